@@ -0,0 +1,10 @@
+#!/usr/bin/env bash
+
+clang -O2 -o sim8086 sim8086.c -lpthread
+
+# The first run records bench_baseline.txt, later runs compare against it
+if [ -f bench_baseline.txt ]; then
+    ./sim8086 -bench -bench-baseline bench_baseline.txt
+else
+    ./sim8086 -bench -bench-save bench_baseline.txt
+fi
@@ -1,12 +1,26 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #define u8  uint8_t 
 #define u16 uint16_t 
 #define u32 uint32_t 
+#define u64 uint64_t 
 #define s8  int8_t 
 #define s16 int16_t 
 #define s32 int32_t 
@@ -17,6 +31,14 @@
 #define LOG(fmt, ...) 
 #endif
 
+#ifndef PROFILER
+#define PROFILER 1
+#endif
+
+#if PROFILER && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
 #define BYTE_TO_BINARY(val)  \
   (val & 0x80 ? '1' : '0'), \
   (val & 0x40 ? '1' : '0'), \
@@ -29,6 +51,148 @@
 
 //printf("data %c%c%c%c%c%c%c%c\n", BYTE_TO_BINARY(data));
 
+u64 ReadOSTimer(void)
+{
+    struct timespec value;
+    clock_gettime(CLOCK_MONOTONIC, &value);
+
+    u64 result = (u64)value.tv_sec * 1000000000ull + value.tv_nsec;
+    return result;
+}
+
+#define OS_TIMER_FREQ 1000000000ull
+
+u64 ReadCPUTimer(void)
+{
+#if PROFILER && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    return ReadOSTimer();
+#endif
+}
+
+u64 EstimateCPUTimerFreq(void)
+{
+    u64 millisecondsToWait = 100;
+    u64 osWaitTime = OS_TIMER_FREQ * millisecondsToWait / 1000;
+
+    u64 cpuStart = ReadCPUTimer();
+    u64 osStart = ReadOSTimer();
+    u64 osEnd = 0;
+    u64 osElapsed = 0;
+    while(osElapsed < osWaitTime)
+    {
+        osEnd = ReadOSTimer();
+        osElapsed = osEnd - osStart;
+    }
+
+    u64 cpuEnd = ReadCPUTimer();
+    u64 cpuElapsed = cpuEnd - cpuStart;
+
+    u64 result = 0;
+    if(osElapsed)
+    {
+        result = OS_TIMER_FREQ * cpuElapsed / osElapsed;
+    }
+
+    return result;
+}
+
+typedef enum ProfilePhase
+{
+    ProfilePhase_Load,
+    ProfilePhase_Decode,
+    ProfilePhase_Execute,
+    ProfilePhase_Print,
+    ProfilePhase_Output,
+
+    ProfilePhase_Count,
+} ProfilePhase;
+
+typedef struct ProfileAnchor
+{
+    u64 elapsed;
+    u64 hitCount;
+    u64 processedByteCount;
+} ProfileAnchor;
+
+// Note: Phases never nest, so each block just adds its own elapsed time.
+// The timer is only read with -stats, otherwise a block costs a branch that
+// always goes the same way. With PROFILER 0 the blocks compile to nothing.
+bool profiling;
+
+#if PROFILER
+static _Thread_local ProfileAnchor profileAnchors[ProfilePhase_Count];
+
+#define TIME_BLOCK_BEGIN(phase) u64 phase##Start = profiling ? ReadCPUTimer() : 0
+#define TIME_BLOCK_END(phase, byteCount) \
+    do \
+    { \
+        if(profiling) \
+        { \
+            profileAnchors[phase].elapsed += ReadCPUTimer() - phase##Start; \
+            profileAnchors[phase].hitCount += 1; \
+            profileAnchors[phase].processedByteCount += (byteCount); \
+        } \
+    } while(0)
+#else
+#define TIME_BLOCK_BEGIN(phase)
+#define TIME_BLOCK_END(phase, byteCount)
+#endif
+
+char* GetProfilePhaseStr(ProfilePhase phase)
+{
+    char* result = 0;
+    switch(phase)
+    {
+    case ProfilePhase_Load: { result = "load"; } break;
+    case ProfilePhase_Decode: { result = "decode"; } break;
+    case ProfilePhase_Execute: { result = "execute"; } break;
+    case ProfilePhase_Print: { result = "print"; } break;
+    case ProfilePhase_Output: { result = "output"; } break;
+    default: break;
+    }
+
+    return result;
+}
+
+#if PROFILER
+void PrintProfile(u64 totalElapsed, u64 instructionCount)
+{
+    u64 cpuFreq = EstimateCPUTimerFreq();
+    double totalSeconds = cpuFreq ? (double)totalElapsed / (double)cpuFreq : 0.0;
+
+    fprintf(stderr, "\nTotal time: %0.4fms (CPU freq %llu)\n", 1000.0 * totalSeconds, (unsigned long long)cpuFreq);
+    for(int phase = 0; phase < ProfilePhase_Count; ++phase)
+    {
+        ProfileAnchor* anchor = profileAnchors + phase;
+        double percent = totalElapsed ? 100.0 * (double)anchor->elapsed / (double)totalElapsed : 0.0;
+        fprintf(stderr, "  %s[%llu]: %llu (%.2f%%)", GetProfilePhaseStr(phase), 
+                (unsigned long long)anchor->hitCount, (unsigned long long)anchor->elapsed, percent);
+
+        if(anchor->processedByteCount && anchor->elapsed && cpuFreq)
+        {
+            double seconds = (double)anchor->elapsed / (double)cpuFreq;
+            double megabytes = (double)anchor->processedByteCount / (1024.0 * 1024.0);
+            fprintf(stderr, "  %.3fmb at %.2fmb/s", megabytes, megabytes / seconds);
+        }
+
+        fprintf(stderr, "\n");
+    }
+
+    if(totalSeconds > 0.0)
+    {
+        fprintf(stderr, "  %llu instructions at %.0f instructions/s\n", 
+                (unsigned long long)instructionCount, (double)instructionCount / totalSeconds);
+    }
+}
+#else
+// Note: Still evaluates the arguments so the caller's counters stay used
+#define PrintProfile(totalElapsed, instructionCount) \
+    ((void)(totalElapsed), (void)(instructionCount), \
+     fprintf(stderr, "\nProfiler is compiled out, rebuild with -DPROFILER=1\n"))
+#endif
+
 typedef enum RegisterCode
 {
     RegisterCode_None,
@@ -51,6 +215,11 @@ typedef enum RegisterCode
     SI,
     DI,
 
+    ES,
+    CS,
+    SS,
+    DS,
+
     BX_SI,
     BX_DI,
     BP_SI, 
@@ -96,6 +265,23 @@ typedef enum InstructionCode
     Loop,
     Jcxz,
 
+    Movs,
+    Cmps,
+    Scas,
+    Lods,
+    Stos,
+
+    Cld,
+    Std,
+
+    Int,
+    Iret,
+    Cli,
+    Sti,
+    Hlt,
+    In,
+    Out,
+
     InstructionCode_Count,
 } InstructionCode;
 
@@ -113,14 +299,28 @@ typedef struct Operand
     OperandCode opCode;
     RegisterCode regCode;
     s16 displacement;
+    RegisterCode segment;
 
     char* literals;
 } Operand;
 
+typedef enum InstructionFlags
+{
+    INST_REP   = 1 << 0,
+    INST_REPNE = 1 << 1,
+    INST_WIDE  = 1 << 2,
+} InstructionFlags;
+
 typedef struct Instruction
 {
     InstructionCode instCode;
     Operand operands[2];
+
+    u8 instFlags;
+
+    // Note: Slot in specializedHandlers the decoder picked, 0 goes through
+    // the generic HandleInstruction
+    u8 handler;
 } Instruction;
 
 typedef enum Flags
@@ -153,8 +353,40 @@ RegisterCode regTable16[8] =
     AX, CX, DX, BX, SP, BP, SI, DI
 };
 
+// Note: Indexed by the sreg field of 8c/8e and bits 3-4 of the segment
+// override prefixes 26/2e/36/3e
+RegisterCode segTable[4] = 
+{
+    ES, CS, SS, DS
+};
+
 RegisterCode* regTable[2] = { regTable8, regTable16 };
 
+// Note: Indexed by the reg field of 80-83 and by bits 3-5 of the first
+// byte of the two operand forms
+InstructionCode groupTable[8] = 
+{
+    Add, Or, Adc, Sbb, And, Sub, Xor, Cmp
+};
+
+// Note: Indexed by the low nibble of 70-7f
+InstructionCode jumpTable[16] = 
+{
+    Jo, Jno, Jb, Jnb, Je, Jne, Jbe, Jnbe, Js, Jns, Jp, Jnp, Jl, Jnl, Jle, Jnle
+};
+
+// Note: Indexed by the low two bits of e0-e3
+InstructionCode loopTable[4] = 
+{
+    Loopne, Loope, Loop, Jcxz
+};
+
+// Note: 1010_xxx_w, a8/a9 are test and do not belong here
+InstructionCode stringTable[8] = 
+{
+    None, None, Movs, Cmps, None, Stos, Lods, Scas
+};
+
 typedef struct Registers
 {
     s16 ax;
@@ -166,19 +398,46 @@ typedef struct Registers
     s16 si;
     s16 di;
 
+    s16 es;
+    s16 cs;
+    s16 ss;
+    s16 ds;
+
     s16 ip;
+
+    // Note: Segment register * 16, indexed from ES
+    u32 segmentBases[4];
 } Registers;
 
-static Registers regs = {};
-static s16 ip = 0;
-static s16 flags;
+#define MEMORY_SIZE (1024 * 1024)
+
+// Note: Machine state is per thread so the self test can simulate several
+// listings at once, each thread allocates its own memory
+static _Thread_local Registers regs = {};
+static _Thread_local s16 ip = 0;
+static _Thread_local s16 flags;
+static _Thread_local u64 clocks;
+static _Thread_local u64 instructionsRetired;
+static _Thread_local bool halted;
+static _Thread_local u8* memory;
+static _Thread_local FILE* output;
 
 typedef struct HandleInstructionResult
 {
+    RegisterCode regCode;
     s16 regBefore;
     s16 regAfter;
 
+    // Note: String instructions also step si and di, the bits are
+    // 1 << (SI - SI) and 1 << (DI - SI) for the ones this one moved
+    u8 indexRegisters;
+    s16 siBefore;
+    s16 siAfter;
+    s16 diBefore;
+    s16 diAfter;
+
     s16 prevFlags;
+    u64 clocks;
 } HandleInstructionResult;
 
 
@@ -205,6 +464,11 @@ char* GetRegCodeStr(RegisterCode code)
     case SI: { result = "si"; } break;
     case DI: { result = "di"; } break;
 
+    case ES: { result = "es"; } break;
+    case CS: { result = "cs"; } break;
+    case SS: { result = "ss"; } break;
+    case DS: { result = "ds"; } break;
+
     case BX_SI: { result = "bx + si"; } break;
     case BX_DI: { result = "bx + di"; } break;
     case BP_SI: { result = "bp + si"; } break;
@@ -230,6 +494,10 @@ s16 *GetRegister(Registers *registers, RegisterCode code)
     case BP: { result = &registers->bp; } break;
     case SI: { result = &registers->si; } break;
     case DI: { result = &registers->di; } break;
+    case ES: { result = &registers->es; } break;
+    case CS: { result = &registers->cs; } break;
+    case SS: { result = &registers->ss; } break;
+    case DS: { result = &registers->ds; } break;
     case IP: { result = &registers->ip; } break;
     default: break;
     }
@@ -237,1208 +505,8749 @@ s16 *GetRegister(Registers *registers, RegisterCode code)
     return result;
 }
 
-char* GetInstructionCodeStr(InstructionCode code)
+u8 *GetRegister8(Registers *registers, RegisterCode code)
 {
-    char* result = 0;
+    u8 *result = 0;
     switch(code)
     {
-    case Mov: { result = "mov"; } break;
-    case Add: { result = "add"; } break;
-    case Or: { result = "or"; } break;
-    case Adc: { result = "adc"; } break;
-    case Sbb: { result = "sbb"; } break;
-    case And: { result = "and"; } break;
-    case Sub: { result = "sub"; } break;
-    case Xor: { result = "xor"; } break;
-    case Cmp: { result = "cmp"; } break;
-
-    case Jo:  { result = "jo"; } break;
-    case Jno: { result = "jno"; } break;
-    case Jb: { result = "jb"; } break;
-    case Jnb: { result = "jnb"; } break;
-    case Je: { result = "je"; } break;
-    case Jne: { result = "jne"; } break;
-    case Jbe: { result = "jbe"; } break;
-    case Jnbe: { result = "jnbe"; } break;
-    case Js: { result = "js"; } break;
-    case Jns: { result = "jns"; } break;
-    case Jp: { result = "jp"; } break;
-    case Jnp: { result = "jnp"; } break;
-    case Jl: { result = "jl"; } break;
-    case Jnl: { result = "jnl"; } break;
-    case Jle: { result = "jle"; } break;
-    case Jnle: { result = "jnle"; } break;
-    case Loopne: { result = "loopne"; } break;
-    case Loope: { result = "loope"; } break;
-    case Loop: { result = "loop"; } break;
-    case Jcxz: { result = "jcxz"; } break;
-
+    case AL: { result = (u8*)&registers->ax; } break;
+    case CL: { result = (u8*)&registers->cx; } break;
+    case DL: { result = (u8*)&registers->dx; } break;
+    case BL: { result = (u8*)&registers->bx; } break;
+    case AH: { result = (u8*)&registers->ax + 1; } break;
+    case CH: { result = (u8*)&registers->cx + 1; } break;
+    case DH: { result = (u8*)&registers->dx + 1; } break;
+    case BH: { result = (u8*)&registers->bx + 1; } break;
     default: break;
     }
 
     return result;
 }
 
-char* GetFlagsStr(Flags flag)
+//
+// Cache model
+//
+
+// Note: Every level is a flat array of sets * ways line tags, each set kept
+// in most recently used order so the last way is the one evicted. Tags are
+// the line number plus one, zero marks an empty way. Accesses are charged to
+// the ip of the instruction making them in per address arrays.
+#define MAX_CACHE_LEVELS 3
+#define CACHE_CODE_SIZE (1 << 16)
+#define DEFAULT_MEMORY_LATENCY 100
+
+typedef struct CacheLevel
 {
-    char* result = 0;
-    switch(flag)
-    {
+    u32 size;
+    u32 lineSize;
+    u32 ways;
+    u32 latency;
 
-    case FLAGS_C: { result = "C"; } break;
-    case FLAGS_P: { result = "P"; } break;
-    case FLAGS_A: { result = "A"; } break;
-    case FLAGS_Z: { result = "Z"; } break;
-    case FLAGS_S: { result = "S"; } break;
-    case FLAGS_T: { result = "T"; } break;
-    case FLAGS_I: { result = "I"; } break;
-    case FLAGS_D: { result = "D"; } break;
-    case FLAGS_O: { result = "O"; } break;
+    u32 lineShift;
+    u32 setMask;
+    u32* tags;
 
-    default: break;
-    }
+    u64 hits;
+    u64 misses;
+    u32* codeMisses;
+} CacheLevel;
+
+typedef struct CacheModel
+{
+    CacheLevel levels[MAX_CACHE_LEVELS];
+    u32 levelCount;
+    u32 memoryLatency;
+
+    u16 accessIp;
+    u64 accesses;
+    u64 clocks;
+    u32* codeAccesses;
+} CacheModel;
+
+static _Thread_local CacheModel* cacheModel;
+
+bool IsPowerOfTwo(u32 value)
+{
+    bool result = value && !(value & (value - 1));
+    return result;
+}
+
+// Note: size:line:ways:latency, size and line in bytes
+bool ParseCacheLevel(char* spec, CacheLevel* level)
+{
+    memset(level, 0, sizeof(*level));
 
+    char* at = spec;
+    level->size = strtoul(at, &at, 0);
+    level->lineSize = *at == ':' ? strtoul(at + 1, &at, 0) : 0;
+    level->ways = *at == ':' ? strtoul(at + 1, &at, 0) : 0;
+    level->latency = *at == ':' ? strtoul(at + 1, &at, 0) : 0;
+
+    bool result = *at == 0 && IsPowerOfTwo(level->lineSize) && level->ways && 
+                  level->size % (level->lineSize * level->ways) == 0 && 
+                  IsPowerOfTwo(level->size / (level->lineSize * level->ways));
     return result;
 }
 
-void UpdateFlags(int val)
+void EnableCacheModel(CacheLevel* levels, u32 levelCount, u32 memoryLatency)
 {
-    bool bitSet = flags & FLAGS_S;
-    if(bitSet)
+    cacheModel = calloc(1, sizeof(CacheModel));
+    cacheModel->levelCount = levelCount;
+    cacheModel->memoryLatency = memoryLatency;
+    cacheModel->codeAccesses = calloc(CACHE_CODE_SIZE, sizeof(u32));
+
+    for(u32 levelIndex = 0; levelIndex < levelCount; ++levelIndex)
     {
-        if(val >= 0)
-        {
-            flags ^= FLAGS_S;
-        }
+        CacheLevel* level = cacheModel->levels + levelIndex;
+        *level = levels[levelIndex];
+
+        u32 sets = level->size / (level->lineSize * level->ways);
+        level->lineShift = __builtin_ctz(level->lineSize);
+        level->setMask = sets - 1;
+        level->tags = calloc(sets * level->ways, sizeof(u32));
+        level->codeMisses = calloc(CACHE_CODE_SIZE, sizeof(u32));
     }
-    else
+}
+
+// Note: Looks the line up level by level, filling every level that missed
+bool CacheAccessLine(u32 address)
+{
+    bool hit = false;
+    u32 clocks = cacheModel->memoryLatency;
+
+    for(u32 levelIndex = 0; levelIndex < cacheModel->levelCount && !hit; ++levelIndex)
     {
-        if(val < 0)
+        CacheLevel* level = cacheModel->levels + levelIndex;
+        u32 line = address >> level->lineShift;
+        u32 tag = line + 1;
+        u32* set = level->tags + (line & level->setMask) * level->ways;
+
+        u32 way = 0;
+        while(way < level->ways - 1 && set[way] != tag)
         {
-            flags ^= FLAGS_S;
+            ++way;
         }
-    }
 
-    bitSet = flags & FLAGS_Z;
-    if(bitSet)
-    {
-        if(val != 0)
+        hit = set[way] == tag;
+        memmove(set + 1, set, way * sizeof(u32));
+        set[0] = tag;
+
+        if(hit)
         {
-            flags ^= FLAGS_Z;
+            ++level->hits;
+            clocks = level->latency;
         }
-    }
-    else
-    {
-        if(val == 0)
+        else
         {
-            flags ^= FLAGS_Z;
+            ++level->misses;
+            ++level->codeMisses[cacheModel->accessIp];
         }
     }
 
-    //int setCount = 0;
-    //for(int index = 0; index < 16; ++index)
-    //{
-    //    if(flags & (1 << index))
-    //    {
-    //        ++setCount;
-    //    }
-    //}
-
-    //bool even = false;
-    //if(setCount > 1)
-    //{
-    //    even = (((int)(float)setCount / 2.0f) == 0);
-    //}
+    cacheModel->clocks += clocks;
+    return hit;
+}
 
-    //printf("setcount %d even %d \n", setCount, even);
-    //bitSet = flags & FLAGS_P;
-    //if(bitSet)
-    //{
-    //    if(!even)
-    //    {
-    //        flags ^= FLAGS_P;
-    //    }
-    //}
-    //else
-    //{
-    //    if(even)
-    //    {
-    //        flags ^= FLAGS_P;
-    //    }
-    //}
+// Note: An access of elementCount elements spread over size bytes. Each
+// line is looked up once and the other elements on it count as first level
+// hits, which is what an element at a time loop would see unless the lines
+// it touches evict each other.
+void CacheAccessRange(u32 address, u32 size, u32 elementCount)
+{
+    u32 lineSize = cacheModel->levelCount ? cacheModel->levels[0].lineSize : 1;
+    u32 first = address & ~(lineSize - 1);
+    u32 lineCount = 0;
+    for(u32 line = first; line < address + size; line += lineSize)
+    {
+        CacheAccessLine(line & (MEMORY_SIZE - 1));
+        ++lineCount;
+    }
 
+    cacheModel->accesses += elementCount;
+    cacheModel->codeAccesses[cacheModel->accessIp] += elementCount;
+    if(elementCount > lineCount && cacheModel->levelCount)
+    {
+        CacheLevel* level = cacheModel->levels;
+        level->hits += elementCount - lineCount;
+        cacheModel->clocks += (u64)(elementCount - lineCount) * level->latency;
+    }
 }
 
-HandleInstructionResult HandleInstruction(Registers *registers, InstructionCode code, Operand leftOperand, Operand rightOperand)
+//
+// Prefetch queue
+//
+
+// Note: The bus interface unit fetches instruction bytes into its queue
+// whenever the execution unit leaves the bus idle, taking BUS_CYCLE_CLOCKS
+// per word on the 8086 and per byte on the 8088. Before an instruction runs
+// all of its bytes have to be in the queue, the clocks spent waiting for
+// them and refilling after taken jumps come on top of the clock tables.
+#define BUS_CYCLE_CLOCKS 4
+
+typedef struct PrefetchQueue
 {
-    HandleInstructionResult result = {};
-    result.prevFlags = flags;
+    u32 queueSize;
+    u32 fetchWidth;
 
-    s16 regBefore = *GetRegister(registers, leftOperand.regCode);
+    u32 queueBytes;
+    u32 fetchClocks;
+    u32 busTransfers;
 
-    s16 *leftReg = GetRegister(registers, leftOperand.regCode);
-    s16 *rightReg = GetRegister(registers, rightOperand.regCode);
+    u64 stallClocks;
+    u64 flushes;
+} PrefetchQueue;
 
-    switch(code)
-    {
+static _Thread_local PrefetchQueue* prefetchQueue;
 
-    case Add:
+bool EnablePrefetchQueue(char* cpu)
+{
+    bool result = true;
+    prefetchQueue = calloc(1, sizeof(PrefetchQueue));
+    if(strcmp(cpu, "8086") == 0)
     {
-        if(rightOperand.opCode == Register)
-        {
-            *leftReg = *leftReg + *rightReg;
-        }
-        else if(rightOperand.opCode == Memory)
-        {
-            *leftReg = *leftReg + *rightReg;
-        }
-        else if(rightOperand.opCode == Immediate)
-        {
-            *leftReg = *leftReg + rightOperand.displacement;
-        }
-    } break;
+        prefetchQueue->queueSize = 6;
+        prefetchQueue->fetchWidth = 2;
+    }
+    else if(strcmp(cpu, "8088") == 0)
+    {
+        prefetchQueue->queueSize = 4;
+        prefetchQueue->fetchWidth = 1;
+    }
+    else
+    {
+        free(prefetchQueue);
+        prefetchQueue = 0;
+        result = false;
+    }
 
-    case Or:
-    case Adc:
-    case Sbb:
-    case And:
-    case Sub:
+    return result;
+}
+
+// Note: A word at an odd address takes two bus cycles on the 8086
+void CountBusTransfers(u32 address, u32 size, u32 elementCount)
+{
+    u32 elementSize = elementCount ? size / elementCount : size;
+    u32 transfers = prefetchQueue->fetchWidth == 1 ? elementSize : (elementSize + (address & 1) + 1) / 2;
+    prefetchQueue->busTransfers += transfers * elementCount;
+}
+
+// Note: Returns the clocks the execution unit waited on the queue
+u32 PrefetchInstruction(u32 length, u64 executeClocks, bool flush)
+{
+    PrefetchQueue* queue = prefetchQueue;
+
+    u32 stall = 0;
+    while(queue->queueBytes < length)
     {
-        if(rightOperand.opCode == Register)
-        {
-            *leftReg = *leftReg - *rightReg;
-        }
-        else if(rightOperand.opCode == Memory)
-        {
-        }
-        else if(rightOperand.opCode == Immediate)
-        {
-            *leftReg = *leftReg - rightOperand.displacement;
-        }
+        stall += BUS_CYCLE_CLOCKS - queue->fetchClocks;
+        queue->fetchClocks = 0;
+        queue->queueBytes += queue->fetchWidth;
+    }
+    queue->queueBytes -= length;
 
-        UpdateFlags(*leftReg);
-    } break;
+    u32 busyClocks = queue->busTransfers * BUS_CYCLE_CLOCKS;
+    u64 idleClocks = executeClocks > busyClocks ? executeClocks - busyClocks : 0;
+    queue->busTransfers = 0;
 
-    case Xor:
-    case Cmp:
+    if(flush)
     {
-        s16 checkVal = 0;
-        if(rightOperand.opCode == Register)
-        {
-            checkVal = *leftReg - *rightReg;
-        }
-        else if(rightOperand.opCode == Memory)
-        {
-        }
-        else if(rightOperand.opCode == Immediate)
+        queue->queueBytes = 0;
+        queue->fetchClocks = 0;
+        ++queue->flushes;
+    }
+    else
+    {
+        u64 available = queue->fetchClocks + idleClocks;
+        while(available >= BUS_CYCLE_CLOCKS && queue->queueBytes + queue->fetchWidth <= queue->queueSize)
         {
-            checkVal = *leftReg - rightOperand.displacement;
+            queue->queueBytes += queue->fetchWidth;
+            available -= BUS_CYCLE_CLOCKS;
         }
 
-        UpdateFlags(checkVal);
-    } break;
+        // Note: A full queue leaves the bus interface unit idle
+        bool full = queue->queueBytes + queue->fetchWidth > queue->queueSize;
+        queue->fetchClocks = full ? 0 : available;
+    }
 
-    case Mov: 
+    queue->stallClocks += stall;
+    return stall;
+}
+
+// Note: Every simulated load and store goes through here so the optional
+// models all see the same accesses
+void NoteMemoryAccess(u32 address, u32 size, u32 elementCount)
+{
+    if(cacheModel)
     {
-        if(rightOperand.opCode == Register)
-        {
-            *leftReg = *rightReg;
-        }
-        else if(rightOperand.opCode == Memory)
-        {
-        }
-        else if(rightOperand.opCode == Immediate)
-        {
-            *leftReg = rightOperand.displacement;
-        }
-    } break;
+        CacheAccessRange(address, size, elementCount);
+    }
 
-    case Jo:
-    case Jno:
-    case Jb: 
-    case Jnb: 
-    case Je: 
-    case Jne: 
+    if(prefetchQueue)
     {
-        bool bitSet = flags & FLAGS_Z;
-        if(!bitSet)
-        {
-            //Note: -2 since at this point to read jump opcode we already read 2 bytes
+        CountBusTransfers(address, size, elementCount);
+    }
+}
+
+u8 ReadMemory8(u32 address)
+{
+    NoteMemoryAccess(address, 1, 1);
+
+    u8 result = memory[address & (MEMORY_SIZE - 1)];
+    return result;
+}
+
+u16 ReadMemory16(u32 address)
+{
+    NoteMemoryAccess(address, 2, 1);
+
+    u16 result = memory[address & (MEMORY_SIZE - 1)] | (memory[(address + 1) & (MEMORY_SIZE - 1)] << 8);
+    return result;
+}
+
+//
+// Undo log
+//
+
+// Note: Every executed instruction pushes its memory byte and register
+// deltas followed by one Undo_Instruction marker holding the cs, ip, flags
+// and clocks from before it and how many deltas precede it. The ring keeps the
+// most recent UNDO_LOG_SIZE entries; full snapshots every
+// UNDO_SNAPSHOT_INTERVAL instructions reach further back than that.
+//
+// Instructions whose outcome came from outside the program, a host int 21h
+// or int 10h service, a delivered hardware interrupt, a port read or a hlt
+// that waited for the next event, also log the registers, ip, flags,
+// clocks and stored bytes they ended with. Replaying from a snapshot applies
+// those instead of running the host service or asking the devices again.
+#define UNDO_LOG_SIZE (1 << 20)
+#define UNDO_SNAPSHOT_INTERVAL (1 << 16)
+#define UNDO_SNAPSHOT_COUNT 8
+
+typedef enum UndoKind
+{
+    Undo_Instruction,
+    Undo_Register,
+    Undo_Memory,
+} UndoKind;
+
+typedef struct UndoEntry
+{
+    u8 kind;
+    u8 regIndex;
+    u16 value;
+    u16 flags;
+    u16 cs;
+    u32 address;
+    u64 clocks;
+} UndoEntry;
+
+typedef struct UndoSnapshot
+{
+    bool valid;
+    u64 instructionIndex;
+
+    Registers regs;
+    s16 ip;
+    s16 flags;
+    u64 clocks;
+    u8* memory;
+} UndoSnapshot;
+
+typedef struct ReplayEvent
+{
+    u64 instructionIndex;
+
+    Registers regs;
+    s16 ip;
+    s16 flags;
+    u64 clocks;
+
+    // Note: Into the byte pool, each one address << 8 | value
+    u64 firstByte;
+    u32 byteCount;
+} ReplayEvent;
+
+typedef struct UndoLog
+{
+    UndoEntry* entries;
+    u64 head;
+    u64 tail;
+    u64 instructionStart;
+    Registers regsBefore;
+    bool external;
+
+    ReplayEvent* events;
+    u64 eventCount;
+    u64 eventCapacity;
+    u32* bytes;
+    u64 byteCount;
+    u64 byteCapacity;
+
+    UndoSnapshot snapshots[UNDO_SNAPSHOT_COUNT];
+    u32 nextSnapshot;
+} UndoLog;
+
+static _Thread_local UndoLog* undoLog;
+
+// Note: Called by whatever hands the program something from outside
+void NoteExternalInput(void)
+{
+    if(undoLog)
+    {
+        undoLog->external = true;
+    }
+}
+
+void PushUndoEntry(UndoEntry entry)
+{
+    if(undoLog->head - undoLog->tail == UNDO_LOG_SIZE)
+    {
+        ++undoLog->tail;
+    }
+
+    undoLog->entries[undoLog->head++ & (UNDO_LOG_SIZE - 1)] = entry;
+}
+
+void UndoRecordMemory(u32 address, u32 size)
+{
+    for(u32 index = 0; index < size; ++index)
+    {
+        UndoEntry entry = {};
+        entry.kind = Undo_Memory;
+        entry.address = (address + index) & (MEMORY_SIZE - 1);
+        entry.value = memory[entry.address];
+        PushUndoEntry(entry);
+    }
+}
+
+// Note: One bit per byte of the address space, so checking a breakpoint or
+// watchpoint is a single bit test no matter how many are set
+#define BITMAP_TEST(bitmap, index) ((bitmap)[(index) >> 3] & (1 << ((index) & 7)))
+#define BITMAP_SET(bitmap, index) ((bitmap)[(index) >> 3] |= (1 << ((index) & 7)))
+
+static u8 breakpointBitmap[MEMORY_SIZE / 8];
+static u8 watchpointBitmap[MEMORY_SIZE / 8];
+static u8 rewindBitmap[MEMORY_SIZE / 8];
+
+// Note: Bytes of blocks the memoizer or the loop accelerator analyzed and
+// of predecoded instructions, a store into one of them throws away the
+// results that cover its page. The page bitmap is checked first, so a store
+// to a page that never held analyzed code costs one bit test
+#define CODE_PAGE_SHIFT 8
+#define CODE_PAGE_SIZE (1 << CODE_PAGE_SHIFT)
+#define CODE_PAGE_COUNT (MEMORY_SIZE >> CODE_PAGE_SHIFT)
+
+static _Thread_local u8* analyzedCodeBitmap;
+static _Thread_local u8 codePageBitmap[CODE_PAGE_COUNT / 8];
+static _Thread_local u8 writtenCodePageBitmap[CODE_PAGE_COUNT / 8];
+static _Thread_local bool analyzedCodeWritten;
+static _Thread_local u64 writtenCodePages;
+
+void EnableAnalyzedCode(void)
+{
+    if(!analyzedCodeBitmap)
+    {
+        analyzedCodeBitmap = calloc(MEMORY_SIZE / 8, 1);
+    }
+}
+
+void MarkAnalyzedCode(u32 address, u32 size)
+{
+    for(u32 offset = 0; offset < size; ++offset)
+    {
+        u32 bit = (address + offset) & (MEMORY_SIZE - 1);
+        BITMAP_SET(analyzedCodeBitmap, bit);
+        BITMAP_SET(codePageBitmap, bit >> CODE_PAGE_SHIFT);
+    }
+}
+
+void NoteCodeWrite(u32 address)
+{
+    if(BITMAP_TEST(analyzedCodeBitmap, address))
+    {
+        BITMAP_SET(writtenCodePageBitmap, address >> CODE_PAGE_SHIFT);
+        analyzedCodeWritten = true;
+    }
+}
+
+static _Thread_local bool watchpointHit;
+static _Thread_local u32 watchpointAddress;
+
+bool IsRangeWatched(u32 address, u32 size)
+{
+    bool result = false;
+    for(u32 index = 0; index < size && !result; ++index)
+    {
+        u32 bit = (address + index) & (MEMORY_SIZE - 1);
+        if(!(bit & 7) && !watchpointBitmap[bit >> 3] && index + 8 <= size)
+        {
+            index += 7;
+            continue;
+        }
+
+        if(BITMAP_TEST(watchpointBitmap, bit))
+        {
+            if(!watchpointHit)
+            {
+                watchpointHit = true;
+                watchpointAddress = bit;
+            }
+            result = true;
+        }
+    }
+
+    return result;
+}
+
+void StoreMemory8(u32 address, u8 value)
+{
+    address &= MEMORY_SIZE - 1;
+    if(BITMAP_TEST(watchpointBitmap, address) && !watchpointHit)
+    {
+        watchpointHit = true;
+        watchpointAddress = address;
+    }
+
+    if(BITMAP_TEST(codePageBitmap, address >> CODE_PAGE_SHIFT))
+    {
+        NoteCodeWrite(address);
+    }
+
+    if(undoLog)
+    {
+        UndoRecordMemory(address, 1);
+    }
+
+    memory[address] = value;
+}
+
+void WriteMemory8(u32 address, u8 value)
+{
+    NoteMemoryAccess(address, 1, 1);
+
+    StoreMemory8(address, value);
+}
+
+// Note: Bulk paths write memory directly, this gives watchpoints, the undo
+// log and the access models the same view of the range an element at a time
+// loop would
+void BeforeBlockWrite(u32 address, u32 size, u32 elementCount)
+{
+    IsRangeWatched(address, size);
+
+    for(u32 index = 0; index < size; ++index)
+    {
+        u32 bit = (address + index) & (MEMORY_SIZE - 1);
+        if(!(bit & (CODE_PAGE_SIZE - 1)) && !BITMAP_TEST(codePageBitmap, bit >> CODE_PAGE_SHIFT) && index + CODE_PAGE_SIZE <= size)
+        {
+            index += CODE_PAGE_SIZE - 1;
+            continue;
+        }
+
+        if(BITMAP_TEST(codePageBitmap, bit >> CODE_PAGE_SHIFT))
+        {
+            NoteCodeWrite(bit);
+        }
+    }
+
+    NoteMemoryAccess(address, size, elementCount);
+
+    if(undoLog)
+    {
+        UndoRecordMemory(address, size);
+    }
+}
+
+void WriteMemory16(u32 address, u16 value)
+{
+    NoteMemoryAccess(address, 2, 1);
+
+    StoreMemory8(address, value & 0xff);
+    StoreMemory8(address + 1, value >> 8);
+}
+
+RegisterCode GetFullRegister(RegisterCode code)
+{
+    RegisterCode result = code;
+    switch(code)
+    {
+    case AL:
+    case AH: { result = AX; } break;
+    case CL:
+    case CH: { result = CX; } break;
+    case DL:
+    case DH: { result = DX; } break;
+    case BL:
+    case BH: { result = BX; } break;
+    default: break;
+    }
+
+    return result;
+}
+
+bool IsSegmentRegister(RegisterCode code)
+{
+    bool result = code >= ES && code <= DS;
+    return result;
+}
+
+u32 GetSegmentBase(Registers *registers, RegisterCode segment)
+{
+    u32 result = registers->segmentBases[segment - ES];
+    return result;
+}
+
+// Note: Bases are cached so a physical address costs one add, they only
+// change when the segment register itself is written
+void UpdateSegmentBase(Registers *registers, RegisterCode segment)
+{
+    registers->segmentBases[segment - ES] = (u32)(u16)*GetRegister(registers, segment) << 4;
+}
+
+// Note: Returns the 20 bit physical address, offsets wrap at 64k inside
+// the segment. Without an override bp based addressing uses ss, everything
+// else ds
+u32 GetEffectiveAddress(Registers *registers, Operand operand)
+{
+    u16 base = 0;
+    switch(operand.regCode)
+    {
+    case BX_SI: { base = registers->bx + registers->si; } break;
+    case BX_DI: { base = registers->bx + registers->di; } break;
+    case BP_SI: { base = registers->bp + registers->si; } break;
+    case BP_DI: { base = registers->bp + registers->di; } break;
+    case BX: { base = registers->bx; } break;
+    case BP: { base = registers->bp; } break;
+    case SI: { base = registers->si; } break;
+    case DI: { base = registers->di; } break;
+    default: break;
+    }
+
+    RegisterCode segment = operand.segment;
+    if(segment == RegisterCode_None)
+    {
+        bool stack = operand.regCode == BP || operand.regCode == BP_SI || operand.regCode == BP_DI;
+        segment = stack ? SS : DS;
+    }
+
+    u32 offset = (u16)(base + operand.displacement);
+    u32 result = (GetSegmentBase(registers, segment) + offset) & (MEMORY_SIZE - 1);
+    return result;
+}
+
+s16 ReadOperand(Registers *registers, Operand operand, bool wide)
+{
+    s16 result = 0;
+    switch(operand.opCode)
+    {
+    case Register:
+    {
+        s16 *reg = GetRegister(registers, operand.regCode);
+        u8 *reg8 = GetRegister8(registers, operand.regCode);
+        if(reg)
+        {
+            result = *reg;
+        }
+        else if(reg8)
+        {
+            result = (s8)*reg8;
+        }
+    } break;
+
+    case Memory:
+    {
+        u32 address = GetEffectiveAddress(registers, operand);
+        result = wide ? (s16)ReadMemory16(address) : (s8)ReadMemory8(address);
+    } break;
+
+    case Immediate:
+    {
+        result = operand.displacement;
+    } break;
+
+    default: break;
+    }
+
+    return result;
+}
+
+void WriteOperand(Registers *registers, Operand operand, bool wide, s16 value)
+{
+    switch(operand.opCode)
+    {
+    case Register:
+    {
+        s16 *reg = GetRegister(registers, operand.regCode);
+        u8 *reg8 = GetRegister8(registers, operand.regCode);
+        if(reg)
+        {
+            *reg = value;
+            if(IsSegmentRegister(operand.regCode))
+            {
+                UpdateSegmentBase(registers, operand.regCode);
+            }
+        }
+        else if(reg8)
+        {
+            *reg8 = value & 0xff;
+        }
+    } break;
+
+    case Memory:
+    {
+        u32 address = GetEffectiveAddress(registers, operand);
+        if(wide)
+        {
+            WriteMemory16(address, value);
+        }
+        else
+        {
+            WriteMemory8(address, value & 0xff);
+        }
+    } break;
+
+    default: break;
+    }
+}
+
+char* GetInstructionCodeStr(InstructionCode code)
+{
+    char* result = 0;
+    switch(code)
+    {
+    case Mov: { result = "mov"; } break;
+    case Add: { result = "add"; } break;
+    case Or: { result = "or"; } break;
+    case Adc: { result = "adc"; } break;
+    case Sbb: { result = "sbb"; } break;
+    case And: { result = "and"; } break;
+    case Sub: { result = "sub"; } break;
+    case Xor: { result = "xor"; } break;
+    case Cmp: { result = "cmp"; } break;
+
+    case Jo:  { result = "jo"; } break;
+    case Jno: { result = "jno"; } break;
+    case Jb: { result = "jb"; } break;
+    case Jnb: { result = "jnb"; } break;
+    case Je: { result = "je"; } break;
+    case Jne: { result = "jne"; } break;
+    case Jbe: { result = "jbe"; } break;
+    case Jnbe: { result = "jnbe"; } break;
+    case Js: { result = "js"; } break;
+    case Jns: { result = "jns"; } break;
+    case Jp: { result = "jp"; } break;
+    case Jnp: { result = "jnp"; } break;
+    case Jl: { result = "jl"; } break;
+    case Jnl: { result = "jnl"; } break;
+    case Jle: { result = "jle"; } break;
+    case Jnle: { result = "jnle"; } break;
+    case Loopne: { result = "loopne"; } break;
+    case Loope: { result = "loope"; } break;
+    case Loop: { result = "loop"; } break;
+    case Jcxz: { result = "jcxz"; } break;
+
+    case Movs: { result = "movs"; } break;
+    case Cmps: { result = "cmps"; } break;
+    case Scas: { result = "scas"; } break;
+    case Lods: { result = "lods"; } break;
+    case Stos: { result = "stos"; } break;
+
+    case Cld: { result = "cld"; } break;
+    case Std: { result = "std"; } break;
+
+    case Int: { result = "int"; } break;
+    case Iret: { result = "iret"; } break;
+    case Cli: { result = "cli"; } break;
+    case Sti: { result = "sti"; } break;
+    case Hlt: { result = "hlt"; } break;
+    case In: { result = "in"; } break;
+    case Out: { result = "out"; } break;
+
+    default: break;
+    }
+
+    return result;
+}
+
+char* GetFlagsStr(Flags flag)
+{
+    char* result = 0;
+    switch(flag)
+    {
+
+    case FLAGS_C: { result = "C"; } break;
+    case FLAGS_P: { result = "P"; } break;
+    case FLAGS_A: { result = "A"; } break;
+    case FLAGS_Z: { result = "Z"; } break;
+    case FLAGS_S: { result = "S"; } break;
+    case FLAGS_T: { result = "T"; } break;
+    case FLAGS_I: { result = "I"; } break;
+    case FLAGS_D: { result = "D"; } break;
+    case FLAGS_O: { result = "O"; } break;
+
+    default: break;
+    }
+
+    return result;
+}
+
+// Note: Sets C, P, A, Z, S and O the way the 8086 leaves them after the
+// arithmetic group. left and right are the operands, carry the borrow or
+// carry that went in and value the result, all sign extended from the
+// operand width. or, and and xor clear C, O and A.
+static inline __attribute__((always_inline))
+void UpdateArithmeticFlags(InstructionCode code, s32 left, s32 right, s32 carry, s32 value, bool wide)
+{
+    u32 mask = wide ? 0xffff : 0xff;
+    u32 sign = wide ? 0x8000 : 0x80;
+    u32 a = left & mask;
+    u32 b = right & mask;
+    u32 r = value & mask;
+
+    s16 result = flags & ~(FLAGS_C | FLAGS_P | FLAGS_A | FLAGS_Z | FLAGS_S | FLAGS_O);
+    switch(code)
+    {
+    case Add:
+    case Adc:
+    {
+        result |= a + b + carry > mask ? FLAGS_C : 0;
+        result |= (a ^ r) & (b ^ r) & sign ? FLAGS_O : 0;
+        result |= (a ^ b ^ r) & 0x10 ? FLAGS_A : 0;
+    } break;
+
+    case Sub:
+    case Sbb:
+    case Cmp:
+    {
+        result |= a < b + carry ? FLAGS_C : 0;
+        result |= (a ^ b) & (a ^ r) & sign ? FLAGS_O : 0;
+        result |= (a ^ b ^ r) & 0x10 ? FLAGS_A : 0;
+    } break;
+
+    default: break;
+    }
+
+    result |= r == 0 ? FLAGS_Z : 0;
+    result |= r & sign ? FLAGS_S : 0;
+    result |= __builtin_parity(r & 0xff) ? 0 : FLAGS_P;
+    flags = result;
+}
+
+bool IsStringInstruction(InstructionCode code)
+{
+    bool result = code >= Movs && code <= Stos;
+    return result;
+}
+
+bool IsBranchInstruction(InstructionCode code)
+{
+    bool result = code >= Jo && code <= Jcxz;
+    return result;
+}
+
+u32 EstimateEffectiveAddressClocks(Operand operand)
+{
+    u32 result = 0;
+    bool displacement = operand.displacement != 0;
+
+    switch(operand.regCode)
+    {
+    case RegisterCode_None: { result = 6; } break;
+
+    case BX:
+    case BP:
+    case SI:
+    case DI: { result = displacement ? 9 : 5; } break;
+
+    case BX_SI:
+    case BP_DI: { result = displacement ? 11 : 7; } break;
+
+    case BX_DI:
+    case BP_SI: { result = displacement ? 12 : 8; } break;
+
+    default: break;
+    }
+
+    if(operand.segment)
+    {
+        result += 2;
+    }
+
+    return result;
+}
+
+// Note: Mov and the arithmetic group, inlined so the specialized handlers
+// get it folded down to their own operand kinds
+static inline __attribute__((always_inline))
+u32 EstimateOperandClocks(InstructionCode code, Operand leftOperand, Operand rightOperand, 
+                          bool leftMemory, bool rightMemory, bool rightImmediate)
+{
+    u32 result = 0;
+
+    // Note: cmp only reads its memory operand, mov only writes it
+    u32 memoryClocks = code == Cmp ? 9 : code == Mov ? 9 : 16;
+    u32 registerClocks = code == Mov ? 2 : 3;
+    u32 fromMemoryClocks = code == Mov ? 8 : 9;
+
+    if(leftMemory)
+    {
+        result = (rightImmediate ? memoryClocks + 1 : memoryClocks) + EstimateEffectiveAddressClocks(leftOperand);
+    }
+    else if(rightMemory)
+    {
+        result = fromMemoryClocks + EstimateEffectiveAddressClocks(rightOperand);
+    }
+    else
+    {
+        result = rightImmediate ? 4 : registerClocks;
+    }
+
+    return result;
+}
+
+// Note: Base timings from the 8086 users manual instruction set reference.
+// Memory operands pay the effective address calculation on top; the odd
+// address word penalty is only modelled for string instructions.
+u32 EstimateClocks(Instruction instruction, bool jumpTaken)
+{
+    u32 result = 0;
+
+    Operand leftOperand = instruction.operands[0];
+    Operand rightOperand = instruction.operands[1];
+
+    switch(instruction.instCode)
+    {
+    case Mov:
+    case Add:
+    case Or:
+    case Adc:
+    case Sbb:
+    case And:
+    case Sub:
+    case Xor:
+    case Cmp:
+    {
+        bool leftMemory = leftOperand.opCode != Register;
+        bool rightMemory = rightOperand.opCode == Memory;
+        bool rightImmediate = rightOperand.opCode == Immediate;
+        result = EstimateOperandClocks(instruction.instCode, leftOperand, rightOperand, 
+                                       leftMemory, rightMemory, rightImmediate);
+    } break;
+
+    case Jo:
+    case Jno:
+    case Jb: 
+    case Jnb: 
+    case Je: 
+    case Jne: 
+    case Jbe: 
+    case Jnbe:
+    case Js: 
+    case Jns:
+    case Jp: 
+    case Jnp:
+    case Jl: 
+    case Jnl:
+    case Jle:
+    case Jnle: { result = jumpTaken ? 16 : 4; } break;
+
+    case Loop: { result = jumpTaken ? 17 : 5; } break;
+    case Loope: { result = jumpTaken ? 18 : 6; } break;
+    case Loopne: { result = jumpTaken ? 19 : 5; } break;
+    case Jcxz: { result = jumpTaken ? 18 : 6; } break;
+
+    case Cld:
+    case Std: { result = 2; } break;
+
+    case Int: { result = 51; } break;
+    case Iret: { result = 24; } break;
+    case Cli:
+    case Sti:
+    case Hlt: { result = 2; } break;
+    case In:
+    case Out: { result = 10; } break;
+
+    default: break;
+    }
+
+    return result;
+}
+
+// Note: Clocks per element for the single and repeated forms, the repeated
+// form also pays REP_STRING_CLOCKS once. Word transfers to odd addresses
+// pay an extra 4 clocks on the 8086 bus for every element.
+#define REP_STRING_CLOCKS 9
+#define ODD_WORD_CLOCKS 4
+
+void CompareStringElement(s16 left, s16 right, bool wide)
+{
+    s16 diff = wide ? (s16)(left - right) : (s8)(left - right);
+    UpdateArithmeticFlags(Cmp, left, right, 0, diff, wide);
+}
+
+HandleInstructionResult HandleStringInstruction(Registers *registers, Instruction instruction)
+{
+    HandleInstructionResult result = {};
+    result.prevFlags = flags;
+
+    InstructionCode code = instruction.instCode;
+    bool rep = instruction.instFlags & (INST_REP | INST_REPNE);
+    bool repne = instruction.instFlags & INST_REPNE;
+    bool wide = instruction.instFlags & INST_WIDE;
+
+    result.regCode = rep ? CX : DI;
+    if(!rep && code == Lods)
+    {
+        result.regCode = AX;
+    }
+    result.regBefore = *GetRegister(registers, result.regCode);
+    result.siBefore = registers->si;
+    result.diBefore = registers->di;
+
+    u16 si = registers->si;
+    u16 di = registers->di;
+    u32 size = wide ? 2 : 1;
+    s32 step = (flags & FLAGS_D) ? -(s32)size : (s32)size;
+    u32 count = rep ? (u16)registers->cx : 1;
+    u32 bytes = count * size;
+
+    // Note: The source segment can be overridden, the destination is
+    // always es
+    RegisterCode sourceSegment = instruction.operands[0].segment ? instruction.operands[0].segment : DS;
+    u32 source = GetSegmentBase(registers, sourceSegment) + si;
+    u32 destination = GetSegmentBase(registers, ES) + di;
+
+    // Note: The bulk paths below must leave memory, flags and the element
+    // count exactly as the element loop would. They only run forward and
+    // when neither SI nor DI wraps around the 64k offset space or the 1MB
+    // address space.
+    bool bulk = step > 0 && si + bytes <= 0x10000 && di + bytes <= 0x10000 && 
+                source + bytes <= MEMORY_SIZE && destination + bytes <= MEMORY_SIZE;
+    u8 *src = memory + source;
+    u8 *dest = memory + destination;
+    u32 done = 0;
+
+    switch(code)
+    {
+    case Movs:
+    {
+        // Note: An element wise forward copy only differs from memmove when
+        // the destination starts inside the source range
+        if(bulk && (destination <= source || destination >= source + bytes))
+        {
+            NoteMemoryAccess(source, bytes, count);
+            BeforeBlockWrite(destination, bytes, count);
+            memmove(dest, src, bytes);
+            done = count;
+        }
+    } break;
+
+    case Stos:
+    {
+        u8 low = registers->ax & 0xff;
+        u8 high = (registers->ax >> 8) & 0xff;
+        if(bulk && (!wide || low == high))
+        {
+            BeforeBlockWrite(destination, bytes, count);
+            memset(dest, low, bytes);
+            done = count;
+        }
+    } break;
+
+    case Lods:
+    {
+        // Note: Only the last element survives in the accumulator
+        if(count)
+        {
+            u32 address = source - si + (u16)(si + (count - 1) * step);
+            if(count > 1)
+            {
+                // Note: Every element but the last one read below
+                u32 lowest = step > 0 ? source : address + size;
+                NoteMemoryAccess(lowest, (count - 1) * size, count - 1);
+            }
+            if(wide)
+            {
+                registers->ax = ReadMemory16(address);
+            }
+            else
+            {
+                *GetRegister8(registers, AL) = ReadMemory8(address);
+            }
+            done = count;
+        }
+    } break;
+
+    case Scas:
+    {
+        if(bulk && rep && !wide && count)
+        {
+            u8 value = registers->ax & 0xff;
+            if(repne)
+            {
+                u8 *found = memchr(dest, value, count);
+                done = found ? (u32)(found - dest) + 1 : count;
+            }
+            else
+            {
+                while(done < count && dest[done] == value)
+                {
+                    ++done;
+                }
+                done = done < count ? done + 1 : count;
+            }
+
+            NoteMemoryAccess(destination, done, done);
+            CompareStringElement(value, dest[done - 1], false);
+        }
+    } break;
+
+    case Cmps:
+    {
+        if(bulk && rep && count)
+        {
+            while(done < count)
+            {
+                bool equal = wide ? 
+                    (src[done * 2] == dest[done * 2] && src[done * 2 + 1] == dest[done * 2 + 1]) : 
+                    src[done] == dest[done];
+                ++done;
+
+                if(equal == repne)
+                {
+                    break;
+                }
+            }
+
+            NoteMemoryAccess(source, done * size, done);
+            NoteMemoryAccess(destination, done * size, done);
+
+            u32 last = (done - 1) * size;
+            s16 left = wide ? (src[last] | (src[last + 1] << 8)) : src[last];
+            s16 right = wide ? (dest[last] | (dest[last + 1] << 8)) : dest[last];
+            CompareStringElement(left, right, wide);
+        }
+    } break;
+
+    default: break;
+    }
+
+    if(!done)
+    {
+        while(done < count)
+        {
+            u32 srcAddress = source - si + (u16)(si + done * step);
+            u32 destAddress = destination - di + (u16)(di + done * step);
+            ++done;
+
+            bool compare = false;
+            switch(code)
+            {
+            case Movs:
+            {
+                if(wide)
+                {
+                    WriteMemory16(destAddress, ReadMemory16(srcAddress));
+                }
+                else
+                {
+                    WriteMemory8(destAddress, ReadMemory8(srcAddress));
+                }
+            } break;
+
+            case Stos:
+            {
+                if(wide)
+                {
+                    WriteMemory16(destAddress, registers->ax);
+                }
+                else
+                {
+                    WriteMemory8(destAddress, registers->ax & 0xff);
+                }
+            } break;
+
+            case Cmps:
+            {
+                s16 left = wide ? ReadMemory16(srcAddress) : ReadMemory8(srcAddress);
+                s16 right = wide ? ReadMemory16(destAddress) : ReadMemory8(destAddress);
+                CompareStringElement(left, right, wide);
+                compare = true;
+            } break;
+
+            case Scas:
+            {
+                s16 left = wide ? registers->ax : (registers->ax & 0xff);
+                s16 right = wide ? ReadMemory16(destAddress) : ReadMemory8(destAddress);
+                CompareStringElement(left, right, wide);
+                compare = true;
+            } break;
+
+            default: break;
+            }
+
+            if(rep && compare)
+            {
+                bool zero = flags & FLAGS_Z;
+                if(zero == repne)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    if(code != Stos && code != Scas)
+    {
+        registers->si = si + done * step;
+        result.siAfter = registers->si;
+        result.indexRegisters |= 1 << (SI - SI);
+    }
+    if(code != Lods)
+    {
+        registers->di = di + done * step;
+        result.diAfter = registers->di;
+        result.indexRegisters |= 1 << (DI - SI);
+    }
+    if(rep)
+    {
+        registers->cx = (u16)registers->cx - done;
+    }
+
+    u32 elementClocks = 0;
+    u32 oddTransfers = 0;
+    switch(code)
+    {
+    case Movs: { elementClocks = rep ? 17 : 18; oddTransfers = (si & 1) + (di & 1); } break;
+    case Cmps: { elementClocks = 22; oddTransfers = (si & 1) + (di & 1); } break;
+    case Scas: { elementClocks = 15; oddTransfers = di & 1; } break;
+    case Lods: { elementClocks = rep ? 13 : 12; oddTransfers = si & 1; } break;
+    case Stos: { elementClocks = rep ? 10 : 11; oddTransfers = di & 1; } break;
+    default: break;
+    }
+
+    if(!wide)
+    {
+        oddTransfers = 0;
+    }
+
+    result.clocks = (rep ? REP_STRING_CLOCKS : 0) + done * (elementClocks + oddTransfers * ODD_WORD_CLOCKS);
+    result.regAfter = *GetRegister(registers, result.regCode);
+
+    return result;
+}
+
+//
+// DOS and BIOS services
+//
+
+// Note: int goes straight to host handlers, interruptTable is indexed by
+// the vector and dosFunctions by ah for int 21h. Failing DOS calls set the
+// carry flag and return the error code in ax. Handles 0-4 are the standard
+// devices, files opened by the program get the ones after them.
+#define DOS_FIRST_FILE 5
+#define DOS_MAX_FILES 32
+
+#define DOS_INVALID_FUNCTION 1
+#define DOS_FILE_NOT_FOUND 2
+#define DOS_TOO_MANY_FILES 4
+#define DOS_INVALID_HANDLE 6
+
+typedef void ServiceHandler(Registers *registers);
+
+static _Thread_local FILE* dosFiles[DOS_MAX_FILES];
+
+u32 GetPhysicalAddress(Registers *registers, RegisterCode segment, u16 offset)
+{
+    u32 result = (GetSegmentBase(registers, segment) + offset) & (MEMORY_SIZE - 1);
+    return result;
+}
+
+void SetServiceResult(Registers *registers, bool failed, u16 value)
+{
+    registers->ax = value;
+    if(failed)
+    {
+        flags |= FLAGS_C;
+    }
+    else
+    {
+        flags &= ~FLAGS_C;
+    }
+}
+
+void ExitProgram(u8 exitCode)
+{
+    halted = true;
+    fprintf(output, "\nProgram exited with code %u\n", exitCode);
+}
+
+void DosTerminate(Registers *registers)
+{
+    // Note: Same signature as the other services, nothing to read
+    (void)registers;
+    ExitProgram(0);
+}
+
+void DosExit(Registers *registers)
+{
+    ExitProgram(registers->ax & 0xff);
+}
+
+void DosWriteChar(Registers *registers)
+{
+    fputc(registers->dx & 0xff, output);
+}
+
+// Note: ds:dx up to a $, a string that wraps all the way around the
+// segment without one ends the run
+void DosWriteString(Registers *registers)
+{
+    u16 offset = registers->dx;
+    for(u32 length = 0; length < 0x10000; ++length, ++offset)
+    {
+        u8 value = ReadMemory8(GetPhysicalAddress(registers, DS, offset));
+        if(value == '$')
+        {
+            return;
+        }
+        fputc(value, output);
+    }
+
+    fprintf(output, "\nint 21h function 09h string at ds:0x%04hx has no $\n", registers->dx);
+    halted = true;
+}
+
+// Note: ds:dx is a zero terminated path on the host, al the access mode
+void DosOpenFile(Registers *registers)
+{
+    char path[256];
+    u32 length = 0;
+    for(u16 offset = registers->dx; length + 1 < sizeof(path); ++offset)
+    {
+        char value = ReadMemory8(GetPhysicalAddress(registers, DS, offset));
+        if(!value)
+        {
+            break;
+        }
+        path[length++] = value;
+    }
+    path[length] = 0;
+
+    int handle = DOS_FIRST_FILE;
+    while(handle < DOS_MAX_FILES && dosFiles[handle])
+    {
+        ++handle;
+    }
+
+    if(handle == DOS_MAX_FILES)
+    {
+        SetServiceResult(registers, true, DOS_TOO_MANY_FILES);
+        return;
+    }
+
+    u8 mode = registers->ax & 0b11;
+    dosFiles[handle] = fopen(path, mode == 0 ? "rb" : "r+b");
+    if(dosFiles[handle])
+    {
+        SetServiceResult(registers, false, handle);
+    }
+    else
+    {
+        SetServiceResult(registers, true, DOS_FILE_NOT_FOUND);
+    }
+}
+
+FILE* GetDosFile(u16 handle)
+{
+    FILE* result = 0;
+    switch(handle)
+    {
+    case 0: { result = stdin; } break;
+    case 1:
+    case 2: { result = output; } break;
+    default:
+    {
+        if(handle < DOS_MAX_FILES)
+        {
+            result = dosFiles[handle];
+        }
+    } break;
+    }
+
+    return result;
+}
+
+void DosCloseFile(Registers *registers)
+{
+    u16 handle = registers->bx;
+    if(handle >= DOS_FIRST_FILE && handle < DOS_MAX_FILES && dosFiles[handle])
+    {
+        fclose(dosFiles[handle]);
+        dosFiles[handle] = 0;
+        SetServiceResult(registers, false, 0);
+    }
+    else
+    {
+        SetServiceResult(registers, true, DOS_INVALID_HANDLE);
+    }
+}
+
+// Note: bx handle, cx bytes, ds:dx buffer, ax gets the bytes transferred.
+// Goes through the memory helpers so watchpoints, undo and the access
+// models see the transfer like any other store
+void DosReadFile(Registers *registers)
+{
+    FILE* file = GetDosFile(registers->bx);
+    if(!file || file == output)
+    {
+        SetServiceResult(registers, true, DOS_INVALID_HANDLE);
+        return;
+    }
+
+    u16 count = registers->cx;
+    u16 done = 0;
+    int value = 0;
+    while(done < count && (value = fgetc(file)) != EOF)
+    {
+        WriteMemory8(GetPhysicalAddress(registers, DS, registers->dx + done), value);
+        ++done;
+    }
+
+    SetServiceResult(registers, false, done);
+}
+
+void DosWriteFile(Registers *registers)
+{
+    FILE* file = GetDosFile(registers->bx);
+    if(!file || file == stdin)
+    {
+        SetServiceResult(registers, true, DOS_INVALID_HANDLE);
+        return;
+    }
+
+    u16 count = registers->cx;
+    for(u16 index = 0; index < count; ++index)
+    {
+        fputc(ReadMemory8(GetPhysicalAddress(registers, DS, registers->dx + index)), file);
+    }
+
+    SetServiceResult(registers, false, count);
+}
+
+ServiceHandler* dosFunctions[256] = 
+{
+    [0x00] = DosTerminate,
+    [0x02] = DosWriteChar,
+    [0x09] = DosWriteString,
+    [0x3d] = DosOpenFile,
+    [0x3e] = DosCloseFile,
+    [0x3f] = DosReadFile,
+    [0x40] = DosWriteFile,
+    [0x4c] = DosExit,
+};
+
+void DosService(Registers *registers)
+{
+    u8 function = (registers->ax >> 8) & 0xff;
+    ServiceHandler* handler = dosFunctions[function];
+    if(handler)
+    {
+        handler(registers);
+    }
+    else
+    {
+        SetServiceResult(registers, true, DOS_INVALID_FUNCTION);
+    }
+}
+
+// Note: Only teletype output, the rest of int 10h is ignored
+void BiosVideoService(Registers *registers)
+{
+    u8 function = (registers->ax >> 8) & 0xff;
+    if(function == 0x0e)
+    {
+        fputc(registers->ax & 0xff, output);
+    }
+}
+
+ServiceHandler* interruptTable[256] = 
+{
+    [0x10] = BiosVideoService,
+    [0x20] = DosTerminate,
+    [0x21] = DosService,
+};
+
+void CloseDosFiles(void)
+{
+    for(int handle = DOS_FIRST_FILE; handle < DOS_MAX_FILES; ++handle)
+    {
+        if(dosFiles[handle])
+        {
+            fclose(dosFiles[handle]);
+            dosFiles[handle] = 0;
+        }
+    }
+}
+
+//
+// Devices and interrupts
+//
+
+// Note: Device events sit in a min-heap keyed by the clock they fire at and
+// the execution loop only compares clocks against nextEventClock, so time
+// between events costs nothing. Due events raise their irq, an irq is
+// delivered between instructions once the interrupt flag allows it, lowest
+// irq first. nextEventClock drops to 0 while something is waiting to be
+// delivered so the next check picks it up. Replays for reverse execution
+// do not see device events.
+#define MAX_EVENTS 64
+#define PIT_CLOCK_DIVIDER 4
+#define IRQ_BASE_VECTOR 8
+#define INTERRUPT_CLOCKS 61
+#define KEYBOARD_PORT 0x60
+
+typedef enum EventKind
+{
+    Event_Timer,
+    Event_Keyboard,
+
+    EventKind_Count,
+} EventKind;
+
+typedef struct Event
+{
+    u64 clock;
+    EventKind kind;
+    u8 data;
+} Event;
+
+typedef struct Scheduler
+{
+    Event events[MAX_EVENTS];
+    u32 eventCount;
+
+    u64 timerPeriod;
+    u8 keyboardData;
+    u8 pendingIrqs;
+
+    u64 delivered;
+    u64 dropped;
+} Scheduler;
+
+static _Thread_local Scheduler* scheduler;
+static _Thread_local u64 nextEventClock = ~0ull;
+
+// Note: Only .COM programs leave the interrupt table at 0000:0000 alone,
+// a raw binary is loaded on top of it
+static _Thread_local bool guestVectors;
+
+bool PushEvent(Event event)
+{
+    bool result = scheduler->eventCount < MAX_EVENTS;
+    if(result)
+    {
+        u32 index = scheduler->eventCount++;
+        while(index)
+        {
+            u32 parent = (index - 1) / 2;
+            if(scheduler->events[parent].clock <= event.clock)
+            {
+                break;
+            }
+            scheduler->events[index] = scheduler->events[parent];
+            index = parent;
+        }
+        scheduler->events[index] = event;
+    }
+
+    return result;
+}
+
+Event PopEvent(void)
+{
+    Event result = scheduler->events[0];
+    Event last = scheduler->events[--scheduler->eventCount];
+
+    u32 index = 0;
+    for(;;)
+    {
+        u32 child = index * 2 + 1;
+        if(child >= scheduler->eventCount)
+        {
+            break;
+        }
+        if(child + 1 < scheduler->eventCount && scheduler->events[child + 1].clock < scheduler->events[child].clock)
+        {
+            ++child;
+        }
+        if(last.clock <= scheduler->events[child].clock)
+        {
+            break;
+        }
+        scheduler->events[index] = scheduler->events[child];
+        index = child;
+    }
+    if(scheduler->eventCount)
+    {
+        scheduler->events[index] = last;
+    }
+
+    return result;
+}
+
+void UpdateNextEventClock(void)
+{
+    bool deliverable = scheduler->pendingIrqs && (flags & FLAGS_I);
+    nextEventClock = deliverable ? 0 : scheduler->eventCount ? scheduler->events[0].clock : ~0ull;
+}
+
+void EnableScheduler(void)
+{
+    if(!scheduler)
+    {
+        scheduler = calloc(1, sizeof(Scheduler));
+    }
+}
+
+// Note: reload 0 counts 65536 like the real counter
+void EnableTimer(u32 reload)
+{
+    EnableScheduler();
+    scheduler->timerPeriod = (u64)(reload ? reload : 0x10000) * PIT_CLOCK_DIVIDER;
+
+    Event event = {};
+    event.clock = scheduler->timerPeriod;
+    event.kind = Event_Timer;
+    PushEvent(event);
+    UpdateNextEventClock();
+}
+
+// Note: clock:scancode
+bool ScheduleKey(char* spec)
+{
+    char* end = 0;
+    Event event = {};
+    event.clock = strtoull(spec, &end, 0);
+    event.kind = Event_Keyboard;
+
+    bool result = *end == ':';
+    if(result)
+    {
+        event.data = strtoul(end + 1, &end, 0);
+        EnableScheduler();
+        result = *end == 0 && PushEvent(event);
+        UpdateNextEventClock();
+    }
+
+    return result;
+}
+
+void PushWord(Registers *registers, u16 value)
+{
+    registers->sp -= 2;
+    WriteMemory16(GetPhysicalAddress(registers, SS, registers->sp), value);
+}
+
+u16 PopWord(Registers *registers)
+{
+    u16 result = ReadMemory16(GetPhysicalAddress(registers, SS, registers->sp));
+    registers->sp += 2;
+    return result;
+}
+
+// Note: A vector the program installed in the table at 0000:0000 is
+// entered like the 8086 does, otherwise the host handler runs in place.
+// Returns false when there is neither.
+bool RaiseInterrupt(Registers *registers, u8 vector)
+{
+    u16 offset = guestVectors ? ReadMemory16(vector * 4) : 0;
+    u16 segment = guestVectors ? ReadMemory16(vector * 4 + 2) : 0;
+
+    bool result = true;
+    if(offset || segment)
+    {
+        PushWord(registers, flags);
+        PushWord(registers, registers->cs);
+        PushWord(registers, ip);
+        flags &= ~(FLAGS_I | FLAGS_T);
+
+        registers->cs = segment;
+        UpdateSegmentBase(registers, CS);
+        ip = offset;
+    }
+    else if(interruptTable[vector])
+    {
+        NoteExternalInput();
+        interruptTable[vector](registers);
+    }
+    else
+    {
+        result = false;
+    }
+
+    return result;
+}
+
+void ReturnFromInterrupt(Registers *registers)
+{
+    ip = PopWord(registers);
+    registers->cs = PopWord(registers);
+    UpdateSegmentBase(registers, CS);
+    flags = PopWord(registers);
+
+    if(scheduler)
+    {
+        UpdateNextEventClock();
+    }
+}
+
+// Note: Raises the irq of every due event, then delivers at most one irq.
+// Returns the vector delivered or -1.
+int ProcessEvents(Registers *registers)
+{
+    while(scheduler->eventCount && scheduler->events[0].clock <= clocks)
+    {
+        Event event = PopEvent();
+        switch(event.kind)
+        {
+        case Event_Timer:
+        {
+            scheduler->pendingIrqs |= 1 << 0;
+            event.clock += scheduler->timerPeriod;
+            PushEvent(event);
+        } break;
+
+        case Event_Keyboard:
+        {
+            scheduler->keyboardData = event.data;
+            scheduler->pendingIrqs |= 1 << 1;
+        } break;
+
+        default: break;
+        }
+    }
+
+    int result = -1;
+    if(scheduler->pendingIrqs && (flags & FLAGS_I))
+    {
+        int irq = __builtin_ctz(scheduler->pendingIrqs);
+        scheduler->pendingIrqs &= ~(1 << irq);
+
+        result = IRQ_BASE_VECTOR + irq;
+        NoteExternalInput();
+        if(RaiseInterrupt(registers, result))
+        {
+            ++scheduler->delivered;
+        }
+        else
+        {
+            ++scheduler->dropped;
+        }
+    }
+
+    UpdateNextEventClock();
+    return result;
+}
+
+u16 ReadPort(u16 port)
+{
+    u16 result = 0xffff;
+    NoteExternalInput();
+    if(port == KEYBOARD_PORT && scheduler)
+    {
+        result = scheduler->keyboardData;
+    }
+
+    return result;
+}
+
+//
+// Branch prediction
+//
+
+// Note: Every conditional jump and loop outcome is fed to all predictors at
+// once. The static one predicts backward branches taken and forward ones not
+// taken, the 2-bit one keeps a saturating counter per branch address and
+// gshare indexes its counters with the address xored with the recent global
+// outcomes. Statistics are plain arrays indexed by the branch address.
+#define BRANCH_CODE_SIZE (1 << 16)
+#define GSHARE_HISTORY_BITS 12
+#define GSHARE_SIZE (1 << GSHARE_HISTORY_BITS)
+
+typedef enum Predictor
+{
+    Predictor_Static,
+    Predictor_Counter,
+    Predictor_Gshare,
+
+    Predictor_Count,
+} Predictor;
+
+typedef struct BranchStats
+{
+    u32 executed[BRANCH_CODE_SIZE];
+    u32 taken[BRANCH_CODE_SIZE];
+    u32 mispredicted[Predictor_Count][BRANCH_CODE_SIZE];
+
+    u8 counters[BRANCH_CODE_SIZE];
+    u8 gshareCounters[GSHARE_SIZE];
+    u32 history;
+
+    u64 totalExecuted;
+    u64 totalTaken;
+    u64 totalMispredicted[Predictor_Count];
+} BranchStats;
+
+static _Thread_local BranchStats* branchStats;
+
+char* GetPredictorStr(Predictor predictor)
+{
+    char* result = 0;
+    switch(predictor)
+    {
+    case Predictor_Static: { result = "static"; } break;
+    case Predictor_Counter: { result = "2-bit"; } break;
+    case Predictor_Gshare: { result = "gshare"; } break;
+    default: break;
+    }
+
+    return result;
+}
+
+// Note: Counters start weakly not taken
+void EnableBranchStats(void)
+{
+    branchStats = calloc(1, sizeof(BranchStats));
+    memset(branchStats->counters, 1, sizeof(branchStats->counters));
+    memset(branchStats->gshareCounters, 1, sizeof(branchStats->gshareCounters));
+}
+
+u8 UpdateCounter(u8 counter, bool taken)
+{
+    u8 result = counter;
+    if(taken && counter < 3)
+    {
+        ++result;
+    }
+    else if(!taken && counter > 0)
+    {
+        --result;
+    }
+
+    return result;
+}
+
+void RecordBranch(u16 address, u16 target, bool taken)
+{
+    BranchStats* stats = branchStats;
+    u32 gshareIndex = (address ^ stats->history) & (GSHARE_SIZE - 1);
+
+    bool predicted[Predictor_Count];
+    predicted[Predictor_Static] = target <= address;
+    predicted[Predictor_Counter] = stats->counters[address] >= 2;
+    predicted[Predictor_Gshare] = stats->gshareCounters[gshareIndex] >= 2;
+
+    for(u32 predictor = 0; predictor < Predictor_Count; ++predictor)
+    {
+        if(predicted[predictor] != taken)
+        {
+            ++stats->mispredicted[predictor][address];
+            ++stats->totalMispredicted[predictor];
+        }
+    }
+
+    stats->counters[address] = UpdateCounter(stats->counters[address], taken);
+    stats->gshareCounters[gshareIndex] = UpdateCounter(stats->gshareCounters[gshareIndex], taken);
+    stats->history = ((stats->history << 1) | taken) & (GSHARE_SIZE - 1);
+
+    ++stats->executed[address];
+    ++stats->totalExecuted;
+    if(taken)
+    {
+        ++stats->taken[address];
+        ++stats->totalTaken;
+    }
+}
+
+//
+// Specialized handlers
+//
+
+// Note: Mov and the arithmetic group get one handler per operation, width
+// and left and right operand kind, all instantiated from HandleSpecialized
+// with the kinds as constants so none of the operand kind or width tests
+// survive. The decoder picks the slot once, HandleInstruction jumps straight
+// to it. Memory to memory has no encoding and no handler.
+typedef HandleInstructionResult SpecializedHandler(Registers *registers, Instruction instruction);
+
+#define SPECIALIZED_INDEX(code, wide, left, right) (((((code) - Mov) * 2 + (wide)) * 2 + (left)) * 3 + (right) + 1)
+#define SPECIALIZED_HANDLER_COUNT SPECIALIZED_INDEX(Cmp, 1, Memory, Immediate) + 1
+
+#define SPECIALIZED_WIDTH_FORMS(X, code, wide) \
+    X(code, wide, Register, Register) \
+    X(code, wide, Register, Memory) \
+    X(code, wide, Register, Immediate) \
+    X(code, wide, Memory, Register) \
+    X(code, wide, Memory, Immediate)
+
+#define SPECIALIZED_FORMS(X, code) \
+    SPECIALIZED_WIDTH_FORMS(X, code, 0) \
+    SPECIALIZED_WIDTH_FORMS(X, code, 1)
+
+#define SPECIALIZED_OPERATIONS(X) \
+    SPECIALIZED_FORMS(X, Mov) \
+    SPECIALIZED_FORMS(X, Add) \
+    SPECIALIZED_FORMS(X, Or) \
+    SPECIALIZED_FORMS(X, Adc) \
+    SPECIALIZED_FORMS(X, Sbb) \
+    SPECIALIZED_FORMS(X, And) \
+    SPECIALIZED_FORMS(X, Sub) \
+    SPECIALIZED_FORMS(X, Xor) \
+    SPECIALIZED_FORMS(X, Cmp)
+
+// Note: Reads and writes happen in the same order as HandleInstruction so
+// the cache model, watchpoints and the undo log see the same accesses
+static inline __attribute__((always_inline))
+HandleInstructionResult HandleSpecialized(Registers *registers, Instruction instruction, 
+                                          InstructionCode code, bool wide, OperandCode left, OperandCode right)
+{
+    Operand leftOperand = instruction.operands[0];
+    Operand rightOperand = instruction.operands[1];
+
+    HandleInstructionResult result = {};
+    result.prevFlags = flags;
+
+    s16 *leftReg = 0;
+    u8 *leftReg8 = 0;
+    u32 leftAddress = 0;
+    if(left == Register)
+    {
+        result.regCode = GetFullRegister(leftOperand.regCode);
+        leftReg = GetRegister(registers, result.regCode);
+        leftReg8 = wide ? 0 : GetRegister8(registers, leftOperand.regCode);
+        result.regBefore = *leftReg;
+    }
+    else
+    {
+        leftAddress = GetEffectiveAddress(registers, leftOperand);
+    }
+
+    s16 leftValue = 0;
+    if(code != Mov)
+    {
+        if(left == Register)
+        {
+            leftValue = wide ? *leftReg : (s8)*leftReg8;
+        }
+        else
+        {
+            leftValue = wide ? (s16)ReadMemory16(leftAddress) : (s8)ReadMemory8(leftAddress);
+        }
+    }
+
+    s16 rightValue = 0;
+    if(right == Register)
+    {
+        rightValue = wide ? *GetRegister(registers, rightOperand.regCode) : (s8)*GetRegister8(registers, rightOperand.regCode);
+    }
+    else if(right == Memory)
+    {
+        u32 rightAddress = GetEffectiveAddress(registers, rightOperand);
+        rightValue = wide ? (s16)ReadMemory16(rightAddress) : (s8)ReadMemory8(rightAddress);
+    }
+    else
+    {
+        rightValue = rightOperand.displacement;
+    }
+
+    s32 carry = (flags & FLAGS_C) ? 1 : 0;
+    s32 value = 0;
+    switch(code)
+    {
+    case Mov: { value = rightValue; } break;
+    case Add: { value = leftValue + rightValue; } break;
+    case Or:  { value = leftValue | rightValue; } break;
+    case Adc: { value = leftValue + rightValue + carry; } break;
+    case Sbb: { value = leftValue - rightValue - carry; } break;
+    case And: { value = leftValue & rightValue; } break;
+    case Sub: 
+    case Cmp: { value = leftValue - rightValue; } break;
+    case Xor: { value = leftValue ^ rightValue; } break;
+    default: break;
+    }
+
+    value = wide ? (s16)value : (s8)value;
+    if(code != Cmp)
+    {
+        if(left == Register && wide)
+        {
+            *leftReg = value;
+            if(code == Mov && IsSegmentRegister(leftOperand.regCode))
+            {
+                UpdateSegmentBase(registers, leftOperand.regCode);
+            }
+        }
+        else if(left == Register)
+        {
+            *leftReg8 = value & 0xff;
+        }
+        else if(wide)
+        {
+            WriteMemory16(leftAddress, value);
+        }
+        else
+        {
+            WriteMemory8(leftAddress, value & 0xff);
+        }
+    }
+
+    if(code != Mov)
+    {
+        UpdateArithmeticFlags(code, leftValue, rightValue, code == Adc || code == Sbb ? carry : 0, value, wide);
+    }
+
+    result.regAfter = leftReg ? *leftReg : 0;
+    result.clocks = EstimateOperandClocks(code, leftOperand, rightOperand, 
+                                          left != Register, right == Memory, right == Immediate);
+
+    return result;
+}
+
+#define DEFINE_SPECIALIZED_HANDLER(code, wide, left, right) \
+    HandleInstructionResult Handle##code##wide##left##right(Registers *registers, Instruction instruction) \
+    { \
+        return HandleSpecialized(registers, instruction, code, wide, left, right); \
+    }
+
+SPECIALIZED_OPERATIONS(DEFINE_SPECIALIZED_HANDLER)
+
+#define SPECIALIZED_TABLE_ENTRY(code, wide, left, right) \
+    [SPECIALIZED_INDEX(code, wide, left, right)] = Handle##code##wide##left##right,
+
+SpecializedHandler* specializedHandlers[SPECIALIZED_HANDLER_COUNT] = 
+{
+    SPECIALIZED_OPERATIONS(SPECIALIZED_TABLE_ENTRY)
+};
+
+u8 SelectSpecializedHandler(Instruction instruction)
+{
+    u8 result = 0;
+
+    InstructionCode code = instruction.instCode;
+    OperandCode left = instruction.operands[0].opCode;
+    OperandCode right = instruction.operands[1].opCode;
+    bool wide = instruction.instFlags & INST_WIDE;
+
+    if(code >= Mov && code <= Cmp && left != Immediate && !(left == Memory && right == Memory))
+    {
+        result = SPECIALIZED_INDEX(code, wide, left, right);
+    }
+
+    return result;
+}
+
+HandleInstructionResult HandleInstruction(Registers *registers, Instruction instruction)
+{
+    if(instruction.handler)
+    {
+        return specializedHandlers[instruction.handler](registers, instruction);
+    }
+
+    InstructionCode code = instruction.instCode;
+    Operand leftOperand = instruction.operands[0];
+    Operand rightOperand = instruction.operands[1];
+
+    if(IsStringInstruction(code))
+    {
+        return HandleStringInstruction(registers, instruction);
+    }
+
+    HandleInstructionResult result = {};
+    result.prevFlags = flags;
+    result.regCode = leftOperand.opCode == Register ? GetFullRegister(leftOperand.regCode) : RegisterCode_None;
+
+    bool wide = instruction.instFlags & INST_WIDE;
+
+    s16 *leftReg = GetRegister(registers, result.regCode);
+    s16 regBefore = leftReg ? *leftReg : 0;
+    bool jumpTaken = false;
+    u64 extraClocks = 0;
+
+    switch(code)
+    {
+
+    case Add:
+    case Or:
+    case Adc:
+    case Sbb:
+    case And:
+    case Sub:
+    case Xor:
+    case Cmp:
+    {
+        s16 left = ReadOperand(registers, leftOperand, wide);
+        s16 right = ReadOperand(registers, rightOperand, wide);
+        s32 carry = (flags & FLAGS_C) ? 1 : 0;
+        s32 value = 0;
+
+        switch(code)
+        {
+        case Add: { value = left + right; } break;
+        case Or:  { value = left | right; } break;
+        case Adc: { value = left + right + carry; } break;
+        case Sbb: { value = left - right - carry; } break;
+        case And: { value = left & right; } break;
+        case Sub: 
+        case Cmp: { value = left - right; } break;
+        case Xor: { value = left ^ right; } break;
+        default: break;
+        }
+
+        value = wide ? (s16)value : (s8)value;
+        if(code != Cmp)
+        {
+            WriteOperand(registers, leftOperand, wide, value);
+        }
+
+        UpdateArithmeticFlags(code, left, right, code == Adc || code == Sbb ? carry : 0, value, wide);
+    } break;
+
+    case Mov: 
+    {
+        s16 value = ReadOperand(registers, rightOperand, wide);
+        WriteOperand(registers, leftOperand, wide, value);
+    } break;
+
+    case Jo:
+    case Jno:
+    case Jb: 
+    case Jnb: 
+    case Je: 
+    case Jne: 
+    case Jbe: 
+    case Jnbe:
+    case Js: 
+    case Jns:
+    case Jp: 
+    case Jnp:
+    case Jl: 
+    case Jnl:
+    case Jle:
+    case Jnle: 
+    case Loopne:
+    case Loope:
+    case Loop:
+    case Jcxz:
+    { 
+        bool carry = flags & FLAGS_C;
+        bool zero = flags & FLAGS_Z;
+        bool sign = flags & FLAGS_S;
+        bool overflow = flags & FLAGS_O;
+        bool parity = flags & FLAGS_P;
+
+        if(code >= Loopne && code <= Loop)
+        {
+            // Note: Loops count cx down before testing it, show that in the trace
+            result.regCode = CX;
+            leftReg = &registers->cx;
+            regBefore = *leftReg;
+            --registers->cx;
+        }
+
+        switch(code)
+        {
+        case Jo: { jumpTaken = overflow; } break;
+        case Jno: { jumpTaken = !overflow; } break;
+        case Jb: { jumpTaken = carry; } break;
+        case Jnb: { jumpTaken = !carry; } break;
+        case Je: { jumpTaken = zero; } break;
+        case Jne: { jumpTaken = !zero; } break;
+        case Jbe: { jumpTaken = carry || zero; } break;
+        case Jnbe: { jumpTaken = !carry && !zero; } break;
+        case Js: { jumpTaken = sign; } break;
+        case Jns: { jumpTaken = !sign; } break;
+        case Jp: { jumpTaken = parity; } break;
+        case Jnp: { jumpTaken = !parity; } break;
+        case Jl: { jumpTaken = sign != overflow; } break;
+        case Jnl: { jumpTaken = sign == overflow; } break;
+        case Jle: { jumpTaken = zero || sign != overflow; } break;
+        case Jnle: { jumpTaken = !zero && sign == overflow; } break;
+        case Loopne: { jumpTaken = registers->cx != 0 && !zero; } break;
+        case Loope: { jumpTaken = registers->cx != 0 && zero; } break;
+        case Loop: { jumpTaken = registers->cx != 0; } break;
+        case Jcxz: { jumpTaken = registers->cx == 0; } break;
+        default: break;
+        }
+
+        // Note: Every branch is 2 bytes and ip is already past it
+        u16 address = ip - 2;
+        if(branchStats)
+        {
+            RecordBranch(address, address + leftOperand.displacement, jumpTaken);
+        }
+
+        if(jumpTaken)
+        {
             ip += leftOperand.displacement - 2;
         }
     } break;
-    case Jbe: 
-    case Jnbe:
-    case Js: 
-    case Jns:
-    case Jp: 
-    case Jnp:
-    case Jl: 
-    case Jnl:
-    case Jle:
-    case Jnle: 
-    case Loopne:
-    case Loope:
-    case Loop:
-    case Jcxz:
-    { 
+
+    case Int:
+    {
+        u8 vector = leftOperand.displacement & 0xff;
+        if(!RaiseInterrupt(registers, vector))
+        {
+            fprintf(output, "\nint %u has no handler\n", vector);
+            halted = true;
+        }
+    } break;
+
+    case Iret:
+    {
+        ReturnFromInterrupt(registers);
+    } break;
+
+    case Cli:
+    {
+        flags &= ~FLAGS_I;
+    } break;
+
+    case Sti:
+    {
+        flags |= FLAGS_I;
+        if(scheduler)
+        {
+            UpdateNextEventClock();
+        }
+    } break;
+
+    case Hlt:
+    {
+        // Note: Waiting for an interrupt skips straight to the next event,
+        // with nothing that could wake it up the program is done
+        if(scheduler && scheduler->eventCount && (flags & FLAGS_I))
+        {
+            u64 wakeClock = scheduler->events[0].clock;
+            NoteExternalInput();
+            extraClocks = wakeClock > clocks ? wakeClock - clocks : 0;
+        }
+        else
+        {
+            fprintf(output, "\nHalted\n");
+            halted = true;
+        }
+    } break;
+
+    case In:
+    {
+        u16 value = ReadPort(rightOperand.displacement & 0xff);
+        WriteOperand(registers, leftOperand, wide, value);
+    } break;
+
+    case Out:
+    {
+        // Note: Nothing listens yet, end of interrupt and friends are ignored
+    } break;
+
+    case Cld:
+    {
+        flags &= ~FLAGS_D;
+    } break;
+
+    case Std:
+    {
+        flags |= FLAGS_D;
+    } break;
+
+    default: break;
+    }
+
+    s16 regAfter = leftReg ? *leftReg : 0;
+
+    result.regBefore = regBefore;
+    result.regAfter = regAfter;
+    result.clocks = EstimateClocks(instruction, jumpTaken) + extraClocks;
+
+    return result;
+}
+
+// Note: nasm wants the override inside the brackets, [es:bx + si]
+char* GetSegmentOverrideStr(Operand operand)
+{
+    char* result = "";
+    switch(operand.segment)
+    {
+    case ES: { result = "es:"; } break;
+    case CS: { result = "cs:"; } break;
+    case SS: { result = "ss:"; } break;
+    case DS: { result = "ds:"; } break;
+    default: break;
+    }
+
+    return result;
+}
+
+void PrintInstruction(Instruction instruction)
+{
+    InstructionCode code = instruction.instCode;
+    Operand leftOperand = instruction.operands[0];
+    Operand rightOperand = instruction.operands[1];
+
+    char* instructionCode = GetInstructionCodeStr(code);
+    char* leftOperandStr = GetRegCodeStr(leftOperand.regCode);
+    char* rightOperandStr = GetRegCodeStr(rightOperand.regCode);
+    char* leftSegmentStr = GetSegmentOverrideStr(leftOperand);
+    char* rightSegmentStr = GetSegmentOverrideStr(rightOperand);
+
+    if(IsStringInstruction(code))
+    {
+        if(leftOperand.segment)
+        {
+            fprintf(output, "%s ", GetRegCodeStr(leftOperand.segment));
+        }
+
+        if(instruction.instFlags & INST_REPNE)
+        {
+            fprintf(output, "repne ");
+        }
+        else if(instruction.instFlags & INST_REP)
+        {
+            bool compare = code == Cmps || code == Scas;
+            fprintf(output, compare ? "repe " : "rep ");
+        }
+
+        fprintf(output, "%s%s", instructionCode, (instruction.instFlags & INST_WIDE) ? "w" : "b");
+    }
+    else
+    {
+        fprintf(output, "%s ", instructionCode);
+    }
+
+    switch(code)
+    {
+
+    case Add:
+    case Or:
+    case Adc:
+    case Sbb:
+    case And:
+    case Sub:
+    case Xor:
+    case Cmp:
+    {
+        if(leftOperand.opCode == Register)
+        {
+            fprintf(output, "%s, ", leftOperandStr);
+        }
+        else if(leftOperand.opCode == Memory)
+        {
+            if(leftOperand.literals)
+            {
+                fprintf(output, "%s ", leftOperand.literals);
+            }
+
+            if(leftOperand.regCode != RegisterCode_None)
+            {
+                fprintf(output, "[%s%s", leftSegmentStr, leftOperandStr);
+
+                if(leftOperand.displacement)
+                {
+                    fprintf(output, " + %d", leftOperand.displacement);
+                }
+
+                fprintf(output, "], ");
+            }
+            else
+            {
+                fprintf(output, "[%s%d], ", leftSegmentStr, leftOperand.displacement);
+            }
+        }
+
+        if(rightOperand.opCode == Register)
+        {
+            fprintf(output, "%s", rightOperandStr);
+        }
+        else if(rightOperand.opCode == Memory)
+        {
+            fprintf(output, "[%s", rightSegmentStr);
+            if(rightOperand.regCode != RegisterCode_None)
+            {
+                char* rightOperandStr = GetRegCodeStr(rightOperand.regCode);
+                fprintf(output, "%s", rightOperandStr);
+
+                if(rightOperand.displacement)
+                {
+                    fprintf(output, " + %d", rightOperand.displacement);
+                }
+            }
+            else
+            {
+                fprintf(output, "%d", rightOperand.displacement);
+            }
+
+            fprintf(output, "]");
+        }
+        else if(rightOperand.opCode == Immediate)
+        {
+            fprintf(output, "%d", rightOperand.displacement);
+        }
+    } break;
+
+    case Mov: 
+    {
+        if(leftOperand.opCode == Register)
+        {
+            fprintf(output, "%s, ", leftOperandStr);
+        }
+        else if(leftOperand.opCode == Memory)
+        {
+            if(leftOperand.regCode != RegisterCode_None)
+            {
+                fprintf(output, "[%s%s", leftSegmentStr, leftOperandStr);
+
+                if(leftOperand.displacement)
+                {
+                    fprintf(output, " + %d", leftOperand.displacement);
+                }
+
+                fprintf(output, "], ");
+            }
+            else
+            {
+                fprintf(output, "[%s%d], ", leftSegmentStr, leftOperand.displacement);
+            }
+        }
+
+        if(rightOperand.opCode == Register)
+        {
+            fprintf(output, "%s", rightOperandStr);
+        }
+        else if(rightOperand.opCode == Memory)
+        {
+            fprintf(output, "[%s", rightSegmentStr);
+            if(rightOperand.regCode != RegisterCode_None)
+            {
+                fprintf(output, "%s", rightOperandStr);
+
+                if(rightOperand.displacement)
+                {
+                    fprintf(output, " + %d", rightOperand.displacement);
+                }
+            }
+            else
+            {
+                fprintf(output, "%d", rightOperand.displacement);
+            }
+
+            fprintf(output, "]");
+        }
+        else if(rightOperand.opCode == Immediate)
+        {
+            if(rightOperand.literals)
+            {
+                fprintf(output, "%s ", rightOperand.literals);
+            }
+            fprintf(output, "%d", rightOperand.displacement);
+        }
+    } break;
+
+    case Jo:
+    case Jno:
+    case Jb: 
+    case Jnb: 
+    case Je: 
+    case Jne: 
+    case Jbe: 
+    case Jnbe:
+    case Js: 
+    case Jns:
+    case Jp: 
+    case Jnp:
+    case Jl: 
+    case Jnl:
+    case Jle:
+    case Jnle: 
+    case Loopne:
+    case Loope:
+    case Loop:
+    case Jcxz:
+    { 
+        fprintf(output, "$+%d", leftOperand.displacement);
+    }
+    break;
+
+    case Int:
+    {
+        fprintf(output, "%d", leftOperand.displacement);
+    } break;
+
+    case In:
+    {
+        fprintf(output, "%s, %d", leftOperandStr, (u8)rightOperand.displacement);
+    } break;
+
+    case Out:
+    {
+        fprintf(output, "%d, %s", (u8)leftOperand.displacement, rightOperandStr);
+    } break;
+
+
+    default: break;
+    }
+}
+
+void PrintRegister(Registers *regs, RegisterCode regCode)
+{
+    s16 reg = *GetRegister(regs, regCode);
+    if(reg)
+    {
+        char *str = GetRegCodeStr(regCode);
+        fprintf(output, "%10s: 0x%04hx (%d)\n", str, reg, (u16)reg);
+    }
+}
+
+Instruction RegRom(InstructionCode instCode, u8 byte1, u8 byte2, u8* buffer, u8 wide, u8 reg, u8 imm)
+{
+    Instruction result = {};
+    result.instCode = instCode;
+    result.instFlags = wide ? INST_WIDE : 0;
+
+    u8 dir = (byte1 >> 1) & 0b1;
+    u8 mod = (byte2 >> 6) & 0b11;
+    u8 rom = (byte2 >> 0) & 0b111;
+
+    char* op = GetInstructionCodeStr(instCode);
+
+    if(imm == 0b1)
+    {
+        s16 data = byte2;
+
+        if(wide)
+        {
+            u8 byte3 = buffer[(u16)ip++];
+            data = (byte3 << 8) | byte2;
+        }
+
+        result.operands[0].opCode = Register;
+        result.operands[0].regCode = regTable[wide][reg];
+        result.operands[1].opCode = Immediate;
+        result.operands[1].displacement = data;
+    }
+    else
+    {
+        if(mod == 0b00)
+        {
+            if(rom == 0b110)
+            {
+                u8 byte3 = buffer[(u16)ip++];
+                u8 byte4 = buffer[(u16)ip++];
+                s16 data = (byte4 << 8) | byte3;
+
+                // Note: Direct address, the register side still follows dir
+                Operand registerOperand = {};
+                registerOperand.opCode = Register;
+                registerOperand.regCode = regTable[wide][reg];
+                Operand memoryOperand = {};
+                memoryOperand.opCode = Memory;
+                memoryOperand.displacement = data;
+
+                result.operands[0] = dir ? registerOperand : memoryOperand;
+                result.operands[1] = dir ? memoryOperand : registerOperand;
+            }
+            else
+            {   
+                if(dir)
+                {
+                    result.operands[0].opCode = Register;
+                    result.operands[0].regCode = regTable[wide][reg];
+                    result.operands[1].opCode = Memory;
+                    result.operands[1].regCode = romTable[rom];
+                }
+                else
+                {
+                    result.operands[0].opCode = Memory;
+                    result.operands[0].regCode = romTable[rom];
+                    result.operands[1].opCode = Register;
+                    result.operands[1].regCode = regTable[wide][reg];
+                }
+            }
+        }
+        else if(mod == 0b01)
+        {
+            s8 data = buffer[(u16)ip++];
+
+            if(dir)
+            {
+                result.operands[0].opCode = Register;
+                result.operands[0].regCode = regTable[wide][reg];
+                result.operands[1].opCode = Memory;
+                result.operands[1].regCode = romTable[rom];
+                result.operands[1].displacement = data;
+            }
+            else
+            {
+                result.operands[0].opCode = Memory;
+                result.operands[0].regCode = romTable[rom];
+                result.operands[0].displacement = data;
+                result.operands[1].opCode = Register;
+                result.operands[1].regCode = regTable[wide][reg];
+            }
+        }
+        else if(mod == 0b10)
+        {
+            u8 byte3 = buffer[(u16)ip++];
+            u8 byte4 = buffer[(u16)ip++];
+            s16 data = (byte4 << 8) | byte3;
+
+            if(dir)
+            {
+                result.operands[0].opCode = Register;
+                result.operands[0].regCode = regTable[wide][reg];
+                result.operands[1].opCode = Memory;
+                result.operands[1].regCode = romTable[rom];
+                result.operands[1].displacement = data;
+            }
+            else
+            {
+                result.operands[0].opCode = Memory;
+                result.operands[0].regCode = romTable[rom];
+                result.operands[0].displacement = data;
+                result.operands[1].opCode = Register;
+                result.operands[1].regCode = regTable[wide][reg];
+            }
+        }
+        else if(mod == 0b11)
+        {
+            u8 src = dir ? reg : rom;
+            u8 dest = dir ? rom : reg;
+
+            result.operands[0].opCode = Register;
+            result.operands[0].regCode = regTable[wide][src];
+            result.operands[1].opCode = Register;
+            result.operands[1].regCode = regTable[wide][dest];
+        }
+    }
+
+    return result;
+}
+
+// Note: The r/m side of a modrm byte, reads whatever displacement mod asks
+// for
+Operand DecodeRomOperand(u8 byte2, u8* buffer, u8 wide)
+{
+    Operand result = {};
+
+    u8 mod = (byte2 >> 6) & 0b11;
+    u8 rom = (byte2 >> 0) & 0b111;
+
+    if(mod == 0b11)
+    {
+        result.opCode = Register;
+        result.regCode = regTable[wide][rom];
+    }
+    else if(mod == 0b00 && rom == 0b110)
+    {
+        u8 byte3 = buffer[(u16)ip++];
+        u8 byte4 = buffer[(u16)ip++];
+
+        result.opCode = Memory;
+        result.displacement = (byte4 << 8) | byte3;
+    }
+    else
+    {
+        result.opCode = Memory;
+        result.regCode = romTable[rom];
+
+        if(mod == 0b01)
+        {
+            result.displacement = (s8)buffer[(u16)ip++];
+        }
+        else if(mod == 0b10)
+        {
+            u8 byte3 = buffer[(u16)ip++];
+            u8 byte4 = buffer[(u16)ip++];
+            result.displacement = (byte4 << 8) | byte3;
+        }
+    }
+
+    return result;
+}
+
+// Note: 80-83 and c6/c7, the immediate follows the displacement. It is 16
+// bits for 81 and c7, 83 sign extends 8 bits to a word and 80/82/c6 take a
+// byte.
+Instruction AddOrAdcSbbAndSubXorCmpMov(InstructionCode instCode, u8 byte1, u8 byte2, u8* buffer)
+{
+    Instruction result = {};
+    result.instCode = instCode;
+
+    u8 wide = (byte1 >> 0) & 0b1;
+    bool mov = instCode == Mov;
+    bool signExtend = byte1 == 0x83;
+
+    result.instFlags = wide ? INST_WIDE : 0;
+    result.operands[0] = DecodeRomOperand(byte2, buffer, wide);
+
+    s16 data = buffer[(u16)ip++];
+    if(signExtend)
+    {
+        data = (s8)data;
+    }
+    else if(wide)
+    {
+        u8 byte4 = buffer[(u16)ip++];
+        data = (byte4 << 8) | (u8)data;
+    }
+
+    result.operands[1].opCode = Immediate;
+    result.operands[1].displacement = data;
+
+    // Note: The size goes on the immediate for mov and on the memory
+    // operand otherwise, a register already has one
+    if(result.operands[0].opCode == Memory)
+    {
+        result.operands[mov ? 1 : 0].literals = wide ? "word" : "byte";
+    }
+
+    return result;
+}
+
+typedef struct DumpRegion
+{
+    char* fileName;
+    u32 start;
+    u32 size;
+
+    u32 width;
+    u32 height;
+} DumpRegion;
+
+#define MAX_DUMP_REGIONS 16
+
+// Note: Accepts "file" for the whole memory or "start:size:file", where
+// size is a byte count or WIDTHxHEIGHT of 4 byte RGBA pixels
+bool ParseDumpRegion(char* spec, DumpRegion* region)
+{
+    DumpRegion result = {};
+    result.fileName = spec;
+    result.size = MEMORY_SIZE;
+
+    char* firstColon = strchr(spec, ':');
+    char* secondColon = firstColon ? strchr(firstColon + 1, ':') : 0;
+    if(firstColon && secondColon)
+    {
+        char* end = 0;
+        result.start = strtoul(spec, &end, 0);
+
+        result.size = strtoul(firstColon + 1, &end, 0);
+        if(*end == 'x')
+        {
+            result.width = result.size;
+            result.height = strtoul(end + 1, &end, 0);
+            result.size = result.width * result.height * 4;
+        }
+
+        result.fileName = secondColon + 1;
+    }
+
+    bool valid = *result.fileName && result.size && 
+                 result.start < MEMORY_SIZE && result.size <= MEMORY_SIZE - result.start;
+    if(valid)
+    {
+        *region = result;
+    }
+
+    return valid;
+}
+
+// Note: The slice is written straight out of the simulated memory, a PAM
+// header (which can carry RGBA as is) goes in front when the file is .pam
+bool DumpMemory(DumpRegion region)
+{
+    char header[128];
+    int headerSize = 0;
+
+    char* extension = strrchr(region.fileName, '.');
+    if(region.width && extension && strcmp(extension, ".pam") == 0)
+    {
+        headerSize = snprintf(header, sizeof(header), 
+                              "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                              region.width, region.height);
+    }
+
+    int file = open(region.fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(file < 0)
+    {
+        return false;
+    }
+
+    struct iovec parts[2] = 
+    {
+        { header, headerSize },
+        { memory + region.start, region.size },
+    };
+
+    int partIndex = headerSize ? 0 : 1;
+    ssize_t expected = headerSize + region.size;
+    ssize_t written = writev(file, parts + partIndex, 2 - partIndex);
+    close(file);
+
+    bool result = written == expected;
+    return result;
+}
+
+Instruction StringInstruction(u8 byte1, u8 prefix)
+{
+    Instruction result = {};
+
+    if((byte1 & 0xf0) == 0xa0)
+    {
+        result.instCode = stringTable[(byte1 >> 1) & 0b111];
+    }
+
+    result.instFlags = prefix;
+    if(byte1 & 0b1)
+    {
+        result.instFlags |= INST_WIDE;
+    }
+
+    return result;
+}
+  
+// Note: ip is signed, bytes are read at it as the 16 bit offset it stands
+// for so code past 32k decodes too
+Instruction DecodeInstruction(u8* buffer)
+{
+    Instruction instruction = {};
+
+    u8 byte1 = buffer[(u16)ip++];
+    u8 byte2 = buffer[(u16)ip++];
+
+    LOG("0x%x\n", byte1);
+    LOG("byte1 %c%c%c%c%c%c%c%c\n", BYTE_TO_BINARY(byte1));
+    LOG("byte2 %c%c%c%c%c%c%c%c\n", BYTE_TO_BINARY(byte2));
+
+    // Note: https://edge.edx.org/c4x/BITSPilani/EEE231/asset/8086_family_Users_Manual_1_.pdf
+    // Intel manual 8086 guide -- Machine Instruction Decoding Guide
+    //
+    // Byte 1     | Byte 2      | Byte 3            | Byte 4            | Byte 5        | Byte 6
+    // OPCODE_D_W | MOD_REG_RM  | LOD DISP / Data   | HI DISP / DATA    | LOW DATA      | HI DATA 
+    // 000000_0_0 | 00_000_000
+    //
+    // MOD :
+    // 00 Memory mode no displacement (When R/M 110 16 bit displacement follows)
+    // 01 Memory mode 8 bit displacement
+    // 10 Memory mode 16 bit displacement
+    // 11 Register mode no displacement
+
+    switch(byte1)
+    {
+    case 0x00:
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x05:
+    case 0x08:
+    case 0x09:
+    case 0x0a:
+    case 0x0b:
+    case 0x0c:
+    case 0x0d:
+    case 0x10:
+    case 0x11:
+    case 0x12:
+    case 0x13:
+    case 0x14:
+    case 0x15:
+    case 0x18:
+    case 0x19:
+    case 0x1a:
+    case 0x1b:
+    case 0x1c:
+    case 0x1d:
+    case 0x20:
+    case 0x21:
+    case 0x22:
+    case 0x23:
+    case 0x24:
+    case 0x25:
+    case 0x28:
+    case 0x29:
+    case 0x2a:
+    case 0x2b:
+    case 0x2c:
+    case 0x2d:
+    case 0x30:
+    case 0x31:
+    case 0x32:
+    case 0x33:
+    case 0x34:
+    case 0x35:
+    case 0x38:
+    case 0x39:
+    case 0x3a:
+    case 0x3b:
+    case 0x3c:
+    case 0x3d:
+    {
+        // Note: Bits 3-5 pick the operation, bit 2 the accumulator and
+        // immediate form
+        u8 wide = (byte1 >> 0) & 0b1;
+        u8 reg = (byte2 >> 3) & 0b111;
+        u8 imm = (byte1 >> 2) & 0b1;
+        if(imm == 0b1)
+        {
+            reg = 0;
+        }
+        instruction = RegRom(groupTable[(byte1 >> 3) & 0b111], byte1, byte2, buffer, wide, reg, imm);
+    } break;
+
+    case 0x70:
+    case 0x71:
+    case 0x72:
+    case 0x73:
+    case 0x74:
+    case 0x75:
+    case 0x76:
+    case 0x77:
+    case 0x78:
+    case 0x79:
+    case 0x7a:
+    case 0x7b:
+    case 0x7c:
+    case 0x7d:
+    case 0x7e:
+    case 0x7f:
+    {
+        instruction.instCode = jumpTable[byte1 & 0b1111];
+        instruction.operands[0].displacement = (s8)byte2 + 2;
+        instruction.operands[0].regCode = IP;
+    } break;
+
+    case 0x80:
+    case 0x81:
+    case 0x82:
+    case 0x83:
+    {
+        u8 instructionCodeIndex = (byte2 >> 3) & 0b111;
+        InstructionCode instructionCode = groupTable[instructionCodeIndex];
+
+        instruction = AddOrAdcSbbAndSubXorCmpMov(instructionCode, byte1, byte2, buffer);
+    }
+    break;
+
+    case 0x88:
+    case 0x89:
+    case 0x8a:
+    case 0x8b:
+    {
+        u8 wide = (byte1 >> 0) & 0b1;
+        u8 reg = (byte2 >> 3) & 0b111;
+        u8 imm = 0;
+        instruction = RegRom(Mov, byte1, byte2, buffer, wide, reg, imm);
+    } break;
+
+    case 0x8c:
+    case 0x8e:
+    {
+        // Note: Always 16 bits, the reg field names a segment register on
+        // the side dir selects
+        u8 dir = (byte1 >> 1) & 0b1;
+        u8 reg = (byte2 >> 3) & 0b111;
+        instruction = RegRom(Mov, byte1 | 0b1, byte2, buffer, 1, reg, 0);
+        instruction.operands[dir ? 0 : 1].regCode = segTable[reg & 0b11];
+    } break;
+
+    case 0x26:
+    case 0x2e:
+    case 0x36:
+    case 0x3e:
+    {
+        // Note: Decodes the instruction after the prefix and attaches the
+        // override to its operands, string instructions keep it on their
+        // first operand. With several prefixes the last one wins.
+        ip--;
+        instruction = DecodeInstruction(buffer);
+        if(!instruction.operands[0].segment)
+        {
+            instruction.operands[0].segment = segTable[(byte1 >> 3) & 0b11];
+            instruction.operands[1].segment = segTable[(byte1 >> 3) & 0b11];
+        }
+    } break;
+
+    case 0xa0:
+    case 0xa1:
+    case 0xa2:
+    case 0xa3:
+    {
+        // Note: The address is 16 bits whatever the width
+        u8 dir = (byte1 >> 1) & 0b1;
+        u8 wide = (byte1 >> 0) & 0b1;
+        u8 reg = 0;
+
+        u8 byte3 = buffer[(u16)ip++];
+        s16 data = (byte3 << 8) | byte2;
+
+        instruction.instCode = Mov;
+        instruction.instFlags = wide ? INST_WIDE : 0;
+
+        if(dir)
+        {
+            instruction.operands[0].opCode = Memory;
+            instruction.operands[0].displacement = data;
+            instruction.operands[1].opCode = Register;
+            instruction.operands[1].regCode = regTable[wide][reg];
+        }
+        else
+        {
+            instruction.operands[0].opCode = Register;
+            instruction.operands[0].regCode = regTable[wide][reg];
+            instruction.operands[1].opCode = Memory;
+            instruction.operands[1].displacement = data;
+        }
+    } break;
+
+    case 0xb0:
+    case 0xb1:
+    case 0xb2:
+    case 0xb3:
+    case 0xb4:
+    case 0xb5:
+    case 0xb6:
+    case 0xb7:
+    case 0xb8:
+    case 0xb9:
+    case 0xba:
+    case 0xbb:
+    case 0xbc:
+    case 0xbd:
+    case 0xbe:
+    case 0xbf:
+    {
+        u8 wide = (byte1 >> 3) & 0b1;
+        u8 reg = (byte1 >> 0) & 0b111;
+        u8 imm = 1;
+        instruction = RegRom(Mov, byte1, byte2, buffer, wide, reg, imm);
+    } break;
+
+    case 0xc6:
+    case 0xc7:
+    {
+        instruction = AddOrAdcSbbAndSubXorCmpMov(Mov, byte1, byte2, buffer);
+    } break;
+
+    case 0xa4:
+    case 0xa5:
+    case 0xa6:
+    case 0xa7:
+    case 0xaa:
+    case 0xab:
+    case 0xac:
+    case 0xad:
+    case 0xae:
+    case 0xaf:
+    {
+        // Note: String instructions are a single byte
+        ip--;
+        instruction = StringInstruction(byte1, 0);
+    } break;
+
+    case 0xf2:
+    case 0xf3:
+    {
+        // Note: Segment overrides may sit between the prefix and the string
+        // opcode, the one closest to the opcode wins like above
+        u8 prefix = byte1 == 0xf2 ? INST_REPNE : INST_REP;
+        RegisterCode segment = RegisterCode_None;
+        while((byte2 & 0b11100111) == 0b00100110)
+        {
+            segment = segTable[(byte2 >> 3) & 0b11];
+            byte2 = buffer[(u16)ip++];
+        }
+
+        instruction = StringInstruction(byte2, prefix);
+        instruction.operands[0].segment = segment;
+        instruction.operands[1].segment = segment;
+    } break;
+
+    case 0xcd:
+    {
+        instruction.instCode = Int;
+        instruction.operands[0].opCode = Immediate;
+        instruction.operands[0].displacement = byte2;
+    } break;
+
+    case 0xcf:
+    case 0xfa:
+    case 0xfb:
+    case 0xf4:
+    {
+        ip--;
+        instruction.instCode = byte1 == 0xcf ? Iret : byte1 == 0xfa ? Cli : byte1 == 0xfb ? Sti : Hlt;
+    } break;
+
+    case 0xe4:
+    case 0xe5:
+    {
+        u8 wide = byte1 & 0b1;
+        instruction.instCode = In;
+        instruction.instFlags = wide ? INST_WIDE : 0;
+        instruction.operands[0].opCode = Register;
+        instruction.operands[0].regCode = wide ? AX : AL;
+        instruction.operands[1].opCode = Immediate;
+        instruction.operands[1].displacement = byte2;
+    } break;
+
+    case 0xe6:
+    case 0xe7:
+    {
+        u8 wide = byte1 & 0b1;
+        instruction.instCode = Out;
+        instruction.instFlags = wide ? INST_WIDE : 0;
+        instruction.operands[0].opCode = Immediate;
+        instruction.operands[0].displacement = byte2;
+        instruction.operands[1].opCode = Register;
+        instruction.operands[1].regCode = wide ? AX : AL;
+    } break;
+
+    case 0xfc:
+    {
+        ip--;
+        instruction.instCode = Cld;
+    } break;
+
+    case 0xfd:
+    {
+        ip--;
+        instruction.instCode = Std;
+    } break;
+
+    case 0xe0:
+    case 0xe1:
+    case 0xe2:
+    case 0xe3:
+    {
+        instruction.instCode = loopTable[byte1 & 0b11];
+        instruction.operands[0].displacement = (s8)byte2 + 2;
+        instruction.operands[0].regCode = IP;
+    } break;
+
+    default: 
+    {
+        fprintf(output, "0x%x unimplemented\n", byte1);
+    } break;
+
+    }
+
+    instruction.handler = SelectSpecializedHandler(instruction);
+
+    return instruction;
+}
+
+//
+// Encoder
+//
+
+int FindRegisterIndex(RegisterCode* table, int count, RegisterCode code)
+{
+    int result = -1;
+    for(int index = 0; index < count; ++index)
+    {
+        if(table[index] == code)
+        {
+            result = index;
+            break;
+        }
+    }
+
+    return result;
+}
+
+int FindInstructionIndex(InstructionCode* table, int count, InstructionCode code)
+{
+    int result = -1;
+    for(int index = 0; index < count; ++index)
+    {
+        if(table[index] == code)
+        {
+            result = index;
+            break;
+        }
+    }
+
+    return result;
+}
+
+u32 EncodeData(u8* out, s16 data, bool wide)
+{
+    out[0] = data & 0xff;
+    if(wide)
+    {
+        out[1] = (data >> 8) & 0xff;
+    }
+
+    u32 result = wide ? 2 : 1;
+    return result;
+}
+
+// Note: Picks the shortest MOD_REG_RM form the way nasm does, so decoding
+// and encoding assembler output gives back the same bytes
+u32 EncodeModRom(u8* out, u8 reg, Operand operand, bool wide)
+{
+    u32 size = 0;
+    reg = (reg & 0b111) << 3;
+
+    if(operand.opCode == Register)
+    {
+        int rom = FindRegisterIndex(regTable[wide], 8, operand.regCode);
+        out[size++] = 0b11000000 | reg | (rom & 0b111);
+    }
+    else if(operand.regCode == RegisterCode_None)
+    {
+        out[size++] = 0b00000110 | reg;
+        size += EncodeData(out + size, operand.displacement, true);
+    }
+    else
+    {
+        int rom = FindRegisterIndex(romTable, 8, operand.regCode) & 0b111;
+        s16 displacement = operand.displacement;
+
+        if(displacement == 0 && rom != 0b110)
+        {
+            out[size++] = 0b00000000 | reg | rom;
+        }
+        else if(displacement == (s8)displacement)
+        {
+            out[size++] = 0b01000000 | reg | rom;
+            size += EncodeData(out + size, displacement, false);
+        }
+        else
+        {
+            out[size++] = 0b10000000 | reg | rom;
+            size += EncodeData(out + size, displacement, true);
+        }
+    }
+
+    return size;
+}
+
+// Note: Reverse of DecodeInstruction using the same tables, returns the
+// number of bytes written to out (at most 6) or 0 when the instruction has
+// no encoding
+u32 EncodeInstruction(Instruction instruction, u8* out)
+{
+    u32 size = 0;
+
+    InstructionCode code = instruction.instCode;
+    Operand leftOperand = instruction.operands[0];
+    Operand rightOperand = instruction.operands[1];
+    bool wide = instruction.instFlags & INST_WIDE;
+
+    bool leftAccumulator = leftOperand.opCode == Register && (leftOperand.regCode == AL || leftOperand.regCode == AX);
+    bool rightAccumulator = rightOperand.opCode == Register && (rightOperand.regCode == AL || rightOperand.regCode == AX);
+    bool leftDirect = leftOperand.opCode == Memory && leftOperand.regCode == RegisterCode_None;
+    bool rightDirect = rightOperand.opCode == Memory && rightOperand.regCode == RegisterCode_None;
+
+    int groupIndex = FindInstructionIndex(groupTable, 8, code);
+    int jumpIndex = FindInstructionIndex(jumpTable, 16, code);
+    int loopIndex = FindInstructionIndex(loopTable, 4, code);
+    int stringIndex = code != None ? FindInstructionIndex(stringTable, 8, code) : -1;
+
+    RegisterCode segment = leftOperand.segment;
+    if(segment != RegisterCode_None)
+    {
+        out[size++] = 0x26 | (FindRegisterIndex(segTable, 4, segment) << 3);
+    }
+
+    bool leftSegment = leftOperand.opCode == Register && IsSegmentRegister(leftOperand.regCode);
+    bool rightSegment = rightOperand.opCode == Register && IsSegmentRegister(rightOperand.regCode);
+
+    if(code == Mov && (leftSegment || rightSegment))
+    {
+        int reg = FindRegisterIndex(segTable, 4, leftSegment ? leftOperand.regCode : rightOperand.regCode);
+        out[size++] = leftSegment ? 0x8e : 0x8c;
+        size += EncodeModRom(out + size, reg, leftSegment ? rightOperand : leftOperand, true);
+    }
+    else if(code == Mov)
+    {
+        if(leftOperand.opCode == Register && rightOperand.opCode == Immediate)
+        {
+            int reg = FindRegisterIndex(regTable[wide], 8, leftOperand.regCode);
+            out[size++] = 0xb0 | (wide << 3) | (reg & 0b111);
+            size += EncodeData(out + size, rightOperand.displacement, wide);
+        }
+        else if(rightOperand.opCode == Immediate)
+        {
+            out[size++] = 0xc6 | wide;
+            size += EncodeModRom(out + size, 0, leftOperand, wide);
+            size += EncodeData(out + size, rightOperand.displacement, wide);
+        }
+        else if(leftAccumulator && rightDirect)
+        {
+            out[size++] = 0xa0 | wide;
+            size += EncodeData(out + size, rightOperand.displacement, true);
+        }
+        else if(leftDirect && rightAccumulator)
+        {
+            out[size++] = 0xa2 | wide;
+            size += EncodeData(out + size, leftOperand.displacement, true);
+        }
+        else if(rightOperand.opCode == Register)
+        {
+            int reg = FindRegisterIndex(regTable[wide], 8, rightOperand.regCode);
+            out[size++] = 0x88 | wide;
+            size += EncodeModRom(out + size, reg, leftOperand, wide);
+        }
+        else
+        {
+            int reg = FindRegisterIndex(regTable[wide], 8, leftOperand.regCode);
+            out[size++] = 0x8a | wide;
+            size += EncodeModRom(out + size, reg, rightOperand, wide);
+        }
+    }
+    else if(groupIndex >= 0)
+    {
+        u8 base = groupIndex << 3;
+        if(rightOperand.opCode == Immediate)
+        {
+            s16 data = rightOperand.displacement;
+            bool signExtend = wide && data == (s8)data;
+
+            if(leftAccumulator && !signExtend)
+            {
+                out[size++] = base | 0b100 | wide;
+                size += EncodeData(out + size, data, wide);
+            }
+            else
+            {
+                out[size++] = 0x80 | (signExtend ? 0b11 : wide);
+                size += EncodeModRom(out + size, groupIndex, leftOperand, wide);
+                size += EncodeData(out + size, data, wide && !signExtend);
+            }
+        }
+        else if(rightOperand.opCode == Register)
+        {
+            int reg = FindRegisterIndex(regTable[wide], 8, rightOperand.regCode);
+            out[size++] = base | wide;
+            size += EncodeModRom(out + size, reg, leftOperand, wide);
+        }
+        else
+        {
+            int reg = FindRegisterIndex(regTable[wide], 8, leftOperand.regCode);
+            out[size++] = base | 0b10 | wide;
+            size += EncodeModRom(out + size, reg, rightOperand, wide);
+        }
+    }
+    else if(jumpIndex >= 0 || loopIndex >= 0)
+    {
+        out[size++] = jumpIndex >= 0 ? (0x70 | jumpIndex) : (0xe0 | loopIndex);
+        size += EncodeData(out + size, leftOperand.displacement - 2, false);
+    }
+    else if(stringIndex >= 0)
+    {
+        if(instruction.instFlags & INST_REPNE)
+        {
+            out[size++] = 0xf2;
+        }
+        else if(instruction.instFlags & INST_REP)
+        {
+            out[size++] = 0xf3;
+        }
+
+        out[size++] = 0xa0 | (stringIndex << 1) | wide;
+    }
+    else if(code == Int)
+    {
+        out[size++] = 0xcd;
+        out[size++] = leftOperand.displacement & 0xff;
+    }
+    else if(code == In)
+    {
+        out[size++] = 0xe4 | wide;
+        out[size++] = rightOperand.displacement & 0xff;
+    }
+    else if(code == Out)
+    {
+        out[size++] = 0xe6 | wide;
+        out[size++] = leftOperand.displacement & 0xff;
+    }
+    else if(code == Iret || code == Cli || code == Sti || code == Hlt)
+    {
+        out[size++] = code == Iret ? 0xcf : code == Cli ? 0xfa : code == Sti ? 0xfb : 0xf4;
+    }
+    else if(code == Cld)
+    {
+        out[size++] = 0xfc;
+    }
+    else if(code == Std)
+    {
+        out[size++] = 0xfd;
+    }
+
+    return size;
+}
+
+typedef struct RoundTripResult
+{
+    u64 instructionCount;
+    u64 mismatchCount;
+    u32 firstMismatch;
+} RoundTripResult;
+
+// Note: Decodes image one instruction at a time, encodes each one again and
+// compares the bytes in place. Stops after maxMismatches, printing each one
+// to output when printMismatches is set. The image needs a few bytes of
+// padding since the decoder always reads two bytes.
+RoundTripResult VerifyRoundTrip(u8* image, u32 imageSize, u64 maxMismatches, bool printMismatches)
+{
+    RoundTripResult result = {};
+    result.firstMismatch = imageSize;
+
+    u32 offset = 0;
+    while(offset < imageSize && result.mismatchCount < maxMismatches)
+    {
+        u8* at = image + offset;
+
+        ip = 0;
+        Instruction instruction = DecodeInstruction(at);
+        u32 length = (u16)ip;
+
+        u8 encoded[16];
+        u32 encodedSize = EncodeInstruction(instruction, encoded);
+        ++result.instructionCount;
+
+        if(encodedSize != length || memcmp(encoded, at, length) != 0)
+        {
+            if(!result.mismatchCount)
+            {
+                result.firstMismatch = offset;
+            }
+            ++result.mismatchCount;
+
+            if(printMismatches)
+            {
+                fprintf(output, "0x%08x: ", offset);
+                if(instruction.instCode != None)
+                {
+                    PrintInstruction(instruction);
+                }
+                else
+                {
+                    fprintf(output, "unknown");
+                }
+                fprintf(output, " ;");
+                for(u32 index = 0; index < length; ++index)
+                {
+                    fprintf(output, " %02x", at[index]);
+                }
+                fprintf(output, " ->");
+                for(u32 index = 0; index < encodedSize; ++index)
+                {
+                    fprintf(output, " %02x", encoded[index]);
+                }
+                fprintf(output, "\n");
+            }
+        }
+
+        offset += length;
+    }
+
+    ip = 0;
+    return result;
+}
+
+//
+// Decoded program
+//
+
+// Note: The decoder cursor is 16 bits, so code never spans more than 64k
+#define CODE_SIZE (1 << 16)
+
+// Note: Carves allocations out of one block, nothing is freed on its own and
+// the whole block goes with a single free
+typedef struct Arena
+{
+    u8* base;
+    u64 size;
+    u64 used;
+} Arena;
+
+bool InitArena(Arena* arena, u64 size)
+{
+    arena->base = calloc(size, 1);
+    arena->size = arena->base ? size : 0;
+    arena->used = 0;
+
+    bool result = arena->base != 0;
+    return result;
+}
+
+void* PushArena(Arena* arena, u64 size)
+{
+    void* result = 0;
+
+    u64 start = (arena->used + 15) & ~15ull;
+    if(start + size <= arena->size)
+    {
+        result = arena->base + start;
+        arena->used = start + size;
+    }
+
+    return result;
+}
+
+void FreeArena(Arena* arena)
+{
+    free(arena->base);
+    arena->base = 0;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+// Note: Every instruction of a 64k code image decoded once into a contiguous
+// array, indexAt maps a code offset to its record + 1 so finding the
+// instruction at any address is one load. An offset holds at most one
+// record, so the array never needs to grow. Offsets no record starts at are
+// decoded on first use, which covers jumps into the middle of an instruction
+// too; unknown opcodes are never stored so the decoder still reports them.
+typedef struct DecodedInstruction
+{
+    Instruction instruction;
+    u16 address;
+    u8 size;
+} DecodedInstruction;
+
+typedef struct DecodedProgram
+{
+    Arena arena;
+    u8* code;
+    u32 base;
+
+    u32* indexAt;
+    DecodedInstruction* records;
+    u32 recordCount;
+
+    FILE* decodeOutput;
+    u64 dropped;
+} DecodedProgram;
+
+static _Thread_local DecodedProgram* decodedProgram;
+
+DecodedProgram* CreateDecodedProgram(u8* code, u32 base)
+{
+    DecodedProgram* program = calloc(1, sizeof(DecodedProgram));
+    program->code = code;
+    program->base = base;
+    program->decodeOutput = fopen("/dev/null", "w");
+
+    InitArena(&program->arena, CODE_SIZE * (sizeof(u32) + sizeof(DecodedInstruction)) + 32);
+    program->indexAt = PushArena(&program->arena, CODE_SIZE * sizeof(u32));
+    program->records = PushArena(&program->arena, CODE_SIZE * sizeof(DecodedInstruction));
+
+    return program;
+}
+
+void FreeDecodedProgram(DecodedProgram* program)
+{
+    fclose(program->decodeOutput);
+    FreeArena(&program->arena);
+    free(program);
+}
+
+// Note: Safe to call from several threads as long as each address is added
+// by only one of them, lookups have to wait until they are all done
+DecodedInstruction* AddDecodedInstruction(DecodedProgram* program, u16 address, Instruction instruction, u32 size)
+{
+    u32 recordIndex = __atomic_fetch_add(&program->recordCount, 1, __ATOMIC_RELAXED);
+
+    DecodedInstruction* result = program->records + recordIndex;
+    result->instruction = instruction;
+    result->address = address;
+    result->size = size;
+    __atomic_store_n(program->indexAt + address, recordIndex + 1, __ATOMIC_RELEASE);
+
+    if(analyzedCodeBitmap)
+    {
+        MarkAnalyzedCode(program->base + address, size);
+    }
+
+    return result;
+}
+
+// Note: Returns 0 for an opcode the decoder doesn't know
+DecodedInstruction* GetDecodedInstruction(DecodedProgram* program, u16 address)
+{
+    u32 recordIndex = program->indexAt[address];
+    DecodedInstruction* result = recordIndex ? program->records + recordIndex - 1 : 0;
+
+    if(!result)
+    {
+        s16 savedIp = ip;
+        FILE* savedOutput = output;
+        ip = address;
+        output = program->decodeOutput;
+
+        Instruction instruction = DecodeInstruction(program->code);
+        u32 size = (u16)(ip - address);
+
+        ip = savedIp;
+        output = savedOutput;
+
+        if(instruction.instCode != None)
+        {
+            result = AddDecodedInstruction(program, address, instruction, size);
+        }
+    }
+
+    return result;
+}
+
+// Note: Everything decodes again on demand
+void ForgetDecodedProgram(DecodedProgram* program)
+{
+    for(u32 recordIndex = 0; recordIndex < program->recordCount; ++recordIndex)
+    {
+        program->indexAt[program->records[recordIndex].address] = 0;
+    }
+
+    program->recordCount = 0;
+}
+
+// Note: Called once code in the page was written. Only the index entries
+// go, the records stay in the arena until it fills up and is reset. A
+// record starts at most 255 bytes before the page, its size is a u8
+void ForgetDecodedPage(DecodedProgram* program, u32 page)
+{
+    u32 pageStart = page << CODE_PAGE_SHIFT;
+    for(s32 offset = -255; offset < CODE_PAGE_SIZE; ++offset)
+    {
+        u32 address = (pageStart + offset - program->base) & (MEMORY_SIZE - 1);
+        u32 recordIndex = address < CODE_SIZE ? program->indexAt[address] : 0;
+        if(recordIndex && offset + program->records[recordIndex - 1].size > 0)
+        {
+            program->indexAt[address] = 0;
+            ++program->dropped;
+        }
+    }
+}
+
+// Note: Decodes the code segment the run starts in up front, from the entry
+// to the end of the program
+void EnableDecodedProgram(u32 programSize)
+{
+    EnableAnalyzedCode();
+
+    u32 base = GetSegmentBase(&regs, CS);
+    decodedProgram = CreateDecodedProgram(memory + base, base);
+
+    s16 savedIp = ip;
+    FILE* savedOutput = output;
+    output = decodedProgram->decodeOutput;
+
+    u32 address = (u16)ip;
+    while(address < programSize && address < CODE_SIZE)
+    {
+        ip = address;
+        Instruction instruction = DecodeInstruction(decodedProgram->code);
+        u32 size = (u16)(ip - address);
+        if(instruction.instCode != None)
+        {
+            AddDecodedInstruction(decodedProgram, address, instruction, size);
+        }
+
+        address += size;
+    }
+
+    ip = savedIp;
+    output = savedOutput;
+}
+
+// Note: Decodes the instruction at cs:ip and moves ip past it, from the
+// decoded program when it covers the current code segment. A miss decodes
+// in place and keeps the result, unknown opcodes are reported every time.
+// Records dropped by code writes still take their slot, a full arena starts
+// over
+Instruction FetchInstruction(void)
+{
+    Instruction result;
+
+    u32 codeBase = GetSegmentBase(&regs, CS);
+    u32 recordIndex = 0;
+    if(decodedProgram && codeBase == decodedProgram->base)
+    {
+        recordIndex = decodedProgram->indexAt[(u16)ip];
+    }
+
+    if(recordIndex)
+    {
+        DecodedInstruction* decoded = decodedProgram->records + recordIndex - 1;
+        result = decoded->instruction;
+        ip += decoded->size;
+    }
+    else
+    {
+        u16 address = ip;
+        result = DecodeInstruction(memory + codeBase);
+        if(decodedProgram && codeBase == decodedProgram->base && result.instCode != None)
+        {
+            if(decodedProgram->recordCount == CODE_SIZE)
+            {
+                ForgetDecodedProgram(decodedProgram);
+            }
+            AddDecodedInstruction(decodedProgram, address, result, (u16)(ip - address));
+        }
+    }
+
+    return result;
+}
+
+//
+// Recursive descent disassembly
+//
+
+typedef struct BasicBlock
+{
+    u16 start;
+    u16 end;
+
+    u16 successors[2];
+    u8 successorCount;
+} BasicBlock;
+
+// Note: Addresses are queued once, guarded by the queued bitmap, so the
+// address array can never overflow. Instruction starts are claimed with an
+// atomic or, whichever worker gets there first decodes the instruction and
+// the others stop following that path
+typedef struct CodeQueue
+{
+    u8 queued[CODE_SIZE / 8];
+    u8 instructionStarts[CODE_SIZE / 8];
+    u8 jumpTargets[CODE_SIZE / 8];
+    u8 exits[CODE_SIZE / 8];
+
+    u16 addresses[CODE_SIZE];
+    u32 count;
+    u32 next;
+    u32 busy;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+
+    u8* image;
+    u32 programSize;
+    FILE* decodeOutput;
+    DecodedProgram* program;
+} CodeQueue;
+
+void PushCodeAddress(CodeQueue* queue, u16 address)
+{
+    pthread_mutex_lock(&queue->mutex);
+    if(!BITMAP_TEST(queue->queued, address))
+    {
+        BITMAP_SET(queue->queued, address);
+        queue->addresses[queue->count++] = address;
+        pthread_cond_signal(&queue->wake);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+bool ClaimInstructionStart(CodeQueue* queue, u16 address)
+{
+    u8 bit = 1 << (address & 7);
+    u8 before = __atomic_fetch_or(&queue->instructionStarts[address >> 3], bit, __ATOMIC_RELAXED);
+    bool result = !(before & bit);
+    return result;
+}
+
+// Note: Int 21h only exits for the terminate functions, so the path keeps
+// the value of ah from immediate movs and forgets it on anything else that
+// writes ax. -1 is unknown, which keeps decoding after the int.
+bool IsExitInstruction(Instruction instruction, s32 knownAh)
+{
+    bool result = false;
+    switch(instruction.instCode)
+    {
+    case Hlt:
+    case Iret: { result = true; } break;
+
+    case Int:
+    {
+        u16 vector = instruction.operands[0].displacement & 0xff;
+        result = vector == 0x20 || (vector == 0x21 && (knownAh == 0x00 || knownAh == 0x4c));
+    } break;
+
+    default: break;
+    }
+
+    return result;
+}
+
+s32 TrackAh(Instruction instruction, s32 knownAh)
+{
+    s32 result = knownAh;
+    Operand destination = instruction.operands[0];
+    if(instruction.instCode == Int || instruction.instCode == Lods)
+    {
+        result = -1;
+    }
+    else if(destination.opCode == Register && 
+            (destination.regCode == AX || destination.regCode == AH || destination.regCode == AL) && 
+            instruction.instCode != Cmp && instruction.instCode != Out)
+    {
+        result = -1;
+        Operand source = instruction.operands[1];
+        if(instruction.instCode == Mov && source.opCode == Immediate && destination.regCode != AL)
+        {
+            result = destination.regCode == AX ? (source.displacement >> 8) & 0xff : source.displacement & 0xff;
+        }
+    }
+
+    return result;
+}
+
+// Note: Follows one path until it reaches code another worker already
+// decoded, leaves the program, hits an opcode the decoder doesn't know or
+// an instruction that stops the program or returns from an interrupt.
+// Branches are conditional so decoding falls through, the taken side is
+// handed to the queue
+void TraceCodePath(CodeQueue* queue, u16 address)
+{
+    s32 knownAh = -1;
+    while(address < queue->programSize && ClaimInstructionStart(queue, address))
+    {
+        ip = address;
+        Instruction instruction = DecodeInstruction(memory);
+        if(instruction.instCode == None)
+        {
+            __atomic_fetch_and(&queue->instructionStarts[address >> 3], ~(1 << (address & 7)), __ATOMIC_RELAXED);
+            break;
+        }
+
+        AddDecodedInstruction(queue->program, address, instruction, (u16)(ip - address));
+
+        if(IsBranchInstruction(instruction.instCode))
+        {
+            u16 target = address + instruction.operands[0].displacement;
+            __atomic_fetch_or(&queue->jumpTargets[target >> 3], 1 << (target & 7), __ATOMIC_RELAXED);
+            if(target < queue->programSize)
+            {
+                PushCodeAddress(queue, target);
+            }
+        }
+
+        if(IsExitInstruction(instruction, knownAh))
+        {
+            __atomic_fetch_or(&queue->exits[address >> 3], 1 << (address & 7), __ATOMIC_RELAXED);
+            break;
+        }
+        knownAh = TrackAh(instruction, knownAh);
+
+        address = ip;
+    }
+}
+
+void* CodeWorker(void* param)
+{
+    CodeQueue* queue = param;
+    memory = queue->image;
+    output = queue->decodeOutput;
+
+    pthread_mutex_lock(&queue->mutex);
+    for(;;)
+    {
+        if(queue->next < queue->count)
+        {
+            u16 address = queue->addresses[queue->next++];
+            ++queue->busy;
+            pthread_mutex_unlock(&queue->mutex);
+
+            TraceCodePath(queue, address);
+
+            pthread_mutex_lock(&queue->mutex);
+            --queue->busy;
+            if(!queue->busy && queue->next == queue->count)
+            {
+                pthread_cond_broadcast(&queue->wake);
+            }
+        }
+        else if(queue->busy)
+        {
+            pthread_cond_wait(&queue->wake, &queue->mutex);
+        }
+        else
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return 0;
+}
+
+// Note: Paths that jump into the middle of an instruction decode bytes that
+// are also part of another one. A listing can only show one of them, so the
+// first one wins and the starts it covers are dropped
+void DropOverlappingStarts(CodeQueue* queue)
+{
+    u32 address = 0;
+    while(address < queue->programSize)
+    {
+        if(!BITMAP_TEST(queue->instructionStarts, address))
+        {
+            ++address;
+            continue;
+        }
+
+        DecodedInstruction* decoded = GetDecodedInstruction(queue->program, address);
+        u32 next = (u16)(address + decoded->size);
+        if(next <= address)
+        {
+            break;
+        }
+
+        for(u32 inside = address + 1; inside < next; ++inside)
+        {
+            queue->instructionStarts[inside >> 3] &= ~(1 << (inside & 7));
+        }
+        address = next;
+    }
+}
+
+// Note: Splits the decoded instructions into blocks, a block starts at
+// the entry, at a jump target or after a branch and ends at a branch, at an
+// exit or where decoded code stops
+u32 BuildBasicBlocks(CodeQueue* queue, BasicBlock* blocks)
+{
+    u32 blockCount = 0;
+    BasicBlock* block = 0;
+
+    u32 address = 0;
+    while(address < queue->programSize)
+    {
+        if(!BITMAP_TEST(queue->instructionStarts, address))
+        {
+            block = 0;
+            ++address;
+            continue;
+        }
+
+        if(!block || BITMAP_TEST(queue->jumpTargets, address))
+        {
+            if(block)
+            {
+                block->successors[block->successorCount++] = address;
+            }
+
+            block = blocks + blockCount++;
+            memset(block, 0, sizeof(*block));
+            block->start = address;
+        }
+
+        DecodedInstruction* decoded = GetDecodedInstruction(queue->program, address);
+        Instruction instruction = decoded->instruction;
+        u32 next = (u16)(address + decoded->size);
+        block->end = next;
+
+        if(IsBranchInstruction(instruction.instCode))
+        {
+            u16 target = address + instruction.operands[0].displacement;
+            if(next < queue->programSize && BITMAP_TEST(queue->instructionStarts, next))
+            {
+                block->successors[block->successorCount++] = next;
+            }
+            if(target < queue->programSize && BITMAP_TEST(queue->instructionStarts, target))
+            {
+                block->successors[block->successorCount++] = target;
+            }
+            block = 0;
+        }
+        else if(BITMAP_TEST(queue->exits, address))
+        {
+            block = 0;
+        }
+
+        // Note: Wrapping past 0xffff ends the listing instead of looping
+        if(next <= address)
+        {
+            break;
+        }
+        address = next;
+    }
+
+    return blockCount;
+}
+
+#define DATA_BYTES_PER_LINE 8
+
+void PrintDataBytes(u32 start, u32 end)
+{
+    for(u32 address = start; address < end; address += DATA_BYTES_PER_LINE)
+    {
+        fprintf(output, "db ");
+        for(u32 index = address; index < end && index < address + DATA_BYTES_PER_LINE; ++index)
+        {
+            fprintf(output, "%s0x%02x", index == address ? "" : ", ", memory[index]);
+        }
+        fprintf(output, "\n");
+    }
+}
+
+// Note: Only bytes reached from the entry point are decoded, everything else
+// is written out as db so the listing still assembles to the same binary.
+// Branches into the middle of a decoded instruction keep the $+N form
+void PrintCodeListing(CodeQueue* queue, BasicBlock* blocks, u32 blockCount)
+{
+    fprintf(output, "bits 16\n");
+
+    u32 address = 0;
+    for(u32 blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+    {
+        BasicBlock* block = blocks + blockIndex;
+        if(address < block->start)
+        {
+            fprintf(output, "\n");
+            PrintDataBytes(address, block->start);
+        }
+
+        fprintf(output, "\n; block 0x%04x-0x%04x", block->start, block->end);
+        for(u32 index = 0; index < block->successorCount; ++index)
+        {
+            fprintf(output, "%s0x%04x", index ? ", " : " -> ", block->successors[index]);
+        }
+        fprintf(output, "\n");
+
+        if(BITMAP_TEST(queue->jumpTargets, block->start))
+        {
+            fprintf(output, "label_%04x:\n", block->start);
+        }
+
+        u32 instructionAddress = block->start;
+        while(instructionAddress < block->end)
+        {
+            DecodedInstruction* decoded = GetDecodedInstruction(queue->program, instructionAddress);
+            Instruction instruction = decoded->instruction;
+
+            u16 target = instructionAddress + instruction.operands[0].displacement;
+            if(IsBranchInstruction(instruction.instCode) && 
+               target < queue->programSize && BITMAP_TEST(queue->instructionStarts, target))
+            {
+                fprintf(output, "%s label_%04x\n", GetInstructionCodeStr(instruction.instCode), target);
+            }
+            else
+            {
+                PrintInstruction(instruction);
+                fprintf(output, "\n");
+            }
+
+            instructionAddress += decoded->size;
+        }
+
+        address = block->end;
+    }
+
+    if(address < queue->programSize)
+    {
+        fprintf(output, "\n");
+        PrintDataBytes(address, queue->programSize);
+    }
+}
+
+u32 DisassembleRecursive(u32 programSize)
+{
+    CodeQueue* queue = calloc(1, sizeof(CodeQueue));
+    pthread_mutex_init(&queue->mutex, 0);
+    pthread_cond_init(&queue->wake, 0);
+    queue->image = memory;
+    queue->programSize = programSize < CODE_SIZE ? programSize : CODE_SIZE;
+    queue->decodeOutput = fopen("/dev/null", "w");
+    queue->program = CreateDecodedProgram(memory, 0);
+
+    PushCodeAddress(queue, 0);
+
+    long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 threadCount = processorCount > 0 ? (u32)processorCount : 1;
+
+    pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+    for(u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        pthread_create(threads + threadIndex, 0, CodeWorker, queue);
+    }
+    for(u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        pthread_join(threads[threadIndex], 0);
+    }
+    free(threads);
+
+    DropOverlappingStarts(queue);
+
+    BasicBlock* blocks = malloc(CODE_SIZE * sizeof(BasicBlock));
+    u32 blockCount = BuildBasicBlocks(queue, blocks);
+    PrintCodeListing(queue, blocks, blockCount);
+
+    fclose(queue->decodeOutput);
+    FreeDecodedProgram(queue->program);
+    pthread_cond_destroy(&queue->wake);
+    pthread_mutex_destroy(&queue->mutex);
+    free(blocks);
+    free(queue);
+
+    ip = 0;
+    return blockCount;
+}
+
+//
+// Reverse execution
+//
+
+void TakeUndoSnapshot(void)
+{
+    UndoSnapshot* snapshot = undoLog->snapshots + undoLog->nextSnapshot;
+    undoLog->nextSnapshot = (undoLog->nextSnapshot + 1) % UNDO_SNAPSHOT_COUNT;
+
+    snapshot->valid = true;
+    snapshot->instructionIndex = instructionsRetired;
+    snapshot->regs = regs;
+    snapshot->ip = ip;
+    snapshot->flags = flags;
+    snapshot->clocks = clocks;
+    memcpy(snapshot->memory, memory, MEMORY_SIZE);
+
+    // Note: Replays never start before the oldest snapshot, events from
+    // before it are not needed any more
+    u64 oldest = instructionsRetired;
+    for(int index = 0; index < UNDO_SNAPSHOT_COUNT; ++index)
+    {
+        UndoSnapshot* other = undoLog->snapshots + index;
+        if(other->valid && other->instructionIndex < oldest)
+        {
+            oldest = other->instructionIndex;
+        }
+    }
+
+    u64 dropped = 0;
+    while(dropped < undoLog->eventCount && undoLog->events[dropped].instructionIndex < oldest)
+    {
+        ++dropped;
+    }
+
+    if(dropped)
+    {
+        u64 firstByte = dropped < undoLog->eventCount ? undoLog->events[dropped].firstByte : undoLog->byteCount;
+        undoLog->eventCount -= dropped;
+        undoLog->byteCount -= firstByte;
+        memmove(undoLog->events, undoLog->events + dropped, undoLog->eventCount * sizeof(ReplayEvent));
+        memmove(undoLog->bytes, undoLog->bytes + firstByte, undoLog->byteCount * sizeof(u32));
+        for(u64 index = 0; index < undoLog->eventCount; ++index)
+        {
+            undoLog->events[index].firstByte -= firstByte;
+        }
+    }
+}
+
+void EnableUndoLog(void)
+{
+    undoLog = calloc(1, sizeof(UndoLog));
+    undoLog->entries = malloc(UNDO_LOG_SIZE * sizeof(UndoEntry));
+    for(int index = 0; index < UNDO_SNAPSHOT_COUNT; ++index)
+    {
+        undoLog->snapshots[index].memory = malloc(MEMORY_SIZE);
+    }
+
+    TakeUndoSnapshot();
+}
+
+void UndoBeginInstruction(void)
+{
+    undoLog->instructionStart = undoLog->head;
+    undoLog->regsBefore = regs;
+    undoLog->external = false;
+}
+
+// Note: The stored bytes are the memory deltas the instruction just logged
+void PushReplayEvent(u64 instructionClocks)
+{
+    if(undoLog->eventCount == undoLog->eventCapacity)
+    {
+        undoLog->eventCapacity = undoLog->eventCapacity ? undoLog->eventCapacity * 2 : 256;
+        undoLog->events = realloc(undoLog->events, undoLog->eventCapacity * sizeof(ReplayEvent));
+    }
+
+    ReplayEvent* event = undoLog->events + undoLog->eventCount++;
+    event->instructionIndex = instructionsRetired - 1;
+    event->regs = regs;
+    event->ip = ip;
+    event->flags = flags;
+    event->clocks = instructionClocks;
+    event->firstByte = undoLog->byteCount;
+    event->byteCount = 0;
+
+    for(u64 position = undoLog->instructionStart; position < undoLog->head; ++position)
+    {
+        UndoEntry entry = undoLog->entries[position & (UNDO_LOG_SIZE - 1)];
+        if(entry.kind == Undo_Memory)
+        {
+            if(undoLog->byteCount == undoLog->byteCapacity)
+            {
+                undoLog->byteCapacity = undoLog->byteCapacity ? undoLog->byteCapacity * 2 : 4096;
+                undoLog->bytes = realloc(undoLog->bytes, undoLog->byteCapacity * sizeof(u32));
+            }
+
+            undoLog->bytes[undoLog->byteCount++] = entry.address << 8 | memory[entry.address];
+            ++event->byteCount;
+        }
+    }
+}
+
+// Note: Events at or after index are about to be redone or are gone
+void DropReplayEvents(u64 instructionIndex)
+{
+    while(undoLog->eventCount && undoLog->events[undoLog->eventCount - 1].instructionIndex >= instructionIndex)
+    {
+        ReplayEvent* event = undoLog->events + --undoLog->eventCount;
+        undoLog->byteCount = event->firstByte;
+    }
+}
+
+// Note: Register deltas are indexed into regTable16 followed by segTable
+RegisterCode GetUndoRegister(int index)
+{
+    RegisterCode result = index < 8 ? regTable16[index] : segTable[index - 8];
+    return result;
+}
+
+void UndoEndInstruction(s16 prevIp, s16 prevFlags, u64 instructionClocks)
+{
+    for(int index = 0; index < 12; ++index)
+    {
+        s16 before = *GetRegister(&undoLog->regsBefore, GetUndoRegister(index));
+        s16 after = *GetRegister(&regs, GetUndoRegister(index));
+        if(before != after)
+        {
+            UndoEntry entry = {};
+            entry.kind = Undo_Register;
+            entry.regIndex = index;
+            entry.value = before;
+            PushUndoEntry(entry);
+        }
+    }
+
+    UndoEntry marker = {};
+    marker.kind = Undo_Instruction;
+    marker.value = prevIp;
+    marker.cs = undoLog->regsBefore.cs;
+    marker.flags = prevFlags;
+    marker.clocks = instructionClocks;
+    marker.address = undoLog->head - undoLog->instructionStart;
+    PushUndoEntry(marker);
+
+    if(undoLog->external)
+    {
+        PushReplayEvent(instructionClocks);
+    }
+
+    if(instructionsRetired % UNDO_SNAPSHOT_INTERVAL == 0)
+    {
+        TakeUndoSnapshot();
+    }
+}
+
+// Note: Returns false when the deltas of the previous instruction have
+// already been overwritten
+bool UndoInstruction(void)
+{
+    bool result = false;
+
+    u64 available = undoLog->head - undoLog->tail;
+    if(available)
+    {
+        UndoEntry marker = undoLog->entries[(undoLog->head - 1) & (UNDO_LOG_SIZE - 1)];
+        u64 needed = (u64)marker.address + 1;
+        if(needed <= available)
+        {
+            for(u64 index = 2; index <= needed; ++index)
+            {
+                UndoEntry entry = undoLog->entries[(undoLog->head - index) & (UNDO_LOG_SIZE - 1)];
+                if(entry.kind == Undo_Memory)
+                {
+                    memory[entry.address] = entry.value & 0xff;
+                }
+                else if(entry.kind == Undo_Register)
+                {
+                    RegisterCode code = GetUndoRegister(entry.regIndex);
+                    *GetRegister(&regs, code) = entry.value;
+                    if(IsSegmentRegister(code))
+                    {
+                        UpdateSegmentBase(&regs, code);
+                    }
+                }
+            }
+
+            ip = marker.value;
+            flags = marker.flags;
+            clocks -= marker.clocks;
+            --instructionsRetired;
+
+            undoLog->head -= needed;
+            result = true;
+        }
+    }
+
+    return result;
+}
+
+void ReplayInstructions(u64 count)
+{
+    FILE* traceOutput = output;
+    output = fopen("/dev/null", "w");
+
+    u64 eventIndex = 0;
+    while(eventIndex < undoLog->eventCount && undoLog->events[eventIndex].instructionIndex < instructionsRetired)
+    {
+        ++eventIndex;
+    }
+
+    for(u64 index = 0; index < count; ++index)
+    {
+        s16 prevIp = ip;
+        s16 prevFlags = flags;
+        UndoBeginInstruction();
+
+        ReplayEvent* event = eventIndex < undoLog->eventCount ? undoLog->events + eventIndex : 0;
+        if(event && event->instructionIndex == instructionsRetired)
+        {
+            for(u32 byteIndex = 0; byteIndex < event->byteCount; ++byteIndex)
+            {
+                u32 packed = undoLog->bytes[event->firstByte + byteIndex];
+                StoreMemory8(packed >> 8, packed & 0xff);
+            }
+            regs = event->regs;
+            ip = event->ip;
+            flags = event->flags;
+            clocks += event->clocks;
+            ++instructionsRetired;
+            ++eventIndex;
+            UndoEndInstruction(prevIp, prevFlags, event->clocks);
+        }
+        else
+        {
+            Instruction instruction = DecodeInstruction(memory + GetSegmentBase(&regs, CS));
+            HandleInstructionResult instructionResult = HandleInstruction(&regs, instruction);
+            clocks += instructionResult.clocks;
+            ++instructionsRetired;
+            UndoEndInstruction(prevIp, instructionResult.prevFlags, instructionResult.clocks);
+        }
+    }
+
+    fclose(output);
+    output = traceOutput;
+}
+
+// Note: Short walks undo the logged deltas in reverse. Longer ones, or ones
+// past the oldest delta still in the ring, restore the latest snapshot at
+// or before the target and replay forward from there, so the work is bounded
+// by the snapshot interval either way. Returns how far it actually got.
+u64 StepBack(u64 count)
+{
+    u64 start = instructionsRetired;
+    u64 target = count < start ? start - count : 0;
+
+    if(count <= UNDO_SNAPSHOT_INTERVAL)
+    {
+        while(instructionsRetired > target && UndoInstruction())
+        {
+        }
+    }
+
+    if(instructionsRetired > target)
+    {
+        // Note: Without a snapshot at or before the target the oldest one is
+        // as far back as the history goes
+        UndoSnapshot* best = 0;
+        UndoSnapshot* oldest = 0;
+        for(int index = 0; index < UNDO_SNAPSHOT_COUNT; ++index)
+        {
+            UndoSnapshot* snapshot = undoLog->snapshots + index;
+            if(snapshot->valid && snapshot->instructionIndex <= target && 
+               (!best || snapshot->instructionIndex > best->instructionIndex))
+            {
+                best = snapshot;
+            }
+
+            if(snapshot->valid && (!oldest || snapshot->instructionIndex < oldest->instructionIndex))
+            {
+                oldest = snapshot;
+            }
+        }
+
+        if(!best && oldest && oldest->instructionIndex < instructionsRetired)
+        {
+            best = oldest;
+            target = oldest->instructionIndex;
+        }
+
+        if(best)
+        {
+            regs = best->regs;
+            ip = best->ip;
+            flags = best->flags;
+            clocks = best->clocks;
+            instructionsRetired = best->instructionIndex;
+            memcpy(memory, best->memory, MEMORY_SIZE);
+
+            // Note: Everything logged after the snapshot is about to be redone
+            undoLog->head = undoLog->tail;
+            for(int index = 0; index < UNDO_SNAPSHOT_COUNT; ++index)
+            {
+                UndoSnapshot* snapshot = undoLog->snapshots + index;
+                if(snapshot->instructionIndex > best->instructionIndex)
+                {
+                    snapshot->valid = false;
+                }
+            }
+
+            ReplayInstructions(target - instructionsRetired);
+        }
+    }
+
+    DropReplayEvents(instructionsRetired);
+
+    u64 result = start - instructionsRetired;
+    return result;
+}
+
+// Note: Finds the most recent logged instruction that started at an address
+// marked in rewindBitmap and steps back to just before it ran
+bool RewindToMarkedAddress(u64* steppedBack)
+{
+    bool result = false;
+
+    u64 position = undoLog->head;
+    u64 count = 0;
+    while(position - undoLog->tail > 0 && !result)
+    {
+        UndoEntry marker = undoLog->entries[(position - 1) & (UNDO_LOG_SIZE - 1)];
+        u64 needed = (u64)marker.address + 1;
+        if(needed > position - undoLog->tail)
+        {
+            break;
+        }
+
+        ++count;
+        position -= needed;
+        result = BITMAP_TEST(rewindBitmap, (((u32)marker.cs << 4) + marker.value) & (MEMORY_SIZE - 1));
+    }
+
+    *steppedBack = result ? StepBack(count) : 0;
+    return result;
+}
+
+//
+// Block memoization
+//
+
+// Note: A pure block is a straight run of register only instructions ending
+// in a branch, so the registers and flags it leaves behind, where it jumps
+// and what it costs only depend on the registers it reads and the flags.
+// The first execution of a block with a new set of inputs is interpreted
+// and recorded, later ones with the same inputs just copy the outputs over.
+// The flags are always part of the inputs because arithmetic only updates
+// some of them. Writing to the bytes of an analyzed block analyzes it again
+// and bumps its generation, which retires the entries recorded before.
+#define MEMO_MAX_INSTRUCTIONS 32
+#define MEMO_MIN_INSTRUCTIONS 2
+#define MEMO_BLOCK_COUNT 4096
+#define MEMO_ENTRY_COUNT 16384
+#define MEMO_REGISTER_COUNT 8
+
+typedef struct MemoBlock
+{
+    u32 address;
+    bool used;
+    bool pure;
+
+    u8 instructionCount;
+    u8 liveIn;
+    u8 liveOut;
+    u16 size;
+    u32 generation;
+} MemoBlock;
+
+typedef struct MemoEntry
+{
+    u32 address;
+    u32 generation;
+    bool valid;
+
+    u8 liveIn;
+    s16 flagsIn;
+    s16 inputs[MEMO_REGISTER_COUNT];
+
+    u8 liveOut;
+    s16 flagsOut;
+    s16 outputs[MEMO_REGISTER_COUNT];
+    s16 ipOut;
+    u32 clocks;
+} MemoEntry;
+
+typedef struct Memoizer
+{
+    FILE* analysisOutput;
+    MemoBlock blocks[MEMO_BLOCK_COUNT];
+    MemoEntry entries[MEMO_ENTRY_COUNT];
+
+    MemoEntry* recording;
+    MemoEntry pending;
+    u32 pendingRemaining;
+    u64 pendingStartClocks;
+
+    u64 hits;
+    u64 misses;
+    u64 skippedInstructions;
+} Memoizer;
+
+static _Thread_local Memoizer* memoizer;
+
+void EnableMemoizer(void)
+{
+    memoizer = calloc(1, sizeof(Memoizer));
+    memoizer->analysisOutput = fopen("/dev/null", "w");
+    EnableAnalyzedCode();
+}
+
+// Note: Returns the bit of the 16 bit register behind a register operand,
+// 0 when the operand is not something a pure block may touch
+u8 GetMemoRegisterBit(Operand operand)
+{
+    u8 result = 0;
+    if(operand.opCode == Register)
+    {
+        int index = FindRegisterIndex(regTable16, MEMO_REGISTER_COUNT, GetFullRegister(operand.regCode));
+        result = index >= 0 ? 1 << index : 0;
+    }
+
+    return result;
+}
+
+void AnalyzeMemoBlock(MemoBlock* block, u32 address)
+{
+    block->pure = false;
+
+    // Note: Decoding moves ip, keep the real one. Bytes past the block may
+    // never run, so whatever the decoder says about them is not shown
+    s16 savedIp = ip;
+    FILE* savedOutput = output;
+    ip = 0;
+    output = memoizer->analysisOutput;
+
+    u8 written = 0;
+    u8* code = memory + address;
+    for(u32 count = 1; count <= MEMO_MAX_INSTRUCTIONS && address + (u16)ip < MEMORY_SIZE - 8; ++count)
+    {
+        if(count > 1 && BITMAP_TEST(breakpointBitmap, (address + (u16)ip) & (MEMORY_SIZE - 1)))
+        {
+            break;
+        }
+
+        Instruction instruction = DecodeInstruction(code);
+        InstructionCode instCode = instruction.instCode;
+        Operand left = instruction.operands[0];
+        Operand right = instruction.operands[1];
+
+        u8 reads = 0;
+        u8 writes = 0;
+        bool allowed = true;
+        if(IsBranchInstruction(instCode))
+        {
+            if(instCode == Jcxz || (instCode >= Loopne && instCode <= Loop))
+            {
+                reads = 1 << FindRegisterIndex(regTable16, MEMO_REGISTER_COUNT, CX);
+                writes = instCode == Jcxz ? 0 : reads;
+            }
+        }
+        else if(instCode >= Mov && instCode <= Cmp)
+        {
+            u8 leftBit = GetMemoRegisterBit(left);
+            u8 rightBit = GetMemoRegisterBit(right);
+            allowed = leftBit && (rightBit || right.opCode == Immediate);
+
+            bool wide = instruction.instFlags & INST_WIDE;
+            reads = rightBit | (instCode != Mov || !wide ? leftBit : 0);
+            writes = instCode != Cmp ? leftBit : 0;
+        }
+        else
+        {
+            allowed = false;
+        }
+
+        if(!allowed)
+        {
+            break;
+        }
+
+        block->liveIn |= reads & ~written;
+        written |= writes;
+
+        if(IsBranchInstruction(instCode))
+        {
+            block->pure = count >= MEMO_MIN_INSTRUCTIONS;
+            block->instructionCount = count;
+            break;
+        }
+    }
+
+    if(block->pure)
+    {
+        block->liveOut = written;
+        block->size = (u16)ip;
+        MarkAnalyzedCode(address, block->size);
+    }
+
+    ip = savedIp;
+    output = savedOutput;
+}
+
+MemoBlock* FindMemoBlock(u32 address)
+{
+    MemoBlock* result = 0;
+    for(u32 probe = 0; probe < 8; ++probe)
+    {
+        MemoBlock* block = memoizer->blocks + ((address + probe) & (MEMO_BLOCK_COUNT - 1));
+        if(!block->used)
+        {
+            block->used = true;
+            block->address = address;
+            AnalyzeMemoBlock(block, address);
+            result = block;
+            break;
+        }
+        if(block->address == address)
+        {
+            result = block;
+            break;
+        }
+    }
+
+    return result;
+}
+
+void ReadMemoInputs(MemoEntry* entry, u8 liveIn)
+{
+    entry->liveIn = liveIn;
+    entry->flagsIn = flags;
+    for(u32 index = 0; index < MEMO_REGISTER_COUNT; ++index)
+    {
+        entry->inputs[index] = liveIn & (1 << index) ? *GetRegister(&regs, regTable16[index]) : 0;
+    }
+}
+
+u32 HashMemoEntry(MemoEntry* entry)
+{
+    u32 result = entry->address * 0x9e3779b1u ^ (u16)entry->flagsIn;
+    for(u32 index = 0; index < MEMO_REGISTER_COUNT; ++index)
+    {
+        result = (result ^ (u16)entry->inputs[index]) * 0x01000193u;
+    }
+
+    return result & (MEMO_ENTRY_COUNT - 1);
+}
+
+bool MatchMemoEntry(MemoEntry* a, MemoEntry* b)
+{
+    bool result = a->valid && a->address == b->address && a->generation == b->generation && a->flagsIn == b->flagsIn &&
+        memcmp(a->inputs, b->inputs, sizeof(a->inputs)) == 0;
+    return result;
+}
+
+// Note: Called before the instruction at cs:ip is decoded, returns how many
+// instructions were skipped or 0 when the block has to be interpreted. A
+// hit is not used when it would run past the next device event or -max.
+u32 ApplyMemoizedBlock(u64 maxInstructions)
+{
+    u32 address = GetSegmentBase(&regs, CS) + (u16)ip;
+    MemoBlock* block = FindMemoBlock(address);
+    if(!block || !block->pure)
+    {
+        return 0;
+    }
+
+    MemoEntry key = {};
+    key.address = address;
+    key.generation = block->generation;
+    ReadMemoInputs(&key, block->liveIn);
+
+    u32 result = 0;
+    MemoEntry* entry = memoizer->entries + HashMemoEntry(&key);
+    if(MatchMemoEntry(entry, &key))
+    {
+        bool beforeEvent = clocks + entry->clocks < nextEventClock;
+        bool beforeMax = !maxInstructions || instructionsRetired + block->instructionCount < maxInstructions;
+        if(beforeEvent && beforeMax)
+        {
+            for(u32 index = 0; index < MEMO_REGISTER_COUNT; ++index)
+            {
+                if(entry->liveOut & (1 << index))
+                {
+                    *GetRegister(&regs, regTable16[index]) = entry->outputs[index];
+                }
+            }
+            flags = entry->flagsOut;
+            ip = entry->ipOut;
+            clocks += entry->clocks;
+            instructionsRetired += block->instructionCount;
+
+            ++memoizer->hits;
+            memoizer->skippedInstructions += block->instructionCount;
+            result = block->instructionCount;
+        }
+    }
+    else
+    {
+        ++memoizer->misses;
+        memoizer->pending = key;
+        memoizer->pending.liveOut = block->liveOut;
+        memoizer->pendingRemaining = block->instructionCount;
+        memoizer->pendingStartClocks = clocks;
+        memoizer->recording = entry;
+    }
+
+    return result;
+}
+
+// Note: Called after every interpreted instruction while a block is being
+// recorded, the entry is stored once its last instruction retired
+void RecordMemoizedStep(void)
+{
+    if(--memoizer->pendingRemaining == 0)
+    {
+        MemoEntry* entry = memoizer->recording;
+        *entry = memoizer->pending;
+        for(u32 index = 0; index < MEMO_REGISTER_COUNT; ++index)
+        {
+            entry->outputs[index] = entry->liveOut & (1 << index) ? *GetRegister(&regs, regTable16[index]) : 0;
+        }
+        entry->flagsOut = flags;
+        entry->ipOut = ip;
+        entry->clocks = clocks - memoizer->pendingStartClocks;
+        entry->valid = true;
+
+        memoizer->recording = 0;
+    }
+}
+
+void PrintMemoStats(void)
+{
+    fprintf(output, "\nMemoized blocks: %llu hits, %llu misses, %llu instructions skipped\n",
+            (unsigned long long)memoizer->hits, (unsigned long long)memoizer->misses,
+            (unsigned long long)memoizer->skippedInstructions);
+}
+
+//
+// Loop acceleration
+//
+
+// Note: A counted loop is a block that branches back to its own start with
+// loop, or with jne right after adding a constant to its counter, and whose
+// other instructions only add constants to registers or load constants
+// into them. Every register then moves by a fixed step per iteration, so
+// the trip count and the state after any number of iterations follow
+// directly. All but the last iteration are skipped, the last one runs
+// normally so it leaves the flags and the fall through exactly as they
+// would be. Fewer iterations are skipped when the next device event or
+// -max would land inside the loop.
+//
+// Only addresses reached by jumping back are looked at, straight line code
+// never starts another iteration. The table only keeps counted loops, the
+// addresses that start none go into a bitmap so each is analyzed once.
+#define LOOP_MAX_INSTRUCTIONS 16
+#define LOOP_TABLE_SIZE 1024
+
+typedef enum LoopUpdate
+{
+    LoopUpdate_None,
+    LoopUpdate_Add,
+    LoopUpdate_Set,
+
+    LoopUpdate_Count,
+} LoopUpdate;
+
+typedef struct CountedLoop
+{
+    u32 address;
+    u32 size;
+    bool used;
+    bool counted;
+
+    u32 instructionCount;
+    u32 iterationClocks;
+
+    int counterIndex;
+    LoopUpdate updates[MEMO_REGISTER_COUNT];
+    s16 values[MEMO_REGISTER_COUNT];
+} CountedLoop;
+
+typedef struct LoopAccelerator
+{
+    CountedLoop loops[LOOP_TABLE_SIZE];
+    u8 notCounted[MEMORY_SIZE / 8];
+    u32 previousAddress;
+    FILE* analysisOutput;
+
+    u64 fastForwards;
+    u64 skippedIterations;
+    u64 skippedInstructions;
+} LoopAccelerator;
+
+static _Thread_local LoopAccelerator* loopAccelerator;
+
+void EnableLoopAccelerator(void)
+{
+    loopAccelerator = calloc(1, sizeof(LoopAccelerator));
+    loopAccelerator->analysisOutput = fopen("/dev/null", "w");
+    EnableAnalyzedCode();
+}
+
+bool OverlapsCodePage(u32 address, u32 size, u32 page)
+{
+    u32 offset = (address - (page << CODE_PAGE_SHIFT)) & (MEMORY_SIZE - 1);
+    bool result = size && (offset < CODE_PAGE_SIZE || offset + size > MEMORY_SIZE);
+    return result;
+}
+
+// Note: Called by the run loop once a store hit analyzed code. Only what
+// covers a written page is analyzed or decoded again
+void ForgetAnalyzedCode(void)
+{
+    for(u32 page = 0; page < CODE_PAGE_COUNT; ++page)
+    {
+        if(!(page & 7) && !writtenCodePageBitmap[page >> 3])
+        {
+            page += 7;
+            continue;
+        }
+        if(!BITMAP_TEST(writtenCodePageBitmap, page))
+        {
+            continue;
+        }
+
+        // Note: Blocks analyzed again below mark their bytes again
+        memset(analyzedCodeBitmap + (page << CODE_PAGE_SHIFT) / 8, 0, CODE_PAGE_SIZE / 8);
+        codePageBitmap[page >> 3] &= ~(1 << (page & 7));
+        writtenCodePageBitmap[page >> 3] &= ~(1 << (page & 7));
+        ++writtenCodePages;
+
+        for(u32 index = 0; memoizer && index < MEMO_BLOCK_COUNT; ++index)
+        {
+            MemoBlock* block = memoizer->blocks + index;
+            if(block->used && OverlapsCodePage(block->address, block->size, page))
+            {
+                MemoBlock reset = {};
+                reset.used = true;
+                reset.address = block->address;
+                reset.generation = block->generation + 1;
+                *block = reset;
+                AnalyzeMemoBlock(block, block->address);
+            }
+        }
+        for(u32 index = 0; loopAccelerator && index < LOOP_TABLE_SIZE; ++index)
+        {
+            CountedLoop* loop = loopAccelerator->loops + index;
+            if(loop->used && OverlapsCodePage(loop->address, loop->size, page))
+            {
+                loop->used = false;
+            }
+        }
+        if(loopAccelerator)
+        {
+            memset(loopAccelerator->notCounted + (page << CODE_PAGE_SHIFT) / 8, 0, CODE_PAGE_SIZE / 8);
+        }
+        if(decodedProgram)
+        {
+            ForgetDecodedPage(decodedProgram, page);
+        }
+
+    }
+
+    analyzedCodeWritten = false;
+}
+
+void AnalyzeCountedLoop(CountedLoop* loop, u32 address)
+{
+    loop->counted = false;
+    loop->counterIndex = -1;
+
+    s16 savedIp = ip;
+    FILE* savedOutput = output;
+    ip = 0;
+    output = loopAccelerator->analysisOutput;
+
+    // Note: The register the last flag setting instruction wrote, jne tests
+    // it. A later mov to it makes it Set and so not a counter any more
+    int flagsIndex = -1;
+    int cxIndex = FindRegisterIndex(regTable16, MEMO_REGISTER_COUNT, CX);
+
+    u8* code = memory + address;
+    for(u32 count = 1; count <= LOOP_MAX_INSTRUCTIONS && address + (u16)ip < MEMORY_SIZE - 8; ++count)
+    {
+        if(BITMAP_TEST(breakpointBitmap, (address + (u16)ip) & (MEMORY_SIZE - 1)))
+        {
+            break;
+        }
+
+        u16 instructionAddress = ip;
+        Instruction instruction = DecodeInstruction(code);
+        InstructionCode instCode = instruction.instCode;
+        Operand left = instruction.operands[0];
+        Operand right = instruction.operands[1];
+        loop->iterationClocks += EstimateClocks(instruction, IsBranchInstruction(instCode));
+
+        if(IsBranchInstruction(instCode))
+        {
+            bool backToStart = (u16)(instructionAddress + left.displacement) == 0;
+            if(backToStart && instCode == Loop && loop->updates[cxIndex] == LoopUpdate_None)
+            {
+                loop->counterIndex = cxIndex;
+                loop->updates[cxIndex] = LoopUpdate_Add;
+                loop->values[cxIndex] = -1;
+            }
+            else if(backToStart && instCode == Jne && flagsIndex >= 0 && loop->updates[flagsIndex] == LoopUpdate_Add)
+            {
+                loop->counterIndex = flagsIndex;
+            }
+
+            // Note: Only an odd step reaches zero from every start value
+            loop->counted = loop->counterIndex >= 0 && (loop->values[loop->counterIndex] & 1) && loop->iterationClocks;
+            loop->instructionCount = count;
+            break;
+        }
+
+        int index = left.opCode == Register && (instruction.instFlags & INST_WIDE) ? 
+            FindRegisterIndex(regTable16, MEMO_REGISTER_COUNT, left.regCode) : -1;
+        if(index < 0 || right.opCode != Immediate || (instCode != Mov && instCode != Add && instCode != Sub))
+        {
+            break;
+        }
+
+        s16 value = right.displacement;
+        if(instCode == Mov)
+        {
+            loop->updates[index] = LoopUpdate_Set;
+            loop->values[index] = value;
+        }
+        else
+        {
+            value = instCode == Sub ? -value : value;
+            loop->updates[index] = loop->updates[index] == LoopUpdate_None ? LoopUpdate_Add : loop->updates[index];
+            loop->values[index] += value;
+            flagsIndex = index;
+        }
+    }
+
+    if(loop->counted)
+    {
+        loop->size = (u16)ip;
+        MarkAnalyzedCode(address, loop->size);
+    }
+
+    ip = savedIp;
+    output = savedOutput;
+}
+
+// Note: Returns 0 when no counted loop starts at address
+CountedLoop* FindCountedLoop(u32 address)
+{
+    if(BITMAP_TEST(loopAccelerator->notCounted, address))
+    {
+        return 0;
+    }
+
+    CountedLoop* result = loopAccelerator->loops + (address & (LOOP_TABLE_SIZE - 1));
+    if(!result->used || result->address != address)
+    {
+        CountedLoop loop = {};
+        loop.used = true;
+        loop.address = address;
+        AnalyzeCountedLoop(&loop, address);
+
+        if(loop.counted)
+        {
+            *result = loop;
+        }
+        else
+        {
+            BITMAP_SET(loopAccelerator->notCounted, address);
+            result = 0;
+        }
+    }
+
+    return result;
+}
+
+// Note: Iterations until counter + n * step wraps to 0, an odd step has an
+// inverse modulo 2^16 which Newton's iteration finds in a few steps
+u32 GetLoopTripCount(u16 counter, u16 step)
+{
+    u16 inverse = step;
+    for(int iteration = 0; iteration < 4; ++iteration)
+    {
+        inverse *= 2 - step * inverse;
+    }
+
+    u16 result = (u16)(-counter) * inverse;
+    return result ? result : 0x10000;
+}
+
+// Note: Called before the instruction at cs:ip is decoded, returns how many
+// instructions were skipped
+u32 FastForwardLoop(u64 maxInstructions)
+{
+    u32 address = (GetSegmentBase(&regs, CS) + (u16)ip) & (MEMORY_SIZE - 1);
+    bool backward = address <= loopAccelerator->previousAddress;
+    loopAccelerator->previousAddress = address;
+    if(!backward)
+    {
+        return 0;
+    }
+
+    CountedLoop* loop = FindCountedLoop(address);
+    if(!loop)
+    {
+        return 0;
+    }
+
+    int counterIndex = loop->counterIndex;
+    u16 counter = *GetRegister(&regs, regTable16[counterIndex]);
+    u64 iterations = GetLoopTripCount(counter, loop->values[counterIndex]) - 1;
+
+    // Note: The iteration after the skipped ones has to finish before the
+    // next event or -max, they would otherwise see the flags it has not set
+    if(nextEventClock != ~0ull)
+    {
+        u64 available = nextEventClock > clocks ? nextEventClock - clocks : 0;
+        u64 fit = available / loop->iterationClocks;
+        fit = fit ? fit - 1 : 0;
+        iterations = iterations < fit ? iterations : fit;
+    }
+    if(maxInstructions)
+    {
+        u64 left = maxInstructions > instructionsRetired ? maxInstructions - instructionsRetired : 0;
+        u64 fit = left / loop->instructionCount;
+        fit = fit ? fit - 1 : 0;
+        iterations = iterations < fit ? iterations : fit;
+    }
+
+    u32 result = 0;
+    if(iterations)
+    {
+        for(u32 index = 0; index < MEMO_REGISTER_COUNT; ++index)
+        {
+            s16* reg = GetRegister(&regs, regTable16[index]);
+            switch(loop->updates[index])
+            {
+            case LoopUpdate_Add: { *reg += (s16)(iterations * loop->values[index]); } break;
+            case LoopUpdate_Set: { *reg = loop->values[index]; } break;
+            default: break;
+            }
+        }
+
+        clocks += iterations * loop->iterationClocks;
+        instructionsRetired += iterations * loop->instructionCount;
+
+        ++loopAccelerator->fastForwards;
+        loopAccelerator->skippedIterations += iterations;
+        loopAccelerator->skippedInstructions += iterations * loop->instructionCount;
+        result = iterations * loop->instructionCount;
+    }
+
+    return result;
+}
+
+void PrintLoopStats(void)
+{
+    fprintf(output, "\nFast forwarded loops: %llu times, %llu iterations, %llu instructions skipped\n",
+            (unsigned long long)loopAccelerator->fastForwards, (unsigned long long)loopAccelerator->skippedIterations,
+            (unsigned long long)loopAccelerator->skippedInstructions);
+}
+
+//
+// Cache and branch statistics
+//
+
+// Note: Decodes again from memory as it is now, so code the program
+// overwrote shows up as what is there at exit
+void PrintInstructionAt(u32 address)
+{
+    s16 savedIp = ip;
+    ip = address;
+    Instruction instruction = DecodeInstruction(memory + GetSegmentBase(&regs, CS));
+    PrintInstruction(instruction);
+    ip = savedIp;
+}
+
+void PrintCacheStats(void)
+{
+    fprintf(output, "\nCache model: %llu accesses, %llu clocks\n", 
+            (unsigned long long)cacheModel->accesses, (unsigned long long)cacheModel->clocks);
+
+    for(u32 levelIndex = 0; levelIndex < cacheModel->levelCount; ++levelIndex)
+    {
+        CacheLevel* level = cacheModel->levels + levelIndex;
+        u64 total = level->hits + level->misses;
+        fprintf(output, "  L%u %u bytes, %u byte lines, %u ways, %u clocks: %llu hits, %llu misses", 
+                levelIndex + 1, level->size, level->lineSize, level->ways, level->latency,
+                (unsigned long long)level->hits, (unsigned long long)level->misses);
+        if(total)
+        {
+            fprintf(output, " (%.2f%% hit)", 100.0 * (double)level->hits / (double)total);
+        }
+        fprintf(output, "\n");
+    }
+
+    fprintf(output, "\nCache accesses by ip:\n");
+    for(u32 address = 0; address < CACHE_CODE_SIZE; ++address)
+    {
+        u32 accesses = cacheModel->codeAccesses[address];
+        if(!accesses)
+        {
+            continue;
+        }
+
+        fprintf(output, "  0x%04x %10u accesses", address, accesses);
+        for(u32 levelIndex = 0; levelIndex < cacheModel->levelCount; ++levelIndex)
+        {
+            fprintf(output, ", L%u %u misses", levelIndex + 1, cacheModel->levels[levelIndex].codeMisses[address]);
+        }
+
+        fprintf(output, " ; ");
+        PrintInstructionAt(address);
+        fprintf(output, "\n");
+    }
+}
+
+void PrintBranchStats(void)
+{
+    BranchStats* stats = branchStats;
+    fprintf(output, "\nBranches: %llu executed, %llu taken\n", 
+            (unsigned long long)stats->totalExecuted, (unsigned long long)stats->totalTaken);
+
+    for(u32 predictor = 0; predictor < Predictor_Count; ++predictor)
+    {
+        u64 mispredicted = stats->totalMispredicted[predictor];
+        fprintf(output, "  %-6s %llu mispredicted", GetPredictorStr(predictor), (unsigned long long)mispredicted);
+        if(stats->totalExecuted)
+        {
+            fprintf(output, " (%.2f%%)", 100.0 * (double)mispredicted / (double)stats->totalExecuted);
+        }
+        fprintf(output, "\n");
+    }
+
+    fprintf(output, "\nBranches by ip:\n");
+    for(u32 address = 0; address < BRANCH_CODE_SIZE; ++address)
+    {
+        u32 executed = stats->executed[address];
+        if(!executed)
+        {
+            continue;
+        }
+
+        fprintf(output, "  0x%04x %10u executed, %10u taken, mispredicted", address, executed, stats->taken[address]);
+        for(u32 predictor = 0; predictor < Predictor_Count; ++predictor)
+        {
+            fprintf(output, " %s %u", GetPredictorStr(predictor), stats->mispredicted[predictor][address]);
+        }
+
+        fprintf(output, " ; ");
+        PrintInstructionAt(address);
+        fprintf(output, "\n");
+    }
+}
+
+//
+// Trace filtering
+//
+
+// Note: An instruction is traced when it passes every filter that is set,
+// and with a sample interval only every Nth of those is printed
+typedef struct TraceFilter
+{
+    bool active;
+
+    bool ipRange;
+    u32 ipStart;
+    u32 ipEnd;
+
+    u64 codes;
+
+    RegisterCode regCode;
+
+    bool memoryRange;
+    u32 memoryStart;
+    u32 memoryEnd;
+
+    u64 sampleInterval;
+    u64 sampleCounter;
+} TraceFilter;
+
+// Note: Accepts a mnemonic or one of the classes mov, alu, jump, string and
+// flag, returns a mask with one bit per InstructionCode
+u64 ParseTraceCodes(char* name)
+{
+    u64 result = 0;
+
+    if(strcmp(name, "mov") == 0)
+    {
+        result = 1ull << Mov;
+    }
+    else if(strcmp(name, "alu") == 0)
+    {
+        for(int index = 0; index < 8; ++index)
+        {
+            result |= 1ull << groupTable[index];
+        }
+    }
+    else if(strcmp(name, "jump") == 0)
+    {
+        for(int index = 0; index < 16; ++index)
+        {
+            result |= 1ull << jumpTable[index];
+        }
+        for(int index = 0; index < 4; ++index)
+        {
+            result |= 1ull << loopTable[index];
+        }
+    }
+    else if(strcmp(name, "string") == 0)
+    {
+        for(int code = Movs; code <= Stos; ++code)
+        {
+            result |= 1ull << code;
+        }
+    }
+    else if(strcmp(name, "flag") == 0)
+    {
+        result = (1ull << Cld) | (1ull << Std);
+    }
+    else
+    {
+        for(int code = None + 1; code < InstructionCode_Count; ++code)
+        {
+            if(strcmp(name, GetInstructionCodeStr(code)) == 0)
+            {
+                result = 1ull << code;
+            }
+        }
+    }
+
+    return result;
+}
+
+RegisterCode ParseRegisterCode(char* name)
+{
+    RegisterCode result = RegisterCode_None;
+    for(int code = AL; code <= DS; ++code)
+    {
+        if(strcmp(name, GetRegCodeStr(code)) == 0)
+        {
+            result = GetFullRegister(code);
+        }
+    }
+
+    return result;
+}
+
+bool IsOperandInRange(Operand operand, u32 start, u32 end)
+{
+    bool result = false;
+    if(operand.opCode == Memory)
+    {
+        u32 address = GetEffectiveAddress(&regs, operand);
+        result = address >= start && address <= end;
+    }
+
+    return result;
+}
+
+// Note: Memory operands have to be resolved before the instruction runs
+bool IsMemoryTraced(TraceFilter* filter, Instruction instruction)
+{
+    bool result = true;
+    if(filter->memoryRange)
+    {
+        result = IsOperandInRange(instruction.operands[0], filter->memoryStart, filter->memoryEnd) || 
+                 IsOperandInRange(instruction.operands[1], filter->memoryStart, filter->memoryEnd);
+
+        if(IsStringInstruction(instruction.instCode))
+        {
+            RegisterCode sourceSegment = instruction.operands[0].segment ? instruction.operands[0].segment : DS;
+            u32 si = GetSegmentBase(&regs, sourceSegment) + (u16)regs.si;
+            u32 di = GetSegmentBase(&regs, ES) + (u16)regs.di;
+            result = (si >= filter->memoryStart && si <= filter->memoryEnd) || 
+                     (di >= filter->memoryStart && di <= filter->memoryEnd);
+        }
+    }
+
+    return result;
+}
+
+bool IsInstructionTraced(TraceFilter* filter, Instruction instruction, HandleInstructionResult instructionResult, s16 prevIp)
+{
+    bool result = true;
+
+    if(filter->ipRange)
+    {
+        result = result && (u16)prevIp >= filter->ipStart && (u16)prevIp <= filter->ipEnd;
+    }
+
+    if(filter->codes)
+    {
+        result = result && (filter->codes & (1ull << instruction.instCode));
+    }
+
+    if(filter->regCode)
+    {
+        result = result && instructionResult.regCode == filter->regCode && 
+                 instructionResult.regBefore != instructionResult.regAfter;
+    }
+
+    if(result && filter->sampleInterval > 1)
+    {
+        result = (++filter->sampleCounter % filter->sampleInterval) == 0;
+    }
+
+    return result;
+}
+
+typedef struct RunOptions
+{
+    bool executionMode;
+    bool showClocks;
+
+    bool reverse;
+    u64 stepBack;
+    bool rewind;
+
+    bool quiet;
+    u64 maxInstructions;
+    bool untilExit;
+    TraceFilter filter;
+
+    bool pipeline;
+    u32 formatterCount;
+} RunOptions;
+
+void ResetMachine(void)
+{
+    Registers emptyRegisters = {};
+    regs = emptyRegisters;
+    ip = 0;
+    flags = 0;
+    clocks = 0;
+    instructionsRetired = 0;
+    halted = false;
+    guestVectors = false;
+    memset(memory, 0, MEMORY_SIZE);
+    CloseDosFiles();
+}
+
+// Note: The program is loaded at address 0 and decoded straight out of
+// the simulated memory so executed stores are visible to the decoder
+bool LoadProgram(char* fileName, u32* programSize)
+{
+    FILE* file = fopen(fileName, "rb");
+    if(!file)
+    {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    u32 fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    bool result = fileSize <= MEMORY_SIZE && fread(memory, 1, fileSize, file) == fileSize;
+    fclose(file);
+
+    *programSize = fileSize;
+    return result;
+}
+
+// Note: A .COM image goes to offset COM_ORIGIN of COM_SEGMENT with every
+// segment register pointing there, after a program segment prefix holding
+// int 20h at offset 0 and an empty command tail. The returned size is the
+// end offset of the image so a disassembly stops at the same place, when
+// executed it runs until it exits or COM_MAX_INSTRUCTIONS without -max.
+#define COM_SEGMENT 0x1000
+#define COM_ORIGIN 0x100
+#define COM_MEMORY_TOP 0xa000
+#define COM_MAX_INSTRUCTIONS 100000000ull
+
+bool LoadComProgram(char* fileName, u32* programEnd)
+{
+    FILE* file = fopen(fileName, "rb");
+    if(!file)
+    {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    u32 fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    u8* segment = memory + (COM_SEGMENT << 4);
+    bool result = fileSize <= 0x10000 - COM_ORIGIN && fread(segment + COM_ORIGIN, 1, fileSize, file) == fileSize;
+    fclose(file);
+
+    segment[0x00] = 0xcd;
+    segment[0x01] = 0x20;
+    segment[0x02] = COM_MEMORY_TOP & 0xff;
+    segment[0x03] = COM_MEMORY_TOP >> 8;
+    segment[0x80] = 0;
+    segment[0x81] = '\r';
+
+    for(int index = 0; index < 4; ++index)
+    {
+        *GetRegister(&regs, segTable[index]) = COM_SEGMENT;
+        UpdateSegmentBase(&regs, segTable[index]);
+    }
+    regs.sp = (s16)0xfffe;
+    ip = COM_ORIGIN;
+    guestVectors = true;
+
+    *programEnd = COM_ORIGIN + fileSize;
+    return result;
+}
+
+bool IsComFile(char* fileName)
+{
+    size_t length = strlen(fileName);
+    bool result = length > 4 && strcasecmp(fileName + length - 4, ".com") == 0;
+    return result;
+}
+
+// Note: The contents are followed by FILE_PADDING zero bytes, so text is
+// terminated and the decoder can safely read past the last instruction
+#define FILE_PADDING 16
+
+char* ReadEntireFile(char* fileName, u32* fileSize)
+{
+    char* result = 0;
+
+    FILE* file = fopen(fileName, "rb");
+    if(file)
+    {
+        fseek(file, 0, SEEK_END);
+        u32 size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        result = malloc(size + FILE_PADDING);
+        if(fread(result, 1, size, file) != size)
+        {
+            free(result);
+            result = 0;
+        }
+        else
+        {
+            memset(result + size, 0, FILE_PADDING);
+            *fileSize = size;
+        }
+
+        fclose(file);
+    }
+
+    return result;
+}
+
+void PrintFlags(s16 flagsToPrint)
+{
+    for(int index = 0; index < FLAGS_COUNT; ++index)
+    {
+        int bitVal = 1 << index;
+        bool bitSet = flagsToPrint & bitVal;
+        if(bitSet)
+        {
+            char* flagStr = GetFlagsStr(bitVal);
+            fprintf(output, "%s", flagStr);
+        }
+    }
+}
+
+void PrintTrace(HandleInstructionResult instructionResult, s16 prevIp, bool showClocks)
+{
+    s16 prevFlags = instructionResult.prevFlags;
+
+    fprintf(output, "; ");
+
+    if(showClocks)
+    {
+        fprintf(output, "Clocks: +%llu = %llu | ", (unsigned long long)instructionResult.clocks, (unsigned long long)clocks);
+    }
+
+    // Note: Jumps name IP as their operand, it is printed once from ip below
+    char *regCode = GetRegCodeStr(instructionResult.regCode);
+    if(instructionResult.regCode != IP && GetRegister(&regs, instructionResult.regCode))
+    {
+        fprintf(output, "%s:0x%04hx->0x%04hx ", 
+                regCode, 
+                instructionResult.regBefore, 
+                instructionResult.regAfter);
+    }
+
+    if((instructionResult.indexRegisters & (1 << (SI - SI))) && instructionResult.regCode != SI)
+    {
+        fprintf(output, "si:0x%04hx->0x%04hx ", instructionResult.siBefore, instructionResult.siAfter);
+    }
+    if((instructionResult.indexRegisters & (1 << (DI - SI))) && instructionResult.regCode != DI)
+    {
+        fprintf(output, "di:0x%04hx->0x%04hx ", instructionResult.diBefore, instructionResult.diAfter);
+    }
+
+    fprintf(output, "ip:0x%04hx->0x%04hx", prevIp, ip);
+
+    if(prevFlags != flags)
+    {
+        fprintf(output, " flags:");
+        PrintFlags(prevFlags & ~flags);
+        fprintf(output, "->");
+        PrintFlags(flags & ~prevFlags);
+    }
+
+    fprintf(output, "\n");
+}
+
+void PrintFinalState(bool showClocks)
+{
+    PrintRegister(&regs, AX);
+    PrintRegister(&regs, BX);
+    PrintRegister(&regs, CX);
+    PrintRegister(&regs, DX);
+    PrintRegister(&regs, SP);
+    PrintRegister(&regs, BP);
+    PrintRegister(&regs, SI);
+    PrintRegister(&regs, DI);
+    PrintRegister(&regs, ES);
+    PrintRegister(&regs, CS);
+    PrintRegister(&regs, SS);
+    PrintRegister(&regs, DS);
+    fprintf(output, "%10s: 0x%04hx (%d)\n", "ip", ip, (u16)ip);
+    fprintf(output, "%10s: ", "flags");
+    PrintFlags(flags);
+    fprintf(output, "\n");
+
+    if(showClocks)
+    {
+        fprintf(output, "%10s: %llu\n", "clocks", (unsigned long long)clocks);
+    }
+}
+
+//
+// Live state
+//
+
+// Note: With -share the machine state is published in a POSIX shared memory
+// object that other processes can map read only and poll. The run loop
+// copies it in every interval retired instructions under a sequence lock,
+// sequence is odd while a copy is being written. A reader copies the state
+// out and keeps it only when sequence was the same even number before and
+// after. With -share-memory the simulated 1MB lives in the object itself at
+// memoryOffset, it is always current but not covered by the lock.
+#define LIVE_STATE_MAGIC 0x36383038
+#define LIVE_STATE_VERSION 1
+#define LIVE_STATE_HEADER_SIZE 4096
+#define LIVE_STATE_DEFAULT_INTERVAL 65536
+#define LIVE_STATE_NAME_SIZE 256
+
+typedef struct SharedState
+{
+    u32 magic;
+    u32 version;
+    u32 sequence;
+    u32 finished;
+
+    // Note: ax, cx, dx, bx, sp, bp, si, di, es, cs, ss, ds
+    u16 registers[12];
+    u16 ip;
+    u16 flags;
+    u64 instructionsRetired;
+    u64 clocks;
+
+    u32 memoryOffset;
+    u32 memorySize;
+} SharedState;
+
+typedef struct LiveState
+{
+    SharedState* shared;
+    u64 interval;
+    u64 nextPublish;
+} LiveState;
+
+static _Thread_local LiveState* liveState;
+
+void GetLiveStateName(char* name, char* result)
+{
+    snprintf(result, LIVE_STATE_NAME_SIZE, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+bool EnableLiveState(char* name, u64 interval, bool shareMemory)
+{
+    char objectName[LIVE_STATE_NAME_SIZE];
+    GetLiveStateName(name, objectName);
+
+    int file = shm_open(objectName, O_CREAT | O_RDWR, 0644);
+    if(file < 0)
+    {
+        return false;
+    }
+
+    u32 size = LIVE_STATE_HEADER_SIZE + (shareMemory ? MEMORY_SIZE : 0);
+    void* mapped = MAP_FAILED;
+    if(ftruncate(file, size) == 0)
+    {
+        mapped = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    }
+    close(file);
+
+    if(mapped == MAP_FAILED)
+    {
+        return false;
+    }
+
+    SharedState* shared = mapped;
+    memset(shared, 0, sizeof(SharedState));
+    shared->magic = LIVE_STATE_MAGIC;
+    shared->version = LIVE_STATE_VERSION;
+
+    // Note: The memory moves into the object with whatever is loaded so far
+    if(shareMemory)
+    {
+        u8* sharedMemory = (u8*)mapped + LIVE_STATE_HEADER_SIZE;
+        memcpy(sharedMemory, memory, MEMORY_SIZE);
+        free(memory);
+        memory = sharedMemory;
+
+        shared->memoryOffset = LIVE_STATE_HEADER_SIZE;
+        shared->memorySize = MEMORY_SIZE;
+    }
+
+    liveState = calloc(1, sizeof(LiveState));
+    liveState->shared = shared;
+    liveState->interval = interval ? interval : LIVE_STATE_DEFAULT_INTERVAL;
+
+    return true;
+}
+
+void PublishLiveState(bool finished)
+{
+    SharedState* shared = liveState->shared;
+    u32 sequence = shared->sequence;
+
+    __atomic_store_n(&shared->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shared->registers[0] = regs.ax;
+    shared->registers[1] = regs.cx;
+    shared->registers[2] = regs.dx;
+    shared->registers[3] = regs.bx;
+    shared->registers[4] = regs.sp;
+    shared->registers[5] = regs.bp;
+    shared->registers[6] = regs.si;
+    shared->registers[7] = regs.di;
+    shared->registers[8] = regs.es;
+    shared->registers[9] = regs.cs;
+    shared->registers[10] = regs.ss;
+    shared->registers[11] = regs.ds;
+    shared->ip = ip;
+    shared->flags = flags;
+    shared->instructionsRetired = instructionsRetired;
+    shared->clocks = clocks;
+    shared->finished = finished;
+
+    __atomic_store_n(&shared->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+    liveState->nextPublish = instructionsRetired + liveState->interval;
+}
+
+// Note: Returns false while the writer is in the middle of a copy
+bool ReadLiveState(volatile SharedState* shared, SharedState* result)
+{
+    u32 sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+    if(sequence & 1)
+    {
+        return false;
+    }
+
+    memcpy(result, (void*)shared, sizeof(SharedState));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    bool stable = __atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == sequence;
+    return stable;
+}
+
+// Note: The reading side of -share, prints a line whenever the state
+// changed until the run finishes
+bool MonitorLiveState(char* name, u32 pollMilliseconds)
+{
+    char objectName[LIVE_STATE_NAME_SIZE];
+    GetLiveStateName(name, objectName);
+
+    int file = shm_open(objectName, O_RDONLY, 0);
+    if(file < 0)
+    {
+        printf("Cannot open shared state %s\n", name);
+        return false;
+    }
+
+    void* mapped = mmap(0, LIVE_STATE_HEADER_SIZE, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+
+    SharedState* shared = mapped;
+    if(mapped == MAP_FAILED || shared->magic != LIVE_STATE_MAGIC || shared->version != LIVE_STATE_VERSION)
+    {
+        printf("%s is not a simulator state\n", name);
+        return false;
+    }
+
+    struct timespec poll = { pollMilliseconds / 1000, (pollMilliseconds % 1000) * 1000000 };
+    u32 lastSequence = 0;
+    for(;;)
+    {
+        SharedState state;
+        if(ReadLiveState(shared, &state) && state.sequence != lastSequence)
+        {
+            lastSequence = state.sequence;
+
+            fprintf(output, "%llu retired %llu clocks ip:0x%04hx", 
+                    (unsigned long long)state.instructionsRetired, (unsigned long long)state.clocks, state.ip);
+
+            char* names[12] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds" };
+            for(u32 index = 0; index < 12; ++index)
+            {
+                fprintf(output, " %s:%04hx", names[index], state.registers[index]);
+            }
+
+            fprintf(output, " flags:");
+            PrintFlags(state.flags);
+            fprintf(output, "\n");
+            fflush(output);
+
+            if(state.finished)
+            {
+                break;
+            }
+        }
+
+        nanosleep(&poll, 0);
+    }
+
+    munmap(mapped, LIVE_STATE_HEADER_SIZE);
+    return true;
+}
+
+//
+// Output pipeline
+//
+
+// Note: With -pipeline the run loop only decodes and executes, everything
+// it would print goes into batches of records instead. Batches are dealt
+// round robin to formatter threads, each formatter turns its batches into
+// text chunks and the writer collects the chunks round robin again, which
+// keeps them in sequence without any locks. Every ring has exactly one
+// producer and one consumer. Text the run loop writes itself, like program
+// output or a watchpoint message, is attached to the next record so it
+// comes out at the same place.
+#define PIPELINE_BATCH_SIZE 512
+#define PIPELINE_RING_SIZE 16
+#define MAX_FORMATTERS 16
+
+typedef struct SpscRing
+{
+    void* slots[PIPELINE_RING_SIZE];
+    __attribute__((aligned(64))) u32 head;
+    __attribute__((aligned(64))) u32 tail;
+} SpscRing;
+
+typedef struct TraceRecord
+{
+    Instruction instruction;
+    HandleInstructionResult instructionResult;
+    s16 prevIp;
+    s16 ip;
+    s16 flags;
+    u64 clocks;
+
+    bool printed;
+    char* sideText;
+    u32 sideTextSize;
+} TraceRecord;
+
+typedef struct TraceBatch
+{
+    u32 recordCount;
+    bool last;
+    TraceRecord records[PIPELINE_BATCH_SIZE];
+
+    char* text;
+    size_t textSize;
+} TraceBatch;
+
+typedef struct Pipeline
+{
+    u32 formatterCount;
+    bool executionMode;
+    bool showClocks;
+
+    SpscRing batchRings[MAX_FORMATTERS];
+    SpscRing textRings[MAX_FORMATTERS];
+    pthread_t formatters[MAX_FORMATTERS];
+    pthread_t writer;
+    bool finished;
+
+    FILE* finalOutput;
+    FILE* sideOutput;
+    char* sideText;
+    size_t sideTextSize;
+
+    TraceBatch* batch;
+    u64 batchCount;
+} Pipeline;
+
+static Pipeline* pipeline;
+
+bool RingPush(SpscRing* ring, void* item)
+{
+    u32 tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    u32 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    bool result = tail - head < PIPELINE_RING_SIZE;
+    if(result)
+    {
+        ring->slots[tail % PIPELINE_RING_SIZE] = item;
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    return result;
+}
+
+void* RingPop(SpscRing* ring)
+{
+    u32 head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    u32 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    void* result = 0;
+    if(head != tail)
+    {
+        result = ring->slots[head % PIPELINE_RING_SIZE];
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    return result;
+}
+
+void RingPushWait(SpscRing* ring, void* item)
+{
+    while(!RingPush(ring, item))
+    {
+        sched_yield();
+    }
+}
+
+void FormatBatch(TraceBatch* batch)
+{
+    output = open_memstream(&batch->text, &batch->textSize);
+
+    for(u32 recordIndex = 0; recordIndex < batch->recordCount; ++recordIndex)
+    {
+        TraceRecord* record = batch->records + recordIndex;
+        if(record->sideTextSize)
+        {
+            fwrite(record->sideText, 1, record->sideTextSize, output);
+            free(record->sideText);
+        }
+
+        if(record->printed)
+        {
+            PrintInstruction(record->instruction);
+            if(pipeline->executionMode)
+            {
+                // Note: PrintTrace reads the machine state as it was after
+                // the instruction, these are this thread's own copies
+                ip = record->ip;
+                flags = record->flags;
+                clocks = record->clocks;
+                PrintTrace(record->instructionResult, record->prevIp, pipeline->showClocks);
+            }
+            else
+            {
+                fprintf(output, "\n");
+            }
+        }
+    }
+
+    fclose(output);
+    output = 0;
+}
+
+void* FormatterThread(void* param)
+{
+    u32 formatterIndex = (u32)(uintptr_t)param;
+    SpscRing* batchRing = pipeline->batchRings + formatterIndex;
+    SpscRing* textRing = pipeline->textRings + formatterIndex;
+
+    for(;;)
+    {
+        TraceBatch* batch = RingPop(batchRing);
+        if(batch)
+        {
+            FormatBatch(batch);
+            RingPushWait(textRing, batch);
+        }
+        else if(__atomic_load_n(&pipeline->finished, __ATOMIC_ACQUIRE))
+        {
+            // Note: finished is set after the last push, so the ring has
+            // to be checked once more before leaving
+            batch = RingPop(batchRing);
+            if(!batch)
+            {
+                break;
+            }
+            FormatBatch(batch);
+            RingPushWait(textRing, batch);
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+
+    return 0;
+}
+
+void* WriterThread(void* param)
+{
+    (void)param;
+    for(u64 sequence = 0;; ++sequence)
+    {
+        SpscRing* textRing = pipeline->textRings + sequence % pipeline->formatterCount;
+
+        TraceBatch* batch;
+        while(!(batch = RingPop(textRing)))
+        {
+            sched_yield();
+        }
+
+        fwrite(batch->text, 1, batch->textSize, pipeline->finalOutput);
+        free(batch->text);
+
+        bool last = batch->last;
+        free(batch);
+        if(last)
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void SubmitBatch(bool last)
+{
+    TraceBatch* batch = pipeline->batch;
+    batch->last = last;
+    RingPushWait(pipeline->batchRings + pipeline->batchCount % pipeline->formatterCount, batch);
+    ++pipeline->batchCount;
+
+    pipeline->batch = calloc(1, sizeof(TraceBatch));
+}
+
+// Note: Takes whatever the run loop wrote since the last record
+void TakeSideText(TraceRecord* record)
+{
+    long size = ftell(pipeline->sideOutput);
+    if(size > 0)
+    {
+        fflush(pipeline->sideOutput);
+        record->sideText = malloc(size);
+        record->sideTextSize = (u32)size;
+        memcpy(record->sideText, pipeline->sideText, size);
+        fseek(pipeline->sideOutput, 0, SEEK_SET);
+    }
+}
+
+void AppendTraceRecord(Instruction instruction, HandleInstructionResult instructionResult, s16 prevIp, bool printed)
+{
+    TraceRecord* record = pipeline->batch->records + pipeline->batch->recordCount++;
+    record->instruction = instruction;
+    record->instructionResult = instructionResult;
+    record->prevIp = prevIp;
+    record->ip = ip;
+    record->flags = flags;
+    record->clocks = clocks;
+    record->printed = printed;
+    record->sideText = 0;
+    record->sideTextSize = 0;
+    TakeSideText(record);
+
+    if(pipeline->batch->recordCount == PIPELINE_BATCH_SIZE)
+    {
+        SubmitBatch(false);
+    }
+}
+
+// Note: formatterCount 0 picks one per processor left after the run loop
+// and the writer
+void StartPipeline(u32 formatterCount, bool executionMode, bool showClocks)
+{
+    if(!formatterCount)
+    {
+        long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+        formatterCount = processorCount > 3 ? (u32)processorCount - 2 : 1;
+    }
+
+    pipeline = calloc(1, sizeof(Pipeline));
+    pipeline->formatterCount = formatterCount < MAX_FORMATTERS ? formatterCount : MAX_FORMATTERS;
+    pipeline->executionMode = executionMode;
+    pipeline->showClocks = showClocks;
+    pipeline->batch = calloc(1, sizeof(TraceBatch));
+
+    fflush(output);
+    pipeline->finalOutput = output;
+    pipeline->sideOutput = open_memstream(&pipeline->sideText, &pipeline->sideTextSize);
+    output = pipeline->sideOutput;
+
+    for(u32 formatterIndex = 0; formatterIndex < pipeline->formatterCount; ++formatterIndex)
+    {
+        pthread_create(pipeline->formatters + formatterIndex, 0, FormatterThread, (void*)(uintptr_t)formatterIndex);
+    }
+    pthread_create(&pipeline->writer, 0, WriterThread, 0);
+}
+
+void FinishPipeline(void)
+{
+    // Note: An empty record carries the text written after the last one
+    HandleInstructionResult emptyResult = {};
+    Instruction emptyInstruction = {};
+    AppendTraceRecord(emptyInstruction, emptyResult, ip, false);
+    SubmitBatch(true);
+
+    __atomic_store_n(&pipeline->finished, true, __ATOMIC_RELEASE);
+    for(u32 formatterIndex = 0; formatterIndex < pipeline->formatterCount; ++formatterIndex)
+    {
+        pthread_join(pipeline->formatters[formatterIndex], 0);
+    }
+    pthread_join(pipeline->writer, 0);
+
+    output = pipeline->finalOutput;
+    fclose(pipeline->sideOutput);
+    free(pipeline->sideText);
+    free(pipeline->batch);
+    free(pipeline);
+    pipeline = 0;
+}
+
+// Note: Disassembles or executes the program already loaded in memory and
+// writes the listing to output, returns the number of instructions decoded
+u64 RunProgram(char* name, u32 programSize, RunOptions options)
+{
+    u64 instructionCount = 0;
+
+    if(options.reverse && !undoLog)
+    {
+        EnableUndoLog();
+    }
+
+    if(options.executionMode)
+    {
+        fprintf(output, "--- test\\%s execution ---\n", name);
+    }
+    else
+    {
+        fprintf(output, "bits 16\n\n");
+    }
+
+    if(options.pipeline)
+    {
+        StartPipeline(options.formatterCount, options.executionMode, options.showClocks);
+    }
+
+    // Note: Skipping instructions is only invisible with nothing watching them
+    bool unobserved = options.executionMode && options.quiet && 
+        !undoLog && !cacheModel && !branchStats && !prefetchQueue;
+    bool memoize = memoizer && unobserved;
+    bool accelerate = loopAccelerator && unobserved;
+
+    // Note: A DOS program can jump past its image or far into another
+    // segment, only raw listings end where their bytes do
+    bool untilExit = options.executionMode && options.untilExit;
+    if(untilExit && !options.maxInstructions)
+    {
+        options.maxInstructions = COM_MAX_INSTRUCTIONS;
+    }
+        
+    while((untilExit || (u16)ip < programSize) && !halted)
+    {
+        if(options.executionMode && BITMAP_TEST(breakpointBitmap, (GetSegmentBase(&regs, CS) + (u16)ip) & (MEMORY_SIZE - 1)))
+        {
+            fprintf(output, "\nBreakpoint at ip:0x%04hx\n", ip);
+            break;
+        }
+
+        if(liveState && instructionsRetired >= liveState->nextPublish)
+        {
+            PublishLiveState(false);
+        }
+
+        // Note: A delivered hardware interrupt is charged to the instruction
+        // it runs in front of and shares its undo record
+        s16 undoIp = ip;
+        s16 undoFlags = flags;
+        u32 interruptClocks = 0;
+        if(options.executionMode && undoLog)
+        {
+            UndoBeginInstruction();
+        }
+        if(options.executionMode && clocks >= nextEventClock)
+        {
+            int vector = ProcessEvents(&regs);
+            if(vector >= 0)
+            {
+                interruptClocks = INTERRUPT_CLOCKS;
+                if(!options.quiet)
+                {
+                    fprintf(output, "; hardware int %d\n", vector);
+                }
+            }
+        }
+
+        if(analyzedCodeWritten)
+        {
+            ForgetAnalyzedCode();
+        }
+
+        if(accelerate)
+        {
+            instructionCount += FastForwardLoop(options.maxInstructions);
+        }
+
+        if(memoize)
+        {
+            if(interruptClocks)
+            {
+                memoizer->recording = 0;
+            }
+
+            if(!memoizer->recording)
+            {
+                u32 skipped = ApplyMemoizedBlock(options.maxInstructions);
+                if(skipped)
+                {
+                    instructionCount += skipped;
+                    continue;
+                }
+            }
+        }
+
+        s16 prevIp = ip;
+
+        TIME_BLOCK_BEGIN(ProfilePhase_Decode);
+
+        // Note: Code is fetched from cs:ip
+        Instruction instruction = FetchInstruction();
+        s16 decodedIp = ip;
+
+        TIME_BLOCK_END(ProfilePhase_Decode, (u16)(ip - prevIp));
+        ++instructionCount;
+
+        if(options.executionMode)
+        {
+            bool traced = !options.quiet;
+            if(traced && options.filter.active)
+            {
+                traced = IsMemoryTraced(&options.filter, instruction);
+            }
+
+            TIME_BLOCK_BEGIN(ProfilePhase_Execute);
+            if(cacheModel)
+            {
+                cacheModel->accessIp = prevIp;
+            }
+
+            HandleInstructionResult instructionResult = HandleInstruction(&regs, instruction);
+            if(prefetchQueue)
+            {
+                bool flush = ip != decodedIp;
+                instructionResult.clocks += PrefetchInstruction((u16)(decodedIp - prevIp), instructionResult.clocks, flush);
+            }
+            instructionResult.clocks += interruptClocks;
+            clocks += instructionResult.clocks;
+            ++instructionsRetired;
+
+            if(memoize && memoizer->recording)
+            {
+                RecordMemoizedStep();
+            }
+
+            if(undoLog)
+            {
+                UndoEndInstruction(undoIp, interruptClocks ? undoFlags : instructionResult.prevFlags, instructionResult.clocks);
+            }
+            TIME_BLOCK_END(ProfilePhase_Execute, 0);
+
+            if(traced && options.filter.active)
+            {
+                traced = IsInstructionTraced(&options.filter, instruction, instructionResult, prevIp);
+            }
+
+            if(traced && pipeline)
+            {
+                TIME_BLOCK_BEGIN(ProfilePhase_Output);
+                AppendTraceRecord(instruction, instructionResult, prevIp, true);
+                TIME_BLOCK_END(ProfilePhase_Output, 0);
+            }
+            else if(traced)
+            {
+                TIME_BLOCK_BEGIN(ProfilePhase_Print);
+                PrintInstruction(instruction);
+                TIME_BLOCK_END(ProfilePhase_Print, 0);
+
+                TIME_BLOCK_BEGIN(ProfilePhase_Output);
+                PrintTrace(instructionResult, prevIp, options.showClocks);
+                TIME_BLOCK_END(ProfilePhase_Output, 0);
+            }
+
+            if(watchpointHit)
+            {
+                fprintf(output, "\nWatchpoint write to 0x%05x at ip:0x%04hx\n", watchpointAddress, prevIp);
+                watchpointHit = false;
+                break;
+            }
+
+            if(options.maxInstructions && instructionsRetired >= options.maxInstructions)
+            {
+                fprintf(output, "\nStopped after %llu instructions at ip:0x%04hx\n", 
+                        (unsigned long long)instructionsRetired, ip);
+                break;
+            }
+        }
+        else if(pipeline)
+        {
+            TIME_BLOCK_BEGIN(ProfilePhase_Output);
+            HandleInstructionResult emptyResult = {};
+            AppendTraceRecord(instruction, emptyResult, prevIp, true);
+            TIME_BLOCK_END(ProfilePhase_Output, 0);
+        }
+        else
+        {
+            TIME_BLOCK_BEGIN(ProfilePhase_Print);
+            PrintInstruction(instruction);
+            fprintf(output, "\n");
+            TIME_BLOCK_END(ProfilePhase_Print, 0);
+        }
+    }
+
+    if(pipeline)
+    {
+        FinishPipeline();
+    }
+
+    // Note: Replaying for reverse execution must not count as cache accesses,
+    // bus transfers or branches
+    CacheModel* runCacheModel = cacheModel;
+    BranchStats* runBranchStats = branchStats;
+    PrefetchQueue* runPrefetchQueue = prefetchQueue;
+    cacheModel = 0;
+    branchStats = 0;
+    prefetchQueue = 0;
+
+    if(undoLog && options.stepBack)
+    {
+        u64 steppedBack = StepBack(options.stepBack);
+        fprintf(output, "\nStepped back %llu instructions to ip:0x%04hx\n", (unsigned long long)steppedBack, ip);
+    }
+
+    if(undoLog && options.rewind)
+    {
+        u64 steppedBack = 0;
+        if(RewindToMarkedAddress(&steppedBack))
+        {
+            fprintf(output, "\nRewound %llu instructions to ip:0x%04hx\n", (unsigned long long)steppedBack, ip);
+        }
+        else
+        {
+            fprintf(output, "\nRewind address not found in the undo log\n");
+        }
+    }
+
+    if(liveState)
+    {
+        PublishLiveState(true);
+    }
+
+    if(options.executionMode)
+    {
+        fprintf(output, "\nFinal registers:\n");
+        PrintFinalState(options.showClocks);
+
+        if(options.quiet)
+        {
+            fprintf(output, "%10s: %llu\n", "retired", (unsigned long long)instructionsRetired);
+            if(!options.showClocks)
+            {
+                fprintf(output, "%10s: %llu\n", "clocks", (unsigned long long)clocks);
+            }
+        }
+    }
+
+    cacheModel = runCacheModel;
+    if(cacheModel && options.executionMode)
+    {
+        PrintCacheStats();
+    }
+
+    branchStats = runBranchStats;
+    if(branchStats && options.executionMode)
+    {
+        PrintBranchStats();
+    }
+
+    prefetchQueue = runPrefetchQueue;
+    if(prefetchQueue && options.executionMode)
+    {
+        fprintf(output, "\nPrefetch queue: %llu stall clocks, %llu flushes\n", 
+                (unsigned long long)prefetchQueue->stallClocks, (unsigned long long)prefetchQueue->flushes);
+    }
+
+    if(memoizer && options.executionMode)
+    {
+        PrintMemoStats();
+    }
+
+    if(loopAccelerator && options.executionMode)
+    {
+        PrintLoopStats();
+    }
+
+    if(decodedProgram && options.executionMode)
+    {
+        fprintf(output, "\nDecoded program: %u instructions, %llu dropped over %llu code page invalidations\n", 
+                decodedProgram->recordCount, (unsigned long long)decodedProgram->dropped,
+                (unsigned long long)writtenCodePages);
+    }
+
+    if(scheduler && options.executionMode)
+    {
+        fprintf(output, "\nInterrupts: %llu delivered, %llu without a handler\n", 
+                (unsigned long long)scheduler->delivered, (unsigned long long)scheduler->dropped);
+    }
+
+    return instructionCount;
+}
+
+//
+// Self test
+//
+
+typedef struct SelfTestJob
+{
+    char name[256];
+    char binaryPath[1024];
+    char referencePath[1024];
+    char disassemblyPath[1024];
+    bool executionMode;
+    bool disassemblyMode;
+
+    bool passed;
+    char message[2048];
+} SelfTestJob;
+
+typedef struct SelfTestQueue
+{
+    SelfTestJob* jobs;
+    u32 jobCount;
+    u32 nextJob;
+} SelfTestQueue;
+
+// Note: Copies the next non empty line with all whitespace removed into
+// line, the same leniency diff -w gives test.sh
+char* NextListingLine(char* at, char* line, u32 lineSize, u32* lineNumber)
+{
+    line[0] = 0;
+    while(*at && !line[0])
+    {
+        u32 length = 0;
+        for(; *at && *at != '\n'; ++at)
+        {
+            bool space = *at == ' ' || *at == '\t' || *at == '\r';
+            if(!space && length + 1 < lineSize)
+            {
+                line[length++] = *at;
+            }
+        }
+
+        line[length] = 0;
+        if(*at == '\n')
+        {
+            ++at;
+        }
+
+        ++*lineNumber;
+    }
+
+    return at;
+}
+
+bool CompareListing(char* expected, char* actual, char* message, u32 messageSize)
+{
+    char expectedLine[256];
+    char actualLine[256];
+    u32 expectedLineNumber = 0;
+    u32 actualLineNumber = 0;
+
+    bool result = true;
+    while(result && (*expected || *actual))
+    {
+        expected = NextListingLine(expected, expectedLine, sizeof(expectedLine), &expectedLineNumber);
+        actual = NextListingLine(actual, actualLine, sizeof(actualLine), &actualLineNumber);
+
+        if(strcmp(expectedLine, actualLine) != 0)
+        {
+            snprintf(message, messageSize, "line %u expected \"%s\" got \"%s\"", 
+                     expectedLineNumber, expectedLine, actualLine);
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+void RunSelfTestJob(SelfTestJob* job)
+{
+    ResetMachine();
+
+    char* text = 0;
+    size_t textSize = 0;
+    output = open_memstream(&text, &textSize);
+
+    u32 programSize = 0;
+    if(!LoadProgram(job->binaryPath, &programSize))
+    {
+        snprintf(job->message, sizeof(job->message), "cannot load %s", job->binaryPath);
+    }
+    else if(job->executionMode)
+    {
+        u32 referenceSize = 0;
+        char* reference = ReadEntireFile(job->referencePath, &referenceSize);
+        if(reference)
+        {
+            RunOptions options = {};
+            options.executionMode = true;
+            RunProgram(job->name, programSize, options);
+            fflush(output);
+
+            job->passed = CompareListing(reference, text, job->message, sizeof(job->message));
+            free(reference);
+        }
+        else
+        {
+            snprintf(job->message, sizeof(job->message), "cannot load %s", job->referencePath);
+        }
+    }
+    else
+    {
+        RoundTripResult roundTrip = VerifyRoundTrip(memory, programSize, 1, false);
+        job->passed = roundTrip.mismatchCount == 0;
+        if(!job->passed)
+        {
+            snprintf(job->message, sizeof(job->message), "decode/encode mismatch at offset 0x%x", roundTrip.firstMismatch);
+        }
+        else if(job->disassemblyMode)
+        {
+            // Note: The bytes coming back says nothing about the text, a
+            // wrong mnemonic or operand still encodes from the decoded form
+            u32 referenceSize = 0;
+            char* reference = ReadEntireFile(job->disassemblyPath, &referenceSize);
+            if(reference)
+            {
+                RunOptions options = {};
+                RunProgram(job->name, programSize, options);
+                fflush(output);
+
+                job->passed = CompareListing(reference, text, job->message, sizeof(job->message));
+                free(reference);
+            }
+            else
+            {
+                job->passed = false;
+                snprintf(job->message, sizeof(job->message), "cannot load %s", job->disassemblyPath);
+            }
+        }
+    }
+
+    fclose(output);
+    free(text);
+}
+
+void* SelfTestWorker(void* param)
+{
+    SelfTestQueue* queue = param;
+    memory = calloc(MEMORY_SIZE, 1);
+
+    for(;;)
+    {
+        u32 jobIndex = __atomic_fetch_add(&queue->nextJob, 1, __ATOMIC_RELAXED);
+        if(jobIndex >= queue->jobCount)
+        {
+            break;
+        }
+
+        RunSelfTestJob(queue->jobs + jobIndex);
+    }
+
+    free(memory);
+    return 0;
+}
+
+int CompareSelfTestJobs(const void* a, const void* b)
+{
+    int result = strcmp(((SelfTestJob*)a)->name, ((SelfTestJob*)b)->name);
+    return result;
+}
+
+// Note: Every extensionless listing_* binary in directory is a test, or only
+// those starting with one of the filters. With a .txt next to it the
+// execution trace is compared against that, otherwise every instruction is
+// decoded and encoded again and must give back the original bytes, and with
+// a .dis next to it the disassembly must also read like that file
+bool RunSelfTest(char* directory, char** filters, int filterCount)
+{
+    DIR* dir = opendir(directory);
+    if(!dir)
+    {
+        printf("Cannot open directory %s\n", directory);
+        return false;
+    }
+
+    u32 jobCapacity = 64;
+    SelfTestQueue queue = {};
+    queue.jobs = malloc(jobCapacity * sizeof(SelfTestJob));
+
+    struct dirent* entry;
+    while((entry = readdir(dir)))
+    {
+        char* name = entry->d_name;
+        if(strncmp(name, "listing_", 8) != 0 || strchr(name, '.') || strlen(name) >= sizeof(queue.jobs->name))
+        {
+            continue;
+        }
+
+        bool selected = filterCount == 0;
+        for(int filterIndex = 0; filterIndex < filterCount; ++filterIndex)
+        {
+            char* filter = filters[filterIndex];
+            selected = selected || strncmp(name, filter, strlen(filter)) == 0;
+        }
+
+        if(!selected)
+        {
+            continue;
+        }
+
+        if(queue.jobCount == jobCapacity)
+        {
+            jobCapacity *= 2;
+            queue.jobs = realloc(queue.jobs, jobCapacity * sizeof(SelfTestJob));
+        }
+
+        SelfTestJob* job = queue.jobs + queue.jobCount;
+        memset(job, 0, sizeof(*job));
+        snprintf(job->name, sizeof(job->name), "%s", name);
+        snprintf(job->binaryPath, sizeof(job->binaryPath), "%s/%s", directory, name);
+        snprintf(job->referencePath, sizeof(job->referencePath), "%s/%s.txt", directory, name);
+
+        snprintf(job->disassemblyPath, sizeof(job->disassemblyPath), "%s/%s.dis", directory, name);
+
+        job->executionMode = access(job->referencePath, R_OK) == 0;
+        job->disassemblyMode = access(job->disassemblyPath, R_OK) == 0;
+
+        ++queue.jobCount;
+    }
+    closedir(dir);
+
+    qsort(queue.jobs, queue.jobCount, sizeof(SelfTestJob), CompareSelfTestJobs);
+
+    long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 threadCount = processorCount > 0 ? (u32)processorCount : 1;
+    if(threadCount > queue.jobCount)
+    {
+        threadCount = queue.jobCount;
+    }
+
+    pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+    for(u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        pthread_create(threads + threadIndex, 0, SelfTestWorker, &queue);
+    }
+    for(u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        pthread_join(threads[threadIndex], 0);
+    }
+    free(threads);
+
+    u32 passedCount = 0;
+    for(u32 jobIndex = 0; jobIndex < queue.jobCount; ++jobIndex)
+    {
+        SelfTestJob* job = queue.jobs + jobIndex;
+        if(job->passed)
+        {
+            ++passedCount;
+            printf("PASS %s\n", job->name);
+        }
+        else
+        {
+            printf("FAIL %s: %s\n", job->name, job->message);
+        }
+    }
+
+    printf("%u/%u listings passed\n", passedCount, queue.jobCount);
+
+    bool result = passedCount == queue.jobCount;
+    free(queue.jobs);
+
+    return result;
+}
+
+#define MAX_REPORTED_MISMATCHES 16
+
+bool VerifyFile(char* fileName)
+{
+    u32 imageSize = 0;
+    u8* image = (u8*)ReadEntireFile(fileName, &imageSize);
+    if(!image)
+    {
+        printf("Cannot load file %s\n", fileName);
+        return false;
+    }
+
+    // Note: The timed pass runs silent, mismatches are printed by a second
+    // pass that stops early
+    FILE* reportOutput = output;
+    output = fopen("/dev/null", "w");
+
+    u64 start = ReadOSTimer();
+    RoundTripResult result = VerifyRoundTrip(image, imageSize, ~0ull, false);
+    u64 elapsed = ReadOSTimer() - start;
+
+    fclose(output);
+    output = reportOutput;
+
+    if(result.mismatchCount)
+    {
+        VerifyRoundTrip(image, imageSize, MAX_REPORTED_MISMATCHES, true);
+    }
+
+    double seconds = (double)elapsed / (double)OS_TIMER_FREQ;
+    fprintf(output, "%llu instructions, %llu mismatches, %u bytes", 
+            (unsigned long long)result.instructionCount, (unsigned long long)result.mismatchCount, imageSize);
+    if(seconds > 0.0)
+    {
+        fprintf(output, " at %.2fmb/s %.0f instructions/s", 
+                (double)imageSize / (1024.0 * 1024.0) / seconds, (double)result.instructionCount / seconds);
+    }
+    fprintf(output, "\n");
+
+    free(image);
+
+    bool passed = result.mismatchCount == 0;
+    return passed;
+}
+
+//
+// Differential execution
+//
+
+// Note: -diff runs two versions of a routine from the same starting state
+// once per input set and compares the registers, flags and memory they
+// leave behind, ip is left out since the two layouts differ. An input
+// set is one line of reg=value and [address]=value assignments, the latter
+// store a word, blank lines and lines starting with ; are skipped. Without
+// an input file there is one set, the state the loader leaves. Memory is
+// compared over the -diff-range ranges, by default everywhere except the
+// bytes the two images were loaded into. Input sets are spread over all
+// cores, each worker keeps one memory per side to compare them in place.
+#define MAX_DIFF_RANGES 16
+#define MAX_DIFF_ASSIGNMENTS 32
+#define DIFF_REGISTER_COUNT 12
+
+typedef struct DiffAssignment
+{
+    // Note: RegisterCode_None and flags not set for a memory word
+    RegisterCode regCode;
+    bool flags;
+    u32 address;
+    u16 value;
+} DiffAssignment;
+
+typedef struct DiffRange
+{
+    u32 start;
+    u32 size;
+} DiffRange;
+
+typedef struct DiffState
+{
+    bool loaded;
+    bool stopped;
+    u32 imageStart;
+    u32 imageEnd;
+
+    s16 registers[DIFF_REGISTER_COUNT];
+    s16 flags;
+    u64 clocks;
+    u64 retired;
+} DiffState;
+
+typedef struct DiffJob
+{
+    u32 lineNumber;
+    DiffAssignment assignments[MAX_DIFF_ASSIGNMENTS];
+    u32 assignmentCount;
+
+    bool same;
+    DiffState states[2];
+    char message[1024];
+} DiffJob;
+
+typedef struct DiffQueue
+{
+    char* fileNames[2];
+    DiffRange ranges[MAX_DIFF_RANGES];
+    u32 rangeCount;
+    u64 maxInstructions;
+
+    DiffJob* jobs;
+    u32 jobCount;
+    u32 nextJob;
+} DiffQueue;
+
+RegisterCode diffRegisters[DIFF_REGISTER_COUNT] = 
+{
+    AX, BX, CX, DX, SP, BP, SI, DI, ES, CS, SS, DS
+};
+
+bool ParseDiffRange(char* spec, DiffRange* range)
+{
+    char* end = 0;
+    DiffRange result = {};
+    result.start = strtoul(spec, &end, 0);
+
+    bool valid = *end == ':';
+    if(valid)
+    {
+        result.size = strtoul(end + 1, &end, 0);
+        valid = !*end && result.size && result.start < MEMORY_SIZE && result.size <= MEMORY_SIZE - result.start;
+    }
+
+    if(valid)
+    {
+        *range = result;
+    }
+
+    return valid;
+}
+
+bool ParseDiffAssignment(char* token, DiffAssignment* assignment)
+{
+    DiffAssignment result = {};
+
+    char* equals = strchr(token, '=');
+    bool valid = equals != 0;
+    if(valid && token[0] == '[')
+    {
+        char* end = 0;
+        result.address = strtoul(token + 1, &end, 0) & (MEMORY_SIZE - 1);
+        valid = end[0] == ']' && end + 1 == equals;
+    }
+    else if(valid)
+    {
+        *equals = 0;
+        result.flags = strcmp(token, "flags") == 0;
+        result.regCode = strcmp(token, "ip") == 0 ? IP : RegisterCode_None;
+        for(u32 index = 0; index < DIFF_REGISTER_COUNT; ++index)
+        {
+            if(strcmp(token, GetRegCodeStr(diffRegisters[index])) == 0)
+            {
+                result.regCode = diffRegisters[index];
+            }
+        }
+        *equals = '=';
+
+        valid = result.flags || result.regCode != RegisterCode_None;
+    }
+
+    if(valid)
+    {
+        char* end = 0;
+        result.value = (u16)strtol(equals + 1, &end, 0);
+        valid = end != equals + 1 && !*end;
+    }
+
+    if(valid)
+    {
+        *assignment = result;
+    }
+
+    return valid;
+}
+
+// Note: Fills queue with one job per input set, or a single job without
+// assignments when there is no input file
+bool ReadDiffInputs(char* fileName, DiffQueue* queue)
+{
+    if(!fileName)
+    {
+        queue->jobs = calloc(1, sizeof(DiffJob));
+        queue->jobCount = 1;
+        return true;
+    }
+
+    u32 textSize = 0;
+    char* text = ReadEntireFile(fileName, &textSize);
+    if(!text)
+    {
+        printf("Cannot load file %s\n", fileName);
+        return false;
+    }
+
+    u32 jobCapacity = 64;
+    queue->jobs = malloc(jobCapacity * sizeof(DiffJob));
+
+    bool result = true;
+    u32 lineNumber = 0;
+    for(char* line = text; result && *line;)
+    {
+        char* lineEnd = strchr(line, '\n');
+        char* next = lineEnd ? lineEnd + 1 : line + strlen(line);
+        if(lineEnd)
+        {
+            *lineEnd = 0;
+        }
+        ++lineNumber;
+
+        DiffJob job = {};
+        job.lineNumber = lineNumber;
+        for(char* token = strtok(line, " \t\r"); result && token && token[0] != ';'; token = strtok(0, " \t\r"))
+        {
+            result = job.assignmentCount < MAX_DIFF_ASSIGNMENTS && 
+                ParseDiffAssignment(token, job.assignments + job.assignmentCount);
+            if(!result)
+            {
+                printf("Bad assignment %s on line %u of %s\n", token, lineNumber, fileName);
+            }
+            ++job.assignmentCount;
+        }
+
+        if(result && job.assignmentCount)
+        {
+            if(queue->jobCount == jobCapacity)
+            {
+                jobCapacity *= 2;
+                queue->jobs = realloc(queue->jobs, jobCapacity * sizeof(DiffJob));
+            }
+            queue->jobs[queue->jobCount++] = job;
+        }
+
+        line = next;
+    }
+
+    free(text);
+    return result;
+}
+
+// Note: Runs one side with memory already pointing at its buffer
+void RunDiffSide(char* fileName, DiffJob* job, u64 maxInstructions, DiffState* state)
+{
+    ResetMachine();
+
+    u32 programSize = 0;
+    bool com = IsComFile(fileName);
+    state->loaded = com ? LoadComProgram(fileName, &programSize) : LoadProgram(fileName, &programSize);
+    state->imageStart = com ? COM_SEGMENT << 4 : 0;
+    state->imageEnd = state->imageStart + programSize;
+    if(!state->loaded)
+    {
+        return;
+    }
+
+    for(u32 index = 0; index < job->assignmentCount; ++index)
+    {
+        DiffAssignment assignment = job->assignments[index];
+        if(assignment.flags)
+        {
+            flags = assignment.value;
+        }
+        else if(assignment.regCode == IP)
+        {
+            ip = assignment.value;
+        }
+        else if(assignment.regCode != RegisterCode_None)
+        {
+            *GetRegister(&regs, assignment.regCode) = assignment.value;
+            if(assignment.regCode >= ES && assignment.regCode <= DS)
+            {
+                UpdateSegmentBase(&regs, assignment.regCode);
+            }
+        }
+        else
+        {
+            memory[assignment.address] = assignment.value & 0xff;
+            memory[(assignment.address + 1) & (MEMORY_SIZE - 1)] = assignment.value >> 8;
+        }
+    }
+
+    RunOptions options = {};
+    options.executionMode = true;
+    options.quiet = true;
+    options.maxInstructions = maxInstructions;
+    options.untilExit = com;
+    RunProgram(fileName, programSize, options);
+
+    for(u32 index = 0; index < DIFF_REGISTER_COUNT; ++index)
+    {
+        state->registers[index] = *GetRegister(&regs, diffRegisters[index]);
+    }
+    state->flags = flags;
+    state->clocks = clocks;
+    state->retired = instructionsRetired;
+    u64 limit = maxInstructions ? maxInstructions : (com ? COM_MAX_INSTRUCTIONS : 0);
+    state->stopped = limit && instructionsRetired >= limit;
+}
+
+void AppendDiffMessage(DiffJob* job, char* format, ...)
+{
+    size_t length = strlen(job->message);
+    if(length + 1 < sizeof(job->message))
+    {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(job->message + length, sizeof(job->message) - length, format, args);
+        va_end(args);
+    }
+}
+
+void CompareDiffRange(DiffJob* job, u8* memoryA, u8* memoryB, u32 start, u32 size)
+{
+    u32 differing = 0;
+    u32 first = 0;
+    for(u32 offset = 0; offset < size; ++offset)
+    {
+        u32 address = start + offset;
+        if(memoryA[address] != memoryB[address])
+        {
+            first = differing ? first : address;
+            ++differing;
+        }
+    }
+
+    if(differing)
+    {
+        AppendDiffMessage(job, " [0x%05x] 0x%02x/0x%02x (%u bytes differ)", first, memoryA[first], memoryB[first], differing);
+        job->same = false;
+    }
+}
+
+void RunDiffJob(DiffQueue* queue, DiffJob* job, u8** sideMemories)
+{
+    for(u32 side = 0; side < 2; ++side)
+    {
+        memory = sideMemories[side];
+        RunDiffSide(queue->fileNames[side], job, queue->maxInstructions, job->states + side);
+    }
+
+    DiffState* a = job->states;
+    DiffState* b = job->states + 1;
+    job->same = true;
+    for(u32 side = 0; side < 2; ++side)
+    {
+        if(!job->states[side].loaded)
+        {
+            AppendDiffMessage(job, " cannot load %s", queue->fileNames[side]);
+            job->same = false;
+            return;
+        }
+    }
+
+    for(u32 index = 0; index < DIFF_REGISTER_COUNT; ++index)
+    {
+        if(a->registers[index] != b->registers[index])
+        {
+            AppendDiffMessage(job, " %s 0x%04hx/0x%04hx", GetRegCodeStr(diffRegisters[index]), a->registers[index], b->registers[index]);
+            job->same = false;
+        }
+    }
+    if(a->flags != b->flags)
+    {
+        AppendDiffMessage(job, " flags 0x%04hx/0x%04hx", a->flags, b->flags);
+        job->same = false;
+    }
+
+    if(queue->rangeCount)
+    {
+        for(u32 index = 0; index < queue->rangeCount; ++index)
+        {
+            CompareDiffRange(job, sideMemories[0], sideMemories[1], queue->ranges[index].start, queue->ranges[index].size);
+        }
+    }
+    else
+    {
+        // Note: Both images live at the same place, only their lengths differ
+        u32 imageStart = a->imageStart;
+        u32 imageEnd = a->imageEnd > b->imageEnd ? a->imageEnd : b->imageEnd;
+        CompareDiffRange(job, sideMemories[0], sideMemories[1], 0, imageStart);
+        CompareDiffRange(job, sideMemories[0], sideMemories[1], imageEnd, MEMORY_SIZE - imageEnd);
+    }
+
+    if(a->stopped || b->stopped)
+    {
+        AppendDiffMessage(job, " (stopped at the instruction limit)");
+    }
+}
+
+void* DiffWorker(void* param)
+{
+    DiffQueue* queue = param;
+    output = fopen("/dev/null", "w");
+
+    u8* sideMemories[2];
+    sideMemories[0] = malloc(MEMORY_SIZE);
+    sideMemories[1] = malloc(MEMORY_SIZE);
+
+    for(;;)
+    {
+        u32 jobIndex = __atomic_fetch_add(&queue->nextJob, 1, __ATOMIC_RELAXED);
+        if(jobIndex >= queue->jobCount)
+        {
+            break;
+        }
+
+        RunDiffJob(queue, queue->jobs + jobIndex, sideMemories);
+    }
+
+    free(sideMemories[0]);
+    free(sideMemories[1]);
+    fclose(output);
+    return 0;
+}
+
+bool RunDifferential(char* fileA, char* fileB, char* inputFile, DiffRange* ranges, u32 rangeCount, u64 maxInstructions)
+{
+    DiffQueue queue = {};
+    queue.fileNames[0] = fileA;
+    queue.fileNames[1] = fileB;
+    memcpy(queue.ranges, ranges, rangeCount * sizeof(DiffRange));
+    queue.rangeCount = rangeCount;
+    queue.maxInstructions = maxInstructions;
+
+    if(!ReadDiffInputs(inputFile, &queue))
+    {
+        free(queue.jobs);
+        return false;
+    }
+
+    long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 threadCount = processorCount > 0 ? (u32)processorCount : 1;
+    if(threadCount > queue.jobCount)
+    {
+        threadCount = queue.jobCount;
+    }
+
+    pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+    for(u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        pthread_create(threads + threadIndex, 0, DiffWorker, &queue);
+    }
+    for(u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        pthread_join(threads[threadIndex], 0);
+    }
+    free(threads);
+
+    u32 sameCount = 0;
+    u64 clocksA = 0;
+    u64 clocksB = 0;
+    for(u32 jobIndex = 0; jobIndex < queue.jobCount; ++jobIndex)
+    {
+        DiffJob* job = queue.jobs + jobIndex;
+        DiffState* a = job->states;
+        DiffState* b = job->states + 1;
+        sameCount += job->same;
+        clocksA += a->clocks;
+        clocksB += b->clocks;
+
+        char label[32] = "initial state";
+        if(job->lineNumber)
+        {
+            snprintf(label, sizeof(label), "line %u", job->lineNumber);
+        }
+
+        printf("%s %s: clocks %llu -> %llu (%+lld)%s\n", job->same ? "SAME" : "DIFF", label,
+               (unsigned long long)a->clocks, (unsigned long long)b->clocks, 
+               (long long)b->clocks - (long long)a->clocks, job->message);
+    }
+
+    printf("%u/%u input sets match, clocks %llu -> %llu (%+lld)\n", sameCount, queue.jobCount,
+           (unsigned long long)clocksA, (unsigned long long)clocksB, (long long)clocksB - (long long)clocksA);
+
+    bool result = sameCount == queue.jobCount;
+    free(queue.jobs);
+
+    return result;
+}
+
+//
+// Decoder validation
+//
+
+// Note: A second decoder written straight from the opcode map, it shares
+// the register name tables with DecodeInstruction and nothing else. Every
+// prefix, first byte, modrm and fill pattern for the bytes after them is run
+// through both and the length and operands must agree. Bytes outside the
+// table must not decode to anything either.
+typedef enum ReferenceForm
+{
+    ReferenceForm_None,
+    ReferenceForm_Single,
+    ReferenceForm_RegRom,
+    ReferenceForm_SegRom,
+    ReferenceForm_AccImmediate,
+    ReferenceForm_RomImmediate,
+    ReferenceForm_RegImmediate,
+    ReferenceForm_AccAddress,
+    ReferenceForm_Short,
+    ReferenceForm_Byte,
+    ReferenceForm_Port,
+    ReferenceForm_String,
+    ReferenceForm_Segment,
+    ReferenceForm_Repeat,
+} ReferenceForm;
+
+typedef struct ReferenceEncoding
+{
+    u8 first;
+    u8 last;
+    ReferenceForm form;
+    InstructionCode instCode;
+} ReferenceEncoding;
+
+// Note: None on the immediate group means the reg field picks the operation
+ReferenceEncoding referenceEncodings[] = 
+{
+    { 0x00, 0x03, ReferenceForm_RegRom, Add },
+    { 0x04, 0x05, ReferenceForm_AccImmediate, Add },
+    { 0x08, 0x0b, ReferenceForm_RegRom, Or },
+    { 0x0c, 0x0d, ReferenceForm_AccImmediate, Or },
+    { 0x10, 0x13, ReferenceForm_RegRom, Adc },
+    { 0x14, 0x15, ReferenceForm_AccImmediate, Adc },
+    { 0x18, 0x1b, ReferenceForm_RegRom, Sbb },
+    { 0x1c, 0x1d, ReferenceForm_AccImmediate, Sbb },
+    { 0x20, 0x23, ReferenceForm_RegRom, And },
+    { 0x24, 0x25, ReferenceForm_AccImmediate, And },
+    { 0x26, 0x26, ReferenceForm_Segment, None },
+    { 0x28, 0x2b, ReferenceForm_RegRom, Sub },
+    { 0x2c, 0x2d, ReferenceForm_AccImmediate, Sub },
+    { 0x2e, 0x2e, ReferenceForm_Segment, None },
+    { 0x30, 0x33, ReferenceForm_RegRom, Xor },
+    { 0x34, 0x35, ReferenceForm_AccImmediate, Xor },
+    { 0x36, 0x36, ReferenceForm_Segment, None },
+    { 0x38, 0x3b, ReferenceForm_RegRom, Cmp },
+    { 0x3c, 0x3d, ReferenceForm_AccImmediate, Cmp },
+    { 0x3e, 0x3e, ReferenceForm_Segment, None },
+    { 0x70, 0x70, ReferenceForm_Short, Jo },
+    { 0x71, 0x71, ReferenceForm_Short, Jno },
+    { 0x72, 0x72, ReferenceForm_Short, Jb },
+    { 0x73, 0x73, ReferenceForm_Short, Jnb },
+    { 0x74, 0x74, ReferenceForm_Short, Je },
+    { 0x75, 0x75, ReferenceForm_Short, Jne },
+    { 0x76, 0x76, ReferenceForm_Short, Jbe },
+    { 0x77, 0x77, ReferenceForm_Short, Jnbe },
+    { 0x78, 0x78, ReferenceForm_Short, Js },
+    { 0x79, 0x79, ReferenceForm_Short, Jns },
+    { 0x7a, 0x7a, ReferenceForm_Short, Jp },
+    { 0x7b, 0x7b, ReferenceForm_Short, Jnp },
+    { 0x7c, 0x7c, ReferenceForm_Short, Jl },
+    { 0x7d, 0x7d, ReferenceForm_Short, Jnl },
+    { 0x7e, 0x7e, ReferenceForm_Short, Jle },
+    { 0x7f, 0x7f, ReferenceForm_Short, Jnle },
+    { 0x80, 0x83, ReferenceForm_RomImmediate, None },
+    { 0x88, 0x8b, ReferenceForm_RegRom, Mov },
+    { 0x8c, 0x8c, ReferenceForm_SegRom, Mov },
+    { 0x8e, 0x8e, ReferenceForm_SegRom, Mov },
+    { 0xa0, 0xa3, ReferenceForm_AccAddress, Mov },
+    { 0xa4, 0xa5, ReferenceForm_String, Movs },
+    { 0xa6, 0xa7, ReferenceForm_String, Cmps },
+    { 0xaa, 0xab, ReferenceForm_String, Stos },
+    { 0xac, 0xad, ReferenceForm_String, Lods },
+    { 0xae, 0xaf, ReferenceForm_String, Scas },
+    { 0xb0, 0xbf, ReferenceForm_RegImmediate, Mov },
+    { 0xc6, 0xc7, ReferenceForm_RomImmediate, Mov },
+    { 0xcd, 0xcd, ReferenceForm_Byte, Int },
+    { 0xcf, 0xcf, ReferenceForm_Single, Iret },
+    { 0xe0, 0xe0, ReferenceForm_Short, Loopne },
+    { 0xe1, 0xe1, ReferenceForm_Short, Loope },
+    { 0xe2, 0xe2, ReferenceForm_Short, Loop },
+    { 0xe3, 0xe3, ReferenceForm_Short, Jcxz },
+    { 0xe4, 0xe5, ReferenceForm_Port, In },
+    { 0xe6, 0xe7, ReferenceForm_Port, Out },
+    { 0xf2, 0xf3, ReferenceForm_Repeat, None },
+    { 0xf4, 0xf4, ReferenceForm_Single, Hlt },
+    { 0xfa, 0xfa, ReferenceForm_Single, Cli },
+    { 0xfb, 0xfb, ReferenceForm_Single, Sti },
+    { 0xfc, 0xfc, ReferenceForm_Single, Cld },
+    { 0xfd, 0xfd, ReferenceForm_Single, Std },
+};
+
+InstructionCode referenceGroup[8] = 
+{
+    Add, Or, Adc, Sbb, And, Sub, Xor, Cmp
+};
+
+ReferenceEncoding FindReferenceEncoding(u8 byte)
+{
+    ReferenceEncoding result = {};
+    u32 encodingCount = sizeof(referenceEncodings) / sizeof(referenceEncodings[0]);
+    for(u32 index = 0; index < encodingCount; ++index)
+    {
+        ReferenceEncoding encoding = referenceEncodings[index];
+        if(byte >= encoding.first && byte <= encoding.last)
+        {
+            result = encoding;
+            break;
+        }
+    }
+
+    return result;
+}
+
+s16 ReadReference16(u8* bytes, u32* length)
+{
+    s16 result = (s16)(bytes[*length] | (bytes[*length + 1] << 8));
+    *length += 2;
+    return result;
+}
+
+Operand ReferenceRom(u8* bytes, u32* length, u8 modrm, bool wide)
+{
+    Operand result = {};
+
+    u8 mod = modrm >> 6;
+    u8 rom = modrm & 0b111;
+    if(mod == 3)
+    {
+        result.opCode = Register;
+        result.regCode = regTable[wide][rom];
+    }
+    else
+    {
+        result.opCode = Memory;
+        result.regCode = romTable[rom];
+
+        if(mod == 0 && rom == 6)
+        {
+            result.regCode = RegisterCode_None;
+            result.displacement = ReadReference16(bytes, length);
+        }
+        else if(mod == 1)
+        {
+            result.displacement = (s8)bytes[(*length)++];
+        }
+        else if(mod == 2)
+        {
+            result.displacement = ReadReference16(bytes, length);
+        }
+    }
+
+    return result;
+}
+
+// Note: Returns the length, result has no instruction code when the bytes
+// are outside the table
+u32 DecodeReference(u8* bytes, Instruction* result)
+{
+    memset(result, 0, sizeof(*result));
+
+    u8 byte = bytes[0];
+    ReferenceEncoding encoding = FindReferenceEncoding(byte);
+    bool wide = byte & 1;
+    u32 length = 1;
+
+    result->instCode = encoding.instCode;
+    result->instFlags = wide ? INST_WIDE : 0;
+    Operand* operands = result->operands;
+
+    switch(encoding.form)
+    {
+    case ReferenceForm_None:
+    case ReferenceForm_Single:
+    case ReferenceForm_Short:
+    case ReferenceForm_Byte:
+    {
+        result->instFlags = 0;
+        if(encoding.form == ReferenceForm_Short)
+        {
+            operands[0].regCode = IP;
+            operands[0].displacement = (s8)bytes[length++] + 2;
+        }
+        else if(encoding.form == ReferenceForm_Byte)
+        {
+            operands[0].opCode = Immediate;
+            operands[0].displacement = bytes[length++];
+        }
+    } break;
+
+    case ReferenceForm_RegRom:
+    case ReferenceForm_SegRom:
+    {
+        bool toReg = byte & 2;
+        u8 modrm = bytes[length++];
+        u8 reg = (modrm >> 3) & 0b111;
+
+        Operand regOperand = {};
+        regOperand.opCode = Register;
+        if(encoding.form == ReferenceForm_SegRom)
+        {
+            wide = true;
+            result->instFlags = INST_WIDE;
+            regOperand.regCode = segTable[reg & 0b11];
+        }
+        else
+        {
+            regOperand.regCode = regTable[wide][reg];
+        }
+
+        Operand romOperand = ReferenceRom(bytes, &length, modrm, wide);
+        operands[0] = toReg ? regOperand : romOperand;
+        operands[1] = toReg ? romOperand : regOperand;
+    } break;
+
+    case ReferenceForm_AccImmediate:
+    {
+        operands[0].opCode = Register;
+        operands[0].regCode = wide ? AX : AL;
+        operands[1].opCode = Immediate;
+        operands[1].displacement = wide ? ReadReference16(bytes, &length) : bytes[length++];
+    } break;
+
+    case ReferenceForm_RomImmediate:
+    {
+        u8 modrm = bytes[length++];
+        if(result->instCode == None)
+        {
+            result->instCode = referenceGroup[(modrm >> 3) & 0b111];
+        }
+
+        operands[0] = ReferenceRom(bytes, &length, modrm, wide);
+        operands[1].opCode = Immediate;
+        if(byte == 0x83)
+        {
+            operands[1].displacement = (s8)bytes[length++];
+        }
+        else
+        {
+            operands[1].displacement = wide ? ReadReference16(bytes, &length) : bytes[length++];
+        }
+
+        if(operands[0].opCode == Memory)
+        {
+            operands[result->instCode == Mov ? 1 : 0].literals = wide ? "word" : "byte";
+        }
+    } break;
+
+    case ReferenceForm_RegImmediate:
+    {
+        wide = byte & 0b1000;
+        result->instFlags = wide ? INST_WIDE : 0;
+        operands[0].opCode = Register;
+        operands[0].regCode = regTable[wide][byte & 0b111];
+        operands[1].opCode = Immediate;
+        operands[1].displacement = wide ? ReadReference16(bytes, &length) : bytes[length++];
+    } break;
+
+    case ReferenceForm_AccAddress:
+    {
+        Operand accumulator = { .opCode = Register, .regCode = wide ? AX : AL };
+        Operand address = { .opCode = Memory, .regCode = RegisterCode_None };
+        address.displacement = ReadReference16(bytes, &length);
+
+        bool toMemory = byte & 2;
+        operands[0] = toMemory ? address : accumulator;
+        operands[1] = toMemory ? accumulator : address;
+    } break;
+
+    case ReferenceForm_Port:
+    {
+        Operand accumulator = { .opCode = Register, .regCode = wide ? AX : AL };
+        Operand port = { .opCode = Immediate, .regCode = RegisterCode_None, .displacement = bytes[length++] };
+
+        bool output = byte & 2;
+        operands[0] = output ? port : accumulator;
+        operands[1] = output ? accumulator : port;
+    } break;
+
+    case ReferenceForm_String: break;
+
+    case ReferenceForm_Repeat:
+    {
+        // Note: Only in front of a string instruction, segment overrides in
+        // between apply to it and the one closest to the opcode wins
+        RegisterCode segment = RegisterCode_None;
+        ReferenceEncoding next = FindReferenceEncoding(bytes[length]);
+        while(next.form == ReferenceForm_Segment)
+        {
+            segment = segTable[(bytes[length] >> 3) & 0b11];
+            next = FindReferenceEncoding(bytes[++length]);
+        }
+
+        if(next.form == ReferenceForm_String)
+        {
+            result->instCode = next.instCode;
+            result->instFlags = (bytes[length] & 1) ? INST_WIDE : 0;
+            result->instFlags |= byte == 0xf2 ? INST_REPNE : INST_REP;
+            operands[0].segment = segment;
+            operands[1].segment = segment;
+        }
+        else
+        {
+            result->instCode = None;
+        }
+        ++length;
+    } break;
+
+    case ReferenceForm_Segment:
+    {
+        length += DecodeReference(bytes + 1, result);
+
+        // Note: The prefix closest to the opcode wins
+        if(!operands[0].segment)
+        {
+            operands[0].segment = segTable[(byte >> 3) & 0b11];
+            operands[1].segment = segTable[(byte >> 3) & 0b11];
+        }
+    } break;
     }
-    break;
 
-    default: break;
+    return length;
+}
+
+bool OperandsEqual(Operand a, Operand b)
+{
+    bool literalsEqual = (!a.literals && !b.literals) || 
+                         (a.literals && b.literals && strcmp(a.literals, b.literals) == 0);
+    bool result = a.opCode == b.opCode && a.regCode == b.regCode && a.displacement == b.displacement && 
+                  a.segment == b.segment && literalsEqual;
+    return result;
+}
+
+// Note: Prefix 0 is none, the first byte runs through every value after it
+// so two prefixes in a row are covered too. The fills go into every byte
+// after the modrm and pick out sign and byte order mistakes.
+#define VALIDATE_BYTES 16
+#define VALIDATE_FILL_COUNT 5
+#define VALIDATE_EXAMPLES 4
+
+u8 validatePrefixes[] = { 0, 0x26, 0x2e, 0x36, 0x3e, 0xf2, 0xf3 };
+
+u8 validateFills[VALIDATE_FILL_COUNT][4] = 
+{
+    { 0x00, 0x00, 0x00, 0x00 },
+    { 0xff, 0xff, 0xff, 0xff },
+    { 0x7f, 0x80, 0x7f, 0x80 },
+    { 0x80, 0x7f, 0x80, 0x7f },
+    { 0x34, 0x12, 0x78, 0x56 },
+};
+
+typedef struct ValidateJob
+{
+    u64 encodingCount;
+    u64 decodedCount;
+    u64 mismatchCount;
+    u64 unsupportedCount;
+
+    u32 exampleCount;
+    u8 examples[VALIDATE_EXAMPLES][VALIDATE_BYTES];
+} ValidateJob;
+
+typedef struct ValidateQueue
+{
+    ValidateJob* jobs;
+    u32 jobCount;
+    u32 nextJob;
+} ValidateQueue;
+
+u32 FillValidateBytes(u8* bytes, u32 jobIndex, u32 modrm, u32 fillIndex)
+{
+    u8 prefix = validatePrefixes[jobIndex >> 8];
+    u32 length = 0;
+    if(prefix)
+    {
+        bytes[length++] = prefix;
     }
 
-    s16 regAfter = *GetRegister(registers, leftOperand.regCode);
+    bytes[length++] = (u8)jobIndex;
+    bytes[length++] = (u8)modrm;
+    for(u32 index = length; index < VALIDATE_BYTES; ++index)
+    {
+        bytes[index] = validateFills[fillIndex][index & 3];
+    }
 
-    result.regBefore = regBefore;
-    result.regAfter = regAfter;
+    return length;
+}
+
+bool IsDecodeValid(u8* bytes, Instruction* decoded, u32* decodedLength, Instruction* expected, u32* expectedLength)
+{
+    ip = 0;
+    *decoded = DecodeInstruction(bytes);
+    *decodedLength = (u16)ip;
+    *expectedLength = DecodeReference(bytes, expected);
+
+    bool result;
+    if(expected->instCode == None)
+    {
+        result = decoded->instCode == None;
+    }
+    else
+    {
+        result = decoded->instCode == expected->instCode && *decodedLength == *expectedLength && 
+                 decoded->instFlags == expected->instFlags && 
+                 OperandsEqual(decoded->operands[0], expected->operands[0]) && 
+                 OperandsEqual(decoded->operands[1], expected->operands[1]);
+    }
 
     return result;
 }
 
-void PrintInstruction(InstructionCode code, Operand leftOperand, Operand rightOperand)
+void RunValidateJob(ValidateJob* job, u32 jobIndex)
 {
-    char* instructionCode = GetInstructionCodeStr(code);
-    char* leftOperandStr = GetRegCodeStr(leftOperand.regCode);
-    char* rightOperandStr = GetRegCodeStr(rightOperand.regCode);
+    u8 bytes[VALIDATE_BYTES];
+    for(u32 modrm = 0; modrm < 256; ++modrm)
+    {
+        for(u32 fillIndex = 0; fillIndex < VALIDATE_FILL_COUNT; ++fillIndex)
+        {
+            FillValidateBytes(bytes, jobIndex, modrm, fillIndex);
 
-    fprintf(stdout, "%s ", instructionCode);
+            Instruction decoded, expected;
+            u32 decodedLength, expectedLength;
+            bool valid = IsDecodeValid(bytes, &decoded, &decodedLength, &expected, &expectedLength);
 
-    switch(code)
+            ++job->encodingCount;
+            job->decodedCount += expected.instCode != None;
+
+            // Note: The 8086 has no invalid opcodes, every byte sequence runs
+            // as something, so both sides giving up is a hole in the coverage
+            // rather than a match
+            job->unsupportedCount += expected.instCode == None && decoded.instCode == None;
+            if(!valid)
+            {
+                ++job->mismatchCount;
+                if(job->exampleCount < VALIDATE_EXAMPLES)
+                {
+                    memcpy(job->examples[job->exampleCount++], bytes, VALIDATE_BYTES);
+                }
+            }
+        }
+    }
+}
+
+void* ValidateWorker(void* param)
+{
+    ValidateQueue* queue = param;
+    output = fopen("/dev/null", "w");
+
+    for(;;)
     {
+        u32 jobIndex = __atomic_fetch_add(&queue->nextJob, 1, __ATOMIC_RELAXED);
+        if(jobIndex >= queue->jobCount)
+        {
+            break;
+        }
 
-    case Add:
-    case Or:
-    case Adc:
-    case Sbb:
-    case And:
-    case Sub:
-    case Xor:
-    case Cmp:
+        RunValidateJob(queue->jobs + jobIndex, jobIndex);
+    }
+
+    fclose(output);
+    return 0;
+}
+
+void PrintValidateDecode(char* label, u8* bytes, Instruction instruction, u32 length)
+{
+    fprintf(output, "    %-9s", label);
+    if(instruction.instCode != None)
     {
-        if(leftOperand.opCode == Register)
+        PrintInstruction(instruction);
+    }
+    else
+    {
+        fprintf(output, "unknown");
+    }
+
+    fprintf(output, " ;");
+    for(u32 index = 0; index < length && index < VALIDATE_BYTES; ++index)
+    {
+        fprintf(output, " %02x", bytes[index]);
+    }
+    fprintf(output, "\n");
+}
+
+// Note: One job per prefix and first byte, handed out to a thread per core.
+// Mismatches are reported per job with a few examples after every thread is
+// done so the order does not depend on timing.
+bool ValidateDecoder()
+{
+    ValidateQueue queue = {};
+    queue.jobCount = sizeof(validatePrefixes) * 256;
+    queue.jobs = calloc(queue.jobCount, sizeof(ValidateJob));
+
+    long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 threadCount = processorCount > 0 ? (u32)processorCount : 1;
+
+    u64 start = ReadOSTimer();
+
+    pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+    for(u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        pthread_create(threads + threadIndex, 0, ValidateWorker, &queue);
+    }
+    for(u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        pthread_join(threads[threadIndex], 0);
+    }
+    free(threads);
+
+    u64 elapsed = ReadOSTimer() - start;
+
+    u64 encodingCount = 0;
+    u64 decodedCount = 0;
+    u64 mismatchCount = 0;
+    for(u32 jobIndex = 0; jobIndex < queue.jobCount; ++jobIndex)
+    {
+        ValidateJob* job = queue.jobs + jobIndex;
+        encodingCount += job->encodingCount;
+        decodedCount += job->decodedCount;
+        mismatchCount += job->mismatchCount;
+
+        if(!job->mismatchCount)
         {
-            fprintf(stdout, "%s, ", leftOperandStr);
+            continue;
         }
-        else if(leftOperand.opCode == Memory)
+
+        u8 prefix = validatePrefixes[jobIndex >> 8];
+        if(prefix)
+        {
+            fprintf(output, "%02x %02x: ", prefix, jobIndex & 0xff);
+        }
+        else
+        {
+            fprintf(output, "%02x: ", jobIndex & 0xff);
+        }
+        fprintf(output, "%llu mismatches\n", (unsigned long long)job->mismatchCount);
+
+        for(u32 exampleIndex = 0; exampleIndex < job->exampleCount; ++exampleIndex)
+        {
+            u8* bytes = job->examples[exampleIndex];
+
+            Instruction decoded, expected;
+            u32 decodedLength, expectedLength;
+            FILE* reportOutput = output;
+            output = fopen("/dev/null", "w");
+            IsDecodeValid(bytes, &decoded, &decodedLength, &expected, &expectedLength);
+            fclose(output);
+            output = reportOutput;
+
+            PrintValidateDecode("decoded", bytes, decoded, decodedLength);
+            PrintValidateDecode("expected", bytes, expected, expectedLength);
+        }
+    }
+
+    // Note: Opcodes neither decoder knows are listed as runs of first bytes.
+    // A prefix as the first byte only points at the byte after it, which its
+    // own row covers, and prefix rows that match the bare row are left out.
+    u64 unsupportedCount = 0;
+    bool unsupported[sizeof(validatePrefixes)][256] = {};
+    for(u32 jobIndex = 0; jobIndex < queue.jobCount; ++jobIndex)
+    {
+        u32 first = jobIndex & 0xff;
+        bool prefix = memchr(validatePrefixes + 1, first, sizeof(validatePrefixes) - 1) != 0;
+
+        unsupportedCount += queue.jobs[jobIndex].unsupportedCount;
+        unsupported[jobIndex >> 8][first] = queue.jobs[jobIndex].unsupportedCount && !prefix;
+    }
+
+    for(u32 prefixIndex = 0; prefixIndex < sizeof(validatePrefixes); ++prefixIndex)
+    {
+        bool* row = unsupported[prefixIndex];
+        if(prefixIndex && memcmp(row, unsupported[0], 256 * sizeof(bool)) == 0)
         {
-            if(rightOperand.opCode == Immediate)
+            continue;
+        }
+
+        bool printed = false;
+        for(u32 first = 0; first < 256; ++first)
+        {
+            if(!row[first] || (first && row[first - 1]))
             {
-                if(leftOperand.literals)
-                {
-                    fprintf(stdout, "%s [%s", leftOperand.literals, leftOperandStr);
+                continue;
+            }
 
-                    if(leftOperand.displacement)
-                    {
-                        fprintf(stdout, " + %d", leftOperand.displacement);
-                    }
+            u32 last = first;
+            while(last < 255 && row[last + 1])
+            {
+                ++last;
+            }
 
-                    fprintf(stdout, "], ");
+            if(!printed)
+            {
+                u8 prefix = validatePrefixes[prefixIndex];
+                if(prefix)
+                {
+                    fprintf(output, "unsupported after %02x:", prefix);
                 }
                 else
                 {
-                    fprintf(stdout, "%s, ", leftOperandStr);
+                    fprintf(output, "unsupported:");
                 }
+                printed = true;
             }
-            else
-            {
-                fprintf(stdout, "[%s", leftOperandStr);
-
-                if(leftOperand.displacement)
-                {
-                    fprintf(stdout, " + %d", leftOperand.displacement);
-                }
 
-                fprintf(stdout, "], ");
+            if(last == first)
+            {
+                fprintf(output, " %02x", first);
             }
-        }
-        else if(leftOperand.opCode == Immediate)
-        {
-            if(leftOperand.literals)
+            else
             {
-                fprintf(stdout, "%s ", leftOperand.literals);
+                fprintf(output, " %02x-%02x", first, last);
             }
-
-            fprintf(stdout, "[%d], ", leftOperand.displacement);
         }
 
-        if(rightOperand.opCode == Register)
+        if(printed)
         {
-            fprintf(stdout, "%s", rightOperandStr);
+            fprintf(output, "\n");
         }
-        else if(rightOperand.opCode == Memory)
+    }
+
+    double seconds = (double)elapsed / (double)OS_TIMER_FREQ;
+    fprintf(output, "%llu encodings, %llu in the table, %llu mismatches, %llu unsupported in %.3fs on %u threads\n", 
+            (unsigned long long)encodingCount, (unsigned long long)decodedCount, 
+            (unsigned long long)mismatchCount, (unsigned long long)unsupportedCount, seconds, threadCount);
+
+    free(queue.jobs);
+
+    bool passed = mismatchCount == 0;
+    return passed;
+}
+
+//
+// Benchmark
+//
+
+// Note: Streams are cut into chunks that start on an instruction and stay
+// below the 64k the decoder cursor can address. The sweep holds every byte
+// sequence of up to two opcode bytes and a modrm, filled in with two
+// displacement patterns, that decodes and encodes back to itself, so it
+// follows whatever the decoder supports. The mix is a runnable program of
+// short counted loops over typical register, memory, immediate and branch
+// instructions, repeated to the stream size for decoding.
+#define BENCH_CHUNK_SIZE 0xf000
+#define BENCH_MAX_CHUNKS 64
+#define BENCH_MIX_CHUNKS 16
+#define BENCH_MIX_LOOP_BYTES 96
+#define BENCH_MIX_LOOP_COUNT 8
+#define BENCH_WARMUP_RUNS 3
+#define BENCH_DEFAULT_RUNS 15
+#define BENCH_MAX_RUNS 1000
+#define BENCH_TOLERANCE 0.05
+#define BENCH_MAX_BASELINE 16
+#define BENCH_DATA_BASE 0x20000
+
+typedef struct BenchStream
+{
+    u8* bytes;
+    u32 size;
+    u32 chunkStart;
+    u32 chunkEnds[BENCH_MAX_CHUNKS];
+    u32 chunkCount;
+
+    u64 instructionCount;
+    u64 executedBytes;
+} BenchStream;
+
+typedef u64 BenchFunction(BenchStream* stream);
+
+typedef struct BenchCase
+{
+    char* name;
+    BenchStream* stream;
+    BenchFunction* function;
+} BenchCase;
+
+typedef struct BenchResult
+{
+    char name[32];
+    u64 bytes;
+    u64 instructions;
+    double best;
+    double median;
+    double spread;
+} BenchResult;
+
+bool AppendBenchBytes(BenchStream* stream, u8* bytes, u32 length)
+{
+    if(stream->size + length - stream->chunkStart > BENCH_CHUNK_SIZE)
+    {
+        stream->chunkEnds[stream->chunkCount++] = stream->size;
+        stream->chunkStart = stream->size;
+    }
+
+    bool result = stream->chunkCount < BENCH_MAX_CHUNKS;
+    if(result)
+    {
+        memcpy(stream->bytes + stream->size, bytes, length);
+        stream->size += length;
+        ++stream->instructionCount;
+    }
+
+    return result;
+}
+
+void EndBenchStream(BenchStream* stream)
+{
+    if(stream->size > stream->chunkStart)
+    {
+        stream->chunkEnds[stream->chunkCount++] = stream->size;
+        stream->chunkStart = stream->size;
+    }
+}
+
+BenchStream* AllocateBenchStream(void)
+{
+    BenchStream* result = calloc(1, sizeof(BenchStream));
+    result->bytes = malloc(BENCH_MAX_CHUNKS * BENCH_CHUNK_SIZE);
+    return result;
+}
+
+// Note: Returns the length when the bytes decode to an instruction that
+// encodes to the same bytes, 0 otherwise
+u32 CheckBenchForm(u8* bytes)
+{
+    ip = 0;
+    Instruction instruction = DecodeInstruction(bytes);
+    u32 length = (u16)ip;
+
+    u8 encoded[16];
+    u32 encodedSize = instruction.instCode != None ? EncodeInstruction(instruction, encoded) : 0;
+    u32 result = encodedSize == length && length && memcmp(encoded, bytes, length) == 0 ? length : 0;
+
+    ip = 0;
+    return result;
+}
+
+void BuildOpcodeSweep(BenchStream* stream)
+{
+    u8 fills[2][6] = 
+    {
+        { 0x34, 0x12, 0x78, 0x56, 0xbc, 0x9a },
+        { 0xf0, 0xff, 0x80, 0x7f, 0x01, 0x80 },
+    };
+
+    // Note: A second opcode byte only matters after a prefix, everything
+    // else would just give the same instructions again
+    for(u32 fillIndex = 0; fillIndex < 2; ++fillIndex)
+    {
+        for(u32 first = 0; first < 256; ++first)
         {
-            fprintf(stdout, "[");
-            if(rightOperand.regCode != RegisterCode_None)
-            {
-                char* rightOperandStr = GetRegCodeStr(rightOperand.regCode);
-                fprintf(stdout, "%s", rightOperandStr);
+            u8 bytes[16] = {};
+            bool prefix = first == 0x26 || first == 0x2e || first == 0x36 || first == 0x3e || first == 0xf2 || first == 0xf3;
 
-                if(rightOperand.displacement)
+            for(u32 second = 0; second < (prefix ? 256u : 1u); ++second)
+            {
+                u32 opcodeSize = prefix ? 2 : 1;
+                for(u32 modrm = 0; modrm < 256; ++modrm)
                 {
-                    fprintf(stdout, " + %d", rightOperand.displacement);
+                    bytes[0] = first;
+                    bytes[1] = prefix ? second : modrm;
+                    bytes[2] = prefix ? modrm : fills[fillIndex][0];
+                    memcpy(bytes + 3, fills[fillIndex] + (prefix ? 0 : 1), 5);
+
+                    u32 length = CheckBenchForm(bytes);
+                    bool usesModrm = length > opcodeSize;
+                    if(length && (usesModrm || modrm == 0))
+                    {
+                        AppendBenchBytes(stream, bytes, length);
+                    }
                 }
             }
-            else
-            {
-                fprintf(stdout, "%d", rightOperand.displacement);
-            }
-
-            fprintf(stdout, "]");
-        }
-        else if(rightOperand.opCode == Immediate)
-        {
-            fprintf(stdout, "%d", rightOperand.displacement);
         }
-    } break;
+    }
 
-    case Mov: 
+    EndBenchStream(stream);
+}
+
+u32 BenchRandom(u32* state)
+{
+    u32 value = *state;
+    value ^= value << 13;
+    value ^= value >> 17;
+    value ^= value << 5;
+    *state = value;
+    return value;
+}
+
+// Note: Forms the decoder does not give back the same way are left out,
+// returns the size written
+u32 EmitBenchInstruction(u8* out, InstructionCode code, Operand left, Operand right, bool wide)
+{
+    Instruction instruction = {};
+    instruction.instCode = code;
+    instruction.instFlags = wide ? INST_WIDE : 0;
+    instruction.operands[0] = left;
+    instruction.operands[1] = right;
+
+    u8 encoded[16] = {};
+    u32 size = EncodeInstruction(instruction, encoded);
+    u32 result = CheckBenchForm(encoded) == size ? size : 0;
+    memcpy(out, encoded, result);
+
+    return result;
+}
+
+// Note: cx counts the loops and sp is left alone, data goes to segment
+// 2000h so stores never land in the code
+u32 BuildRealisticProgram(u8* out, u32 capacity, u64* executedBytes)
+{
+    static u8 prologue[] = 
     {
-        if(leftOperand.opCode == Register)
-        {
-            fprintf(stdout, "%s, ", leftOperandStr);
-        }
-        else if(leftOperand.opCode == Memory)
+        0xb8, 0x00, 0x20, // mov ax, 2000h
+        0x8e, 0xd8,       // mov ds, ax
+        0x8e, 0xc0,       // mov es, ax
+        0x8e, 0xd0,       // mov ss, ax
+    };
+    RegisterCode registers[] = { AX, BX, DX, SI, DI, BP };
+    RegisterCode bases[] = { BX_SI, BX_DI, BP_SI, BP_DI, SI, DI, BP, BX, RegisterCode_None };
+    InstructionCode arithmetic[] = { Add, Sub, Cmp, And, Or, Xor, Adc, Sbb };
+
+    u32 state = 0x2545f491;
+    u32 size = sizeof(prologue);
+    memcpy(out, prologue, size);
+    *executedBytes = size;
+
+    while(size + BENCH_MIX_LOOP_BYTES + 32 < capacity)
+    {
+        Operand counter = { .opCode = Register, .regCode = CX };
+        Operand count = { .opCode = Immediate, .regCode = RegisterCode_None, .displacement = BENCH_MIX_LOOP_COUNT };
+        u32 counterSize = EmitBenchInstruction(out + size, Mov, counter, count, true);
+        size += counterSize;
+        *executedBytes += counterSize;
+
+        u32 loopStart = size;
+        while(size - loopStart < BENCH_MIX_LOOP_BYTES)
         {
-            fprintf(stdout, "[%s", leftOperandStr);
+            u32 choice = BenchRandom(&state) % 100;
+            bool wide = BenchRandom(&state) % 4 != 0;
+            RegisterCode reg = registers[BenchRandom(&state) % 6];
+            RegisterCode other = registers[BenchRandom(&state) % 6];
+            if(!wide)
+            {
+                reg = (RegisterCode)(AL + (reg == AX ? 0 : reg == BX ? 3 : 2));
+                other = (RegisterCode)(AL + (other == AX ? 0 : other == BX ? 3 : 2));
+            }
 
-            if(leftOperand.displacement)
+            Operand left = { .opCode = Register, .regCode = reg };
+            Operand right = { .opCode = Register, .regCode = other };
+            Operand memoryOperand = { .opCode = Memory, .regCode = bases[BenchRandom(&state) % 9] };
+            memoryOperand.displacement = BenchRandom(&state) % 3 == 0 ? (s16)BenchRandom(&state) : (s8)BenchRandom(&state);
+            if(memoryOperand.regCode == RegisterCode_None)
             {
-                fprintf(stdout, " + %d", leftOperand.displacement);
+                memoryOperand.displacement = 0x100 + (BenchRandom(&state) & 0x0ffe);
             }
+            Operand immediate = { .opCode = Immediate, .regCode = RegisterCode_None, .displacement = (s16)(BenchRandom(&state) & (wide ? 0x7fff : 0x7f)) };
+            InstructionCode operation = arithmetic[BenchRandom(&state) % 8];
 
-            fprintf(stdout, "], ");
-        }
-        else if(leftOperand.opCode == Immediate)
-        {
-            if(rightOperand.regCode == AL || rightOperand.regCode == AX)
+            if(choice < 25)
             {
-                fprintf(stdout, "[%d], ", leftOperand.displacement);
+                size += EmitBenchInstruction(out + size, Mov, left, right, wide);
             }
-            else
+            else if(choice < 40)
             {
-                fprintf(stdout, "%d, ", leftOperand.displacement);
+                size += EmitBenchInstruction(out + size, Mov, left, memoryOperand, wide);
             }
-        }
-
-        if(rightOperand.opCode == Register)
-        {
-            fprintf(stdout, "%s", rightOperandStr);
-        }
-        else if(rightOperand.opCode == Memory)
-        {
-            fprintf(stdout, "[");
-            if(rightOperand.regCode != RegisterCode_None)
+            else if(choice < 50)
             {
-                fprintf(stdout, "%s", rightOperandStr);
-
-                if(rightOperand.displacement)
-                {
-                    fprintf(stdout, " + %d", rightOperand.displacement);
-                }
+                size += EmitBenchInstruction(out + size, Mov, memoryOperand, right, wide);
             }
-            else
+            else if(choice < 65)
             {
-                fprintf(stdout, "%d", rightOperand.displacement);
+                size += EmitBenchInstruction(out + size, operation, left, right, wide);
             }
-
-            fprintf(stdout, "]");
-        }
-        else if(rightOperand.opCode == Immediate)
-        {
-            if(leftOperand.regCode == AL || leftOperand.regCode == AX)
+            else if(choice < 80)
+            {
+                size += EmitBenchInstruction(out + size, operation, left, immediate, wide);
+            }
+            else if(choice < 90)
             {
-                fprintf(stdout, "[%d]", rightOperand.displacement);
+                size += EmitBenchInstruction(out + size, operation, left, memoryOperand, wide);
             }
             else
             {
-                if(rightOperand.literals)
+                // Note: A conditional jump over a two byte mov
+                u8 skipped[16];
+                Operand skip = { .opCode = Immediate, .regCode = IP, .displacement = 4 };
+                Operand none = {};
+                if(EmitBenchInstruction(skipped, Mov, left, right, wide) == 2)
                 {
-                    fprintf(stdout, "%s ", rightOperand.literals);
+                    size += EmitBenchInstruction(out + size, jumpTable[BenchRandom(&state) % 16], skip, none, false);
+                    size += EmitBenchInstruction(out + size, Mov, left, right, wide);
                 }
-                fprintf(stdout, "%d", rightOperand.displacement);
             }
         }
-    } break;
 
-    case Jo:
-    case Jno:
-    case Jb: 
-    case Jnb: 
-    case Je: 
-    case Jne: 
-    case Jbe: 
-    case Jnbe:
-    case Js: 
-    case Jns:
-    case Jp: 
-    case Jnp:
-    case Jl: 
-    case Jnl:
-    case Jle:
-    case Jnle: 
-    case Loopne:
-    case Loope:
-    case Loop:
-    case Jcxz:
-    { 
-        fprintf(stdout, "$+%d", leftOperand.displacement);
+        Operand back = { .opCode = Immediate, .regCode = IP, .displacement = (s16)(loopStart - size) };
+        Operand none = {};
+        size += EmitBenchInstruction(out + size, Loop, back, none, false);
+        *executedBytes += (u64)(size - loopStart) * BENCH_MIX_LOOP_COUNT;
     }
-    break;
 
-
-    default: break;
-    }
+    return size;
 }
 
-void PrintRegister(Registers *regs, RegisterCode regCode)
+void BuildRealisticMix(BenchStream* stream, BenchStream* program)
 {
-    s16 reg = *GetRegister(regs, regCode);
-    if(reg)
+    program->size = BuildRealisticProgram(program->bytes, BENCH_CHUNK_SIZE, &program->executedBytes);
+    program->chunkEnds[0] = program->size;
+    program->chunkCount = 1;
+
+    for(u32 chunkIndex = 0; chunkIndex < BENCH_MIX_CHUNKS; ++chunkIndex)
     {
-        char *str = GetRegCodeStr(regCode);
-        fprintf(stdout, "%10s: 0x%04hx (%d)\n", str, reg, (u16)reg);
+        u32 offset = 0;
+        while(offset < program->size)
+        {
+            ip = 0;
+            DecodeInstruction(program->bytes + offset);
+            u32 length = (u16)ip;
+            AppendBenchBytes(stream, program->bytes + offset, length);
+            offset += length;
+        }
+        EndBenchStream(stream);
     }
+    ip = 0;
+    program->instructionCount = stream->instructionCount / BENCH_MIX_CHUNKS;
 }
 
-Instruction RegRom(InstructionCode instCode, u8 byte1, u8 byte2, u8* buffer, u8 wide, u8 reg, u8 imm)
+u64 BenchDecode(BenchStream* stream)
 {
-    Instruction result = {};
-    result.instCode = instCode;
+    u64 result = 0;
+    u32 chunkStart = 0;
+    for(u32 chunkIndex = 0; chunkIndex < stream->chunkCount; ++chunkIndex)
+    {
+        u8* chunk = stream->bytes + chunkStart;
+        u16 chunkSize = stream->chunkEnds[chunkIndex] - chunkStart;
 
-    u8 dir = (byte1 >> 1) & 0b1;
-    u8 mod = (byte2 >> 6) & 0b11;
-    u8 rom = (byte2 >> 0) & 0b111;
+        ip = 0;
+        while((u16)ip < chunkSize)
+        {
+            DecodeInstruction(chunk);
+            ++result;
+        }
+        chunkStart = stream->chunkEnds[chunkIndex];
+    }
 
-    char* op = GetInstructionCodeStr(instCode);
+    ip = 0;
+    return result;
+}
 
-    if(imm == 0b1)
+u64 BenchDecodePrint(BenchStream* stream)
+{
+    u64 result = 0;
+    u32 chunkStart = 0;
+    for(u32 chunkIndex = 0; chunkIndex < stream->chunkCount; ++chunkIndex)
     {
-        s16 data = byte2;
+        u8* chunk = stream->bytes + chunkStart;
+        u16 chunkSize = stream->chunkEnds[chunkIndex] - chunkStart;
 
-        if(wide)
+        ip = 0;
+        while((u16)ip < chunkSize)
         {
-            u8 byte3 = buffer[ip++];
-            data = (byte3 << 8) | byte2;
+            PrintInstruction(DecodeInstruction(chunk));
+            fprintf(output, "\n");
+            ++result;
         }
-
-        result.operands[0].opCode = Register;
-        result.operands[0].regCode = regTable[wide][reg];
-        result.operands[1].opCode = Immediate;
-        result.operands[1].displacement = data;
+        chunkStart = stream->chunkEnds[chunkIndex];
     }
-    else
-    {
-        if(mod == 0b00)
-        {
-            if(rom == 0b110)
-            {
-                u8 byte3 = buffer[ip++];
-                u8 byte4 = buffer[ip++];
-                s16 data = (byte4 << 8) | byte3;
 
-                result.operands[0].opCode = Register;
-                result.operands[0].regCode = regTable[wide][reg];
-                result.operands[1].opCode = Memory;
-                result.operands[1].displacement = data;
-            }
-            else
-            {   
-                if(dir)
-                {
-                    result.operands[0].opCode = Register;
-                    result.operands[0].regCode = regTable[wide][reg];
-                    result.operands[1].opCode = Memory;
-                    result.operands[1].regCode = romTable[rom];
-                }
-                else
-                {
-                    result.operands[0].opCode = Memory;
-                    result.operands[0].regCode = romTable[rom];
-                    result.operands[1].opCode = Register;
-                    result.operands[1].regCode = regTable[wide][reg];
-                }
-            }
-        }
-        else if(mod == 0b01)
-        {
-            s8 data = buffer[ip++];
+    ip = 0;
+    return result;
+}
 
-            if(dir)
-            {
-                result.operands[0].opCode = Register;
-                result.operands[0].regCode = regTable[wide][reg];
-                result.operands[1].opCode = Memory;
-                result.operands[1].regCode = romTable[rom];
-                result.operands[1].displacement = data;
-            }
-            else
-            {
-                result.operands[0].opCode = Memory;
-                result.operands[0].regCode = romTable[rom];
-                result.operands[0].displacement = data;
-                result.operands[1].opCode = Register;
-                result.operands[1].regCode = regTable[wide][reg];
-            }
-        }
-        else if(mod == 0b10)
-        {
-            u8 byte3 = buffer[ip++];
-            u8 byte4 = buffer[ip++];
-            s16 data = (byte4 << 8) | byte3;
+u64 BenchExecute(BenchStream* program)
+{
+    Registers emptyRegisters = {};
+    regs = emptyRegisters;
+    ip = 0;
+    flags = 0;
+    clocks = 0;
+    instructionsRetired = 0;
+    halted = false;
+    memcpy(memory, program->bytes, program->size);
+    memset(memory + BENCH_DATA_BASE, 0, 0x10000);
+
+    RunOptions options = {};
+    options.executionMode = true;
+    options.quiet = true;
+    RunProgram("bench", program->size, options);
+
+    return instructionsRetired;
+}
 
-            if(dir)
-            {
-                result.operands[0].opCode = Register;
-                result.operands[0].regCode = regTable[wide][reg];
-                result.operands[1].opCode = Memory;
-                result.operands[1].regCode = romTable[rom];
-                result.operands[1].displacement = data;
-            }
-            else
-            {
-                result.operands[0].opCode = Memory;
-                result.operands[0].regCode = romTable[rom];
-                result.operands[0].displacement = data;
-                result.operands[1].opCode = Register;
-                result.operands[1].regCode = regTable[wide][reg];
-            }
-        }
-        else if(mod == 0b11)
-        {
-            u8 src = dir ? reg : rom;
-            u8 dest = dir ? rom : reg;
+// Note: Every sweep form runs once on its own from the same registers, the
+// decoder's position is kept apart from ip so jumps, int and iret only
+// change state that is reset before the next one. ax is 0 so int 21h only
+// terminates, cx keeps rep forms short and data goes to BENCH_DATA_BASE.
+u64 BenchExecuteSweep(BenchStream* stream)
+{
+    Registers start = {};
+    start.cx = 4;
+    start.sp = 0x1000;
+    start.es = start.ss = start.ds = BENCH_DATA_BASE >> 4;
+    UpdateSegmentBase(&start, ES);
+    UpdateSegmentBase(&start, SS);
+    UpdateSegmentBase(&start, DS);
+
+    clocks = 0;
+    instructionsRetired = 0;
+    memset(memory + BENCH_DATA_BASE, 0, 0x10000);
+
+    u64 result = 0;
+    u32 chunkStart = 0;
+    for(u32 chunkIndex = 0; chunkIndex < stream->chunkCount; ++chunkIndex)
+    {
+        u8* chunk = stream->bytes + chunkStart;
+        u16 chunkSize = stream->chunkEnds[chunkIndex] - chunkStart;
 
-            result.operands[0].opCode = Register;
-            result.operands[0].regCode = regTable[wide][src];
-            result.operands[1].opCode = Register;
-            result.operands[1].regCode = regTable[wide][dest];
+        u16 offset = 0;
+        while(offset < chunkSize)
+        {
+            ip = offset;
+            Instruction instruction = DecodeInstruction(chunk);
+            offset = (u16)ip;
+
+            regs = start;
+            flags = 0;
+            halted = false;
+            clocks += HandleInstruction(&regs, instruction).clocks;
+            ++result;
         }
+        chunkStart = stream->chunkEnds[chunkIndex];
     }
 
+    ip = 0;
+    halted = false;
+    instructionsRetired = result;
     return result;
 }
 
-Instruction AddOrAdcSbbAndSubXorCmpMov(InstructionCode instCode, u8 byte1, u8 byte2, u8* buffer)
+int CompareBenchTimes(const void* a, const void* b)
 {
-    Instruction result = {};
-    result.instCode = instCode;
+    double left = *(double*)a;
+    double right = *(double*)b;
+    int result = left < right ? -1 : left > right ? 1 : 0;
+    return result;
+}
 
-    u8 dir = (byte1 >> 1) & 0b1;
-    u8 wide = (byte1 >> 0) & 0b1;
-    u8 mod = (byte2 >> 6) & 0b11;
-    u8 rom = (byte2 >> 0) & 0b111;
+BenchResult RunBenchCase(BenchCase benchCase, u32 runCount)
+{
+    BenchResult result = {};
+    snprintf(result.name, sizeof(result.name), "%s", benchCase.name);
 
-    bool mov = instCode == Mov;
-    char* literals = wide ? "word" : "byte";
-    char* op = GetInstructionCodeStr(instCode);
+    for(u32 run = 0; run < BENCH_WARMUP_RUNS; ++run)
+    {
+        benchCase.function(benchCase.stream);
+    }
 
-    if(mod == 0b00)
+    double times[BENCH_MAX_RUNS];
+    for(u32 run = 0; run < runCount; ++run)
     {
-        if(rom == 0b110)
-        {
-            u8 byte3 = buffer[ip++];
-            
-            result.operands[0].literals = literals;
+        u64 start = ReadOSTimer();
+        result.instructions = benchCase.function(benchCase.stream);
+        times[run] = (double)(ReadOSTimer() - start) / (double)OS_TIMER_FREQ;
+    }
 
-            if(!dir && wide)
-            {
-                u8 byte4 = buffer[ip++];
-                s16 data = (byte4 << 8) | byte3;
+    // Note: The spread between the 10th and 90th percentile run says how
+    // far the median can be trusted, a single outlier does not move it
+    qsort(times, runCount, sizeof(double), CompareBenchTimes);
+    result.best = times[0];
+    result.median = times[runCount / 2];
+    double spread = times[runCount * 9 / 10 < runCount ? runCount * 9 / 10 : runCount - 1] - times[runCount / 10];
+    result.spread = result.median > 0.0 ? spread / result.median : 0.0;
+    result.bytes = benchCase.function == BenchExecute ? benchCase.stream->executedBytes : benchCase.stream->size;
 
-                result.operands[0].opCode = Immediate;
-                result.operands[1].displacement = data;
-                result.operands[1].opCode = Memory;
-                result.operands[1].regCode = romTable[rom];
-            }
-            else if(dir && !wide)
-            {
-                s16 data = byte3;
+    return result;
+}
 
-                result.operands[0].opCode = Memory;
-                result.operands[0].regCode = romTable[rom];
-                result.operands[1].opCode = Immediate;
-                result.operands[1].displacement = data;
-            }
-            else
-            {
-                u8 byte4 = buffer[ip++];
-                u8 byte5 = buffer[ip++];
-                s16 data = (byte4 << 8) | byte3;
+void PrintBenchResult(BenchResult result)
+{
+    fprintf(output, "%-14s %9llu bytes %9llu instructions  median %8.3fms best %8.3fms spread %4.1f%%  %8.2fmb/s %12.0f instructions/s", 
+            result.name, (unsigned long long)result.bytes, (unsigned long long)result.instructions,
+            1000.0 * result.median, 1000.0 * result.best, 100.0 * result.spread,
+            (double)result.bytes / (1024.0 * 1024.0) / result.median, (double)result.instructions / result.median);
+}
 
-                result.operands[0].opCode = Immediate;
-                result.operands[0].displacement = data;
-                result.operands[1].opCode = Immediate;
-                result.operands[1].displacement = byte5;
-            }
+// Note: One line per case, name then median seconds
+u32 LoadBenchBaseline(char* fileName, BenchResult* baseline)
+{
+    u32 result = 0;
+
+    FILE* file = fopen(fileName, "r");
+    if(file)
+    {
+        while(result < BENCH_MAX_BASELINE && fscanf(file, "%31s %lf", baseline[result].name, &baseline[result].median) == 2)
+        {
+            ++result;
         }
-        else
-        {   
-            u8 byte3 = buffer[ip++];
-            s16 data = 0;
+        fclose(file);
+    }
 
-            int movTarget = mov ? 1 : 0;
-            result.operands[0].opCode = Memory;
-            result.operands[0].regCode = romTable[rom];
-            result.operands[1].opCode = Immediate;
-            result.operands[movTarget].literals = literals;
+    return result;
+}
 
-            if(!dir && wide)
-            {
-                u8 byte4 = buffer[ip++];
-                data = (byte4 << 8) | byte3;
-            }
-            else
-            {
-                data = byte3;
-            }
+// Note: Returns false when a case got slower than the baseline by more than
+// BENCH_TOLERANCE plus its spread
+bool RunBenchmarks(u32 runCount, char* saveFile, char* baselineFile)
+{
+    runCount = runCount < 1 ? 1 : runCount > BENCH_MAX_RUNS ? BENCH_MAX_RUNS : runCount;
 
-            result.operands[1].displacement = data;
-        }
+    FILE* reportOutput = output;
+    output = fopen("/dev/null", "w");
+
+    BenchStream* sweep = AllocateBenchStream();
+    BenchStream* mix = AllocateBenchStream();
+    BenchStream* program = AllocateBenchStream();
+    BuildOpcodeSweep(sweep);
+    BuildRealisticMix(mix, program);
+
+    BenchCase cases[] = 
+    {
+        { "sweep-decode", sweep, BenchDecode },
+        { "sweep-print", sweep, BenchDecodePrint },
+        { "sweep-execute", sweep, BenchExecuteSweep },
+        { "mix-decode", mix, BenchDecode },
+        { "mix-print", mix, BenchDecodePrint },
+        { "mix-execute", program, BenchExecute },
+    };
+    u32 caseCount = sizeof(cases) / sizeof(cases[0]);
+
+    BenchResult results[16];
+    for(u32 caseIndex = 0; caseIndex < caseCount; ++caseIndex)
+    {
+        results[caseIndex] = RunBenchCase(cases[caseIndex], runCount);
     }
-    else if(mod == 0b01)
+
+    fclose(output);
+    output = reportOutput;
+
+    BenchResult baseline[BENCH_MAX_BASELINE];
+    u32 baselineCount = baselineFile ? LoadBenchBaseline(baselineFile, baseline) : 0;
+    if(baselineFile && !baselineCount)
     {
-        s16 data = 0;
+        fprintf(output, "Cannot load baseline %s\n", baselineFile);
+    }
 
-        result.operands[0].opCode = Memory;
-        result.operands[0].regCode = romTable[rom];
-        result.operands[1].opCode = Immediate;
+    fprintf(output, "%llu sweep forms, %llu mix instructions, %u runs after %u warmup runs\n\n", 
+            (unsigned long long)sweep->instructionCount, (unsigned long long)program->instructionCount, runCount, BENCH_WARMUP_RUNS);
 
-        if(mov)
-        {
-            s8 displacement = buffer[ip++];
-            data = buffer[ip++];
+    bool result = true;
+    for(u32 caseIndex = 0; caseIndex < caseCount; ++caseIndex)
+    {
+        BenchResult current = results[caseIndex];
+        PrintBenchResult(current);
 
-            result.operands[0].displacement = displacement;
-            result.operands[1].literals = literals;
-        }
-        else
+        for(u32 baselineIndex = 0; baselineIndex < baselineCount; ++baselineIndex)
         {
-            u8 byte3 = buffer[ip++];
-            u8 byte4 = buffer[ip++];
-            u8 byte5 = buffer[ip++];
-            s16 displacement = (byte4 << 8) | byte3;
-
-            data = byte5;
-            if(wide)
+            if(strcmp(baseline[baselineIndex].name, current.name) == 0 && baseline[baselineIndex].median > 0.0)
             {
-                u8 byte6 = buffer[ip++];
-                data = (byte6 << 8) | byte5;
+                // Note: A noisy run widens the margin by its own spread
+                double change = current.median / baseline[baselineIndex].median - 1.0;
+                double margin = BENCH_TOLERANCE + current.spread;
+                bool slower = change > margin;
+                fprintf(output, "  %+6.1f%% %s", 100.0 * change, 
+                        slower ? "slower" : change < -margin ? "faster" : "same");
+                result = result && !slower;
             }
-
-            result.operands[0].displacement = displacement;
-            result.operands[0].literals = literals;
         }
-
-        result.operands[1].displacement = data;
-
+        fprintf(output, "\n");
     }
-    else if(mod == 0b10)
-    {
-        u8 byte3 = buffer[ip++];
-        u8 byte4 = buffer[ip++];
-        u8 byte5 = buffer[ip++];
-
-        s16 displacement = (byte4 << 8) | byte3;
-        s16 data = byte5;
 
-        result.operands[0].opCode = Memory;
-        result.operands[0].regCode = romTable[rom];
-        result.operands[0].displacement = displacement;
-        result.operands[1].opCode = Immediate;
-
-        if(mov)
+    if(saveFile)
+    {
+        FILE* file = fopen(saveFile, "w");
+        if(file)
         {
-            if(wide)
+            for(u32 caseIndex = 0; caseIndex < caseCount; ++caseIndex)
             {
-                u8 byte6 = buffer[ip++];
-                data = (byte6 << 8) | byte5;
+                fprintf(file, "%s %.9f\n", results[caseIndex].name, results[caseIndex].median);
             }
-
-            result.operands[1].literals = literals;
+            fclose(file);
         }
         else
         {
-            result.operands[0].literals = literals;
+            fprintf(output, "Cannot write baseline %s\n", saveFile);
         }
-
-        result.operands[1].displacement = data;
     }
-    else if(mod == 0b11)
-    {
-        u8 byte3 = buffer[ip++];
-        s16 data = byte3;
 
-        if(!dir && wide)
-        {
-            u8 byte4 = buffer[ip++];
-            data = (byte4 << 8) | byte3;
-        }
-
-        result.operands[0].opCode = Memory;
-        result.operands[0].regCode = regTable[wide][rom];
-        result.operands[1].opCode = Immediate;
-        result.operands[1].displacement = data;
-    }
+    free(sweep->bytes);
+    free(mix->bytes);
+    free(program->bytes);
+    free(sweep);
+    free(mix);
+    free(program);
 
     return result;
 }
-  
+
 int main(int argc, char **argv) 
 {
-    if(argc == 0)
-    {
-        printf("No input file specified\n");
-        return 0;
-    }
+    u64 profileStart = ReadCPUTimer();
+    u64 instructionCount = 0;
+
+    output = stdout;
+    memory = calloc(MEMORY_SIZE, 1);
 
     char* targetFile = 0;
-    bool executionMode = false;
-    if(argc == 3)
+    char* selfTestDirectory = 0;
+    bool benchMode = false;
+    u32 benchRuns = BENCH_DEFAULT_RUNS;
+    char* benchSaveFile = 0;
+    char* benchBaselineFile = 0;
+    char* positionalArgs[argc];
+    int positionalCount = 0;
+    RunOptions options = {};
+    bool verifyMode = false;
+    bool validateMode = false;
+    char* shareName = 0;
+    u64 shareInterval = 0;
+    bool shareMemory = false;
+    char* monitorName = 0;
+    u32 monitorMilliseconds = 100;
+    bool cfgMode = false;
+    bool branchMode = false;
+    char* prefetchCpu = 0;
+    bool timerMode = false;
+    bool memoMode = false;
+    bool fastLoopMode = false;
+    bool predecodeMode = false;
+    u32 timerReload = 0;
+    CacheLevel cacheLevels[MAX_CACHE_LEVELS];
+    u32 cacheLevelCount = 0;
+    u32 memoryLatency = DEFAULT_MEMORY_LATENCY;
+    bool showStats = false;
+    DumpRegion dumpRegions[MAX_DUMP_REGIONS];
+    int dumpCount = 0;
+    char* diffFiles[2] = {};
+    char* diffInputFile = 0;
+    DiffRange diffRanges[MAX_DIFF_RANGES];
+    u32 diffRangeCount = 0;
+    for(int argIndex = 1; argIndex < argc; ++argIndex)
     {
-        char* mode = argv[1];
-        if(strcmp(mode, "-exec") == 0)
+        char* arg = argv[argIndex];
+        if(strcmp(arg, "-exec") == 0)
         {
-            executionMode = true;
-            targetFile = argv[2];
+            options.executionMode = true;
         }
-        else
+        else if(strcmp(arg, "-clocks") == 0)
         {
-            printf("Unknown command %s\n", mode);
-            return 0;
+            options.executionMode = true;
+            options.showClocks = true;
         }
-    }
-    else
-    {
-        targetFile = argv[1];
-    }
-
-    FILE* file = fopen(targetFile, "r");
-    if(!file)
-    {
-        printf("Cannot open file %s\n", targetFile);
-        return 0;
-    }
-
-    fseek(file, 0, SEEK_END);
-    u32 fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    u8* buffer = malloc(fileSize);
-    int count = fread(buffer, sizeof(char), fileSize, file);
-    fclose(file);
-
-    if(executionMode)
-    {
-        fprintf(stdout, "--- test\\%s execution ---\n", targetFile);
-    }
-    else
-    {
-        fprintf(stdout, "bits 16\n\n");
-    }
-        
-    while(ip < fileSize)
-    {
-        s16 prevIp = ip;
-
-        Instruction instruction = {};
-
-        u8 byte1 = buffer[ip++];
-        u8 byte2 = buffer[ip++];
-
-        LOG("0x%x\n", byte1);
-        LOG("byte1 %c%c%c%c%c%c%c%c\n", BYTE_TO_BINARY(byte1));
-        LOG("byte2 %c%c%c%c%c%c%c%c\n", BYTE_TO_BINARY(byte2));
-
-        // Note: https://edge.edx.org/c4x/BITSPilani/EEE231/asset/8086_family_Users_Manual_1_.pdf
-        // Intel manual 8086 guide -- Machine Instruction Decoding Guide
-        //
-        // Byte 1     | Byte 2      | Byte 3            | Byte 4            | Byte 5        | Byte 6
-        // OPCODE_D_W | MOD_REG_RM  | LOD DISP / Data   | HI DISP / DATA    | LOW DATA      | HI DATA 
-        // 000000_0_0 | 00_000_000
-        //
-        // MOD :
-        // 00 Memory mode no displacement (When R/M 110 16 bit displacement follows)
-        // 01 Memory mode 8 bit displacement
-        // 10 Memory mode 16 bit displacement
-        // 11 Register mode no displacement
-
-        switch(byte1)
-        {
-        case 0x00:
-        case 0x01:
-        case 0x02:
-        case 0x03:
-        case 0x04:
-        case 0x05:
-        {
-            u8 wide = (byte1 >> 0) & 0b1;
-            u8 reg = (byte2 >> 3) & 0b111;
-            u8 imm = (byte1 >> 2) & 0b1;
-            if(imm == 0b1)
-            {
-                reg = 0;
-            }
-            instruction = RegRom(Add, byte1, byte2, buffer, wide, reg, imm);
-        } break;
-
-        case 0x28:
-        case 0x29:
-        case 0x2a:
-        case 0x2b:
-        case 0x2c:
-        case 0x2d:
+        else if(strcmp(arg, "-stats") == 0)
+        {
+            showStats = true;
+        }
+        else if(strcmp(arg, "-dump") == 0 && argIndex + 1 < argc)
         {
-            u8 wide = (byte1 >> 0) & 0b1;
-            u8 reg = (byte2 >> 3) & 0b111;
-            u8 imm = (byte1 >> 2) & 0b1;
-            if(imm == 0b1)
+            char* spec = argv[++argIndex];
+            if(dumpCount == MAX_DUMP_REGIONS || !ParseDumpRegion(spec, &dumpRegions[dumpCount]))
             {
-                reg = 0;
+                printf("Invalid dump %s\n", spec);
+                return 0;
             }
-            instruction = RegRom(Sub, byte1, byte2, buffer, wide, reg, imm);
-        } break;
-
-        case 0x38:
-        case 0x39:
-        case 0x3a:
-        case 0x3b:
-        case 0x3c:
-        case 0x3d:
+            ++dumpCount;
+        }
+        else if(strcmp(arg, "-break") == 0 && argIndex + 1 < argc)
+        {
+            u32 address = strtoul(argv[++argIndex], 0, 0) & (MEMORY_SIZE - 1);
+            BITMAP_SET(breakpointBitmap, address);
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-watch") == 0 && argIndex + 1 < argc)
         {
-            u8 wide = (byte1 >> 0) & 0b1;
-            u8 reg = (byte2 >> 3) & 0b111;
-            u8 imm = (byte1 >> 2) & 0b1;
-            if(imm == 0b1)
+            // Note: start or start:size
+            char* end = 0;
+            u32 address = strtoul(argv[++argIndex], &end, 0);
+            u32 size = *end == ':' ? strtoul(end + 1, 0, 0) : 1;
+            for(u32 index = 0; index < size && index < MEMORY_SIZE; ++index)
             {
-                reg = 0;
+                BITMAP_SET(watchpointBitmap, (address + index) & (MEMORY_SIZE - 1));
             }
-            instruction = RegRom(Cmp, byte1, byte2, buffer, wide, reg, imm);
-        } break;
-
-        case 0x70:
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-back") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jo;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x71:
+            options.stepBack = strtoull(argv[++argIndex], 0, 0);
+            options.executionMode = true;
+            options.reverse = true;
+        }
+        else if(strcmp(arg, "-rewind") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jno;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x72:
+            u32 address = strtoul(argv[++argIndex], 0, 0) & (MEMORY_SIZE - 1);
+            BITMAP_SET(rewindBitmap, address);
+            options.executionMode = true;
+            options.reverse = true;
+            options.rewind = true;
+        }
+        else if(strcmp(arg, "-quiet") == 0)
         {
-            instruction.instCode = Jb;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x73:
+            options.quiet = true;
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-max") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jnb;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x74:
+            options.maxInstructions = strtoull(argv[++argIndex], 0, 0);
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-sample") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Je;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x75:
+            options.filter.sampleInterval = strtoull(argv[++argIndex], 0, 0);
+            options.filter.active = true;
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-trace-ip") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jne;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x76:
+            // Note: start:end, both inclusive
+            char* end = 0;
+            options.filter.ipStart = strtoul(argv[++argIndex], &end, 0);
+            options.filter.ipEnd = *end == ':' ? strtoul(end + 1, 0, 0) : options.filter.ipStart;
+            options.filter.ipRange = true;
+            options.filter.active = true;
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-trace-op") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jbe;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x77:
+            char* name = argv[++argIndex];
+            u64 codes = ParseTraceCodes(name);
+            if(!codes)
+            {
+                printf("Unknown instruction or class %s\n", name);
+                return 0;
+            }
+            options.filter.codes |= codes;
+            options.filter.active = true;
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-trace-reg") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jnbe;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x78:
+            char* name = argv[++argIndex];
+            options.filter.regCode = ParseRegisterCode(name);
+            if(!options.filter.regCode)
+            {
+                printf("Unknown register %s\n", name);
+                return 0;
+            }
+            options.filter.active = true;
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-trace-mem") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Js;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x79:
+            // Note: start[:size], same as -watch
+            char* end = 0;
+            options.filter.memoryStart = strtoul(argv[++argIndex], &end, 0);
+            u32 size = *end == ':' ? strtoul(end + 1, 0, 0) : 1;
+            options.filter.memoryEnd = options.filter.memoryStart + (size ? size : 1) - 1;
+            options.filter.memoryRange = true;
+            options.filter.active = true;
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-cache") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jns;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x7a:
+            char* spec = argv[++argIndex];
+            if(cacheLevelCount == MAX_CACHE_LEVELS || !ParseCacheLevel(spec, &cacheLevels[cacheLevelCount]))
+            {
+                printf("Invalid cache level %s\n", spec);
+                return 0;
+            }
+            ++cacheLevelCount;
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-memory-latency") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jp;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x7b:
+            memoryLatency = strtoul(argv[++argIndex], 0, 0);
+        }
+        else if(strcmp(arg, "-branches") == 0)
         {
-            instruction.instCode = Jnp;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x7c:
+            branchMode = true;
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-prefetch") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jl;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x7d:
+            prefetchCpu = argv[++argIndex];
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-timer") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jnl;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x7e:
+            timerReload = strtoul(argv[++argIndex], 0, 0);
+            timerMode = true;
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-key") == 0 && argIndex + 1 < argc)
         {
-            instruction.instCode = Jle;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x7f:
+            char* spec = argv[++argIndex];
+            if(!ScheduleKey(spec))
+            {
+                printf("Invalid key %s\n", spec);
+                return 0;
+            }
+            options.executionMode = true;
+        }
+        else if(strcmp(arg, "-memo") == 0)
         {
-            instruction.instCode = Jnle;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
-
-        case 0x80:
-        case 0x81:
-        case 0x82:
-        case 0x83:
+            memoMode = true;
+            options.executionMode = true;
+            options.quiet = true;
+        }
+        else if(strcmp(arg, "-fast-loops") == 0)
         {
-            InstructionCode instructionCodes[8] = { Add, Or, Adc, Sbb, And, Sub, Xor, Cmp };
-            u8 instructionCodeIndex = (byte2 >> 3) & 0b111;
-            InstructionCode instructionCode = instructionCodes[instructionCodeIndex];
-
-            instruction = AddOrAdcSbbAndSubXorCmpMov(instructionCode, byte1, byte2, buffer);
+            fastLoopMode = true;
+            options.executionMode = true;
+            options.quiet = true;
         }
-        break;
-
-        case 0x88:
-        case 0x89:
-        case 0x8a:
-        case 0x8b:
-        case 0x8c:
+        else if(strcmp(arg, "-pipeline") == 0)
         {
-            u8 wide = (byte1 >> 0) & 0b1;
-            u8 reg = (byte2 >> 3) & 0b111;
-            u8 imm = 0;
-            instruction = RegRom(Mov, byte1, byte2, buffer, wide, reg, imm);
-        } break;
-
-        case 0xa0:
-        case 0xa1:
-        case 0xa2:
-        case 0xa3:
+            // Note: optional formatter thread count
+            options.pipeline = true;
+            if(argIndex + 1 < argc && argv[argIndex + 1][0] >= '0' && argv[argIndex + 1][0] <= '9')
+            {
+                options.formatterCount = strtoul(argv[++argIndex], 0, 0);
+            }
+        }
+        else if(strcmp(arg, "-verify") == 0)
         {
-            char* op = GetInstructionCodeStr(Mov);
-            u8 dir = (byte1 >> 1) & 0b1;
-            u8 wide = (byte1 >> 0) & 0b1;
-            u8 reg = 0;
-
-            s16 data = byte2;
-
-            if(wide)
+            verifyMode = true;
+        }
+        else if(strcmp(arg, "-cfg") == 0)
+        {
+            cfgMode = true;
+        }
+        else if(strcmp(arg, "-share") == 0 && argIndex + 1 < argc)
+        {
+            // Note: optional instruction interval
+            shareName = argv[++argIndex];
+            if(argIndex + 1 < argc && argv[argIndex + 1][0] >= '0' && argv[argIndex + 1][0] <= '9')
             {
-                u8 byte3 = buffer[ip++];
-                data = (byte3 << 8) | byte2;
+                shareInterval = strtoull(argv[++argIndex], 0, 0);
             }
-            
-            instruction.instCode = Mov;
-                                          
-            if(dir)
+        }
+        else if(strcmp(arg, "-share-memory") == 0)
+        {
+            shareMemory = true;
+        }
+        else if(strcmp(arg, "-monitor") == 0 && argIndex + 1 < argc)
+        {
+            // Note: optional poll interval in milliseconds
+            monitorName = argv[++argIndex];
+            if(argIndex + 1 < argc && argv[argIndex + 1][0] >= '0' && argv[argIndex + 1][0] <= '9')
             {
-                instruction.operands[0].opCode = Immediate;
-                instruction.operands[0].displacement = data;
-                instruction.operands[1].opCode = Register;
-                instruction.operands[1].regCode = regTable[wide][reg];
+                monitorMilliseconds = strtoul(argv[++argIndex], 0, 0);
             }
-            else
+        }
+        else if(strcmp(arg, "-predecode") == 0)
+        {
+            predecodeMode = true;
+        }
+        else if(strcmp(arg, "-validate") == 0)
+        {
+            validateMode = true;
+        }
+        else if(strcmp(arg, "-bench") == 0)
+        {
+            // Note: optional run count
+            benchMode = true;
+            if(argIndex + 1 < argc && argv[argIndex + 1][0] >= '0' && argv[argIndex + 1][0] <= '9')
             {
-                instruction.operands[0].opCode = Register;
-                instruction.operands[0].regCode = regTable[wide][reg];
-                instruction.operands[1].opCode = Immediate;
-                instruction.operands[1].displacement = data;
+                benchRuns = strtoul(argv[++argIndex], 0, 0);
             }
-        } break;
+        }
+        else if(strcmp(arg, "-bench-save") == 0 && argIndex + 1 < argc)
+        {
+            benchSaveFile = argv[++argIndex];
+            benchMode = true;
+        }
+        else if(strcmp(arg, "-bench-baseline") == 0 && argIndex + 1 < argc)
+        {
+            benchBaselineFile = argv[++argIndex];
+            benchMode = true;
+        }
+        else if(strcmp(arg, "-selftest") == 0 && argIndex + 1 < argc)
+        {
+            selfTestDirectory = argv[++argIndex];
+        }
+        else if(strcmp(arg, "-diff") == 0 && argIndex + 2 < argc)
+        {
+            diffFiles[0] = argv[++argIndex];
+            diffFiles[1] = argv[++argIndex];
+        }
+        else if(strcmp(arg, "-diff-inputs") == 0 && argIndex + 1 < argc)
+        {
+            diffInputFile = argv[++argIndex];
+        }
+        else if(strcmp(arg, "-diff-range") == 0 && argIndex + 1 < argc)
+        {
+            char* spec = argv[++argIndex];
+            if(diffRangeCount == MAX_DIFF_RANGES || !ParseDiffRange(spec, &diffRanges[diffRangeCount]))
+            {
+                printf("Invalid range %s\n", spec);
+                return 0;
+            }
+            ++diffRangeCount;
+        }
+        else if(arg[0] == '-')
+        {
+            printf("Unknown command %s\n", arg);
+            return 0;
+        }
+        else
+        {
+            targetFile = arg;
+            positionalArgs[positionalCount++] = arg;
+        }
+    }
 
-        case 0xb0:
-        case 0xb1:
-        case 0xb2:
-        case 0xb3:
-        case 0xb4:
-        case 0xb5:
-        case 0xb6:
-        case 0xb7:
-        case 0xb8:
-        case 0xb9:
-        case 0xba:
-        case 0xbb:
-        case 0xbc:
-        case 0xbd:
-        case 0xbe:
-        case 0xbf:
-        {
-            u8 wide = (byte1 >> 3) & 0b1;
-            u8 reg = (byte1 >> 0) & 0b111;
-            u8 imm = 1;
-            instruction = RegRom(Mov, byte1, byte2, buffer, wide, reg, imm);
-        } break;
+    if(benchMode)
+    {
+        bool passed = RunBenchmarks(benchRuns, benchSaveFile, benchBaselineFile);
+        return passed ? 0 : 1;
+    }
 
-        case 0xc6:
-        case 0xc7:
-        {
-            instruction = AddOrAdcSbbAndSubXorCmpMov(Mov, byte1, byte2, buffer);
-        } break;
+    if(monitorName)
+    {
+        bool monitored = MonitorLiveState(monitorName, monitorMilliseconds);
+        return monitored ? 0 : 1;
+    }
 
-        case 0xe0:
-        {
-            instruction.instCode = Loopne;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
+    if(validateMode)
+    {
+        bool passed = ValidateDecoder();
+        return passed ? 0 : 1;
+    }
 
-        case 0xe1:
-        {
-            instruction.instCode = Loope;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
+    if(selfTestDirectory)
+    {
+        bool passed = RunSelfTest(selfTestDirectory, positionalArgs, positionalCount);
+        return passed ? 0 : 1;
+    }
 
-        case 0xe2:
-        {
-            instruction.instCode = Loop;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
+    if(diffFiles[0])
+    {
+        bool same = RunDifferential(diffFiles[0], diffFiles[1], diffInputFile, 
+                                    diffRanges, diffRangeCount, options.maxInstructions);
+        return same ? 0 : 1;
+    }
 
-        case 0xe3:
-        {
-            instruction.instCode = Jcxz;
-            instruction.operands[0].displacement = (s8)byte2 + 2;
-            instruction.operands[0].regCode = IP;
-        } break;
+    if(!targetFile)
+    {
+        printf("No input file specified\n");
+        return 0;
+    }
+
+    if(verifyMode)
+    {
+        bool passed = VerifyFile(targetFile);
+        return passed ? 0 : 1;
+    }
 
+    profiling = showStats;
+    TIME_BLOCK_BEGIN(ProfilePhase_Load);
 
-        default: 
-        {
-            printf("0x%x unimplemented\n", byte1);
-        } break;
+    u32 programSize = 0;
+    options.untilExit = IsComFile(targetFile) && !cfgMode;
+    bool loaded = options.untilExit ? 
+        LoadComProgram(targetFile, &programSize) : LoadProgram(targetFile, &programSize);
+    if(!loaded)
+    {
+        printf("Cannot load file %s\n", targetFile);
+        return 0;
+    }
 
-        }
+    TIME_BLOCK_END(ProfilePhase_Load, programSize);
+
+    if(cfgMode)
+    {
+        DisassembleRecursive(programSize);
+        return 0;
+    }
 
-        Operand leftOperand = instruction.operands[0];
-        Operand rightOperand = instruction.operands[1];
+    if(cacheLevelCount)
+    {
+        EnableCacheModel(cacheLevels, cacheLevelCount, memoryLatency);
+    }
 
-        char* leftOperandStr = GetRegCodeStr(leftOperand.regCode);
-        char* rightOperandStr = GetRegCodeStr(rightOperand.regCode);
+    if(branchMode)
+    {
+        EnableBranchStats();
+    }
 
-        if(executionMode)
-        {
-            HandleInstructionResult instructionResult = HandleInstruction(&regs, instruction.instCode, leftOperand, rightOperand);
-            s16 prevFlags = instructionResult.prevFlags;
+    if(prefetchCpu && !EnablePrefetchQueue(prefetchCpu))
+    {
+        printf("Unknown cpu %s, use 8086 or 8088\n", prefetchCpu);
+        return 0;
+    }
 
-            PrintInstruction(instruction.instCode, leftOperand, rightOperand);
+    if(timerMode)
+    {
+        EnableTimer(timerReload);
+    }
 
-            char *regCode = GetRegCodeStr(leftOperand.regCode);
-            fprintf(stdout, "; %s:0x%04hx->0x%04hx ip:0x%04hx->0x%04hx", 
-                    regCode, 
-                    instructionResult.regBefore, 
-                    instructionResult.regAfter,
-                    prevIp,
-                    ip);
+    if(memoMode)
+    {
+        EnableMemoizer();
+    }
 
-            if(prevFlags != flags)
-            {
-                fprintf(stdout, " flags:");
+    if(fastLoopMode)
+    {
+        EnableLoopAccelerator();
+    }
 
-                for(int index = 0; index < FLAGS_COUNT; ++index)
-                {
-                    int bitVal = 1 << index;
-                    bool bitPreviouslySet = prevFlags & bitVal;
-                    bool bitCleared = (flags & bitVal) == 0;
-                    if(bitPreviouslySet && bitCleared)
-                    {
-                        char* flagStr = GetFlagsStr(bitVal);
-                        fprintf(stdout, "%s", flagStr);
-                    }
-                }
+    if(predecodeMode)
+    {
+        EnableDecodedProgram(programSize);
+    }
 
-                fprintf(stdout, "->");
+    if(shareName && !EnableLiveState(shareName, shareInterval, shareMemory))
+    {
+        printf("Cannot share state as %s\n", shareName);
+        return 0;
+    }
 
-                for(int index = 0; index < FLAGS_COUNT; ++index)
-                {
-                    int bitVal = 1 << index;
-                    bool bitPreviouslyUnset = (prevFlags & bitVal) == 0;
-                    bool bitNowSet = flags & bitVal;
-                    if(bitPreviouslyUnset && bitNowSet)
-                    {
-                        char* flagStr = GetFlagsStr(bitVal);
-                        fprintf(stdout, "%s", flagStr);
-                    }
-                }
-            }
+    instructionCount = RunProgram(targetFile, programSize, options);
 
-            fprintf(stdout, "\n");
-        }
-        else
+    for(int dumpIndex = 0; dumpIndex < dumpCount; ++dumpIndex)
+    {
+        DumpRegion region = dumpRegions[dumpIndex];
+        if(!DumpMemory(region))
         {
-            PrintInstruction(instruction.instCode, leftOperand, rightOperand);
-            fprintf(stdout, "\n");
+            printf("Cannot write dump %s\n", region.fileName);
         }
     }
 
-    if(executionMode)
+    if(showStats)
     {
-        fprintf(stdout, "\nFinal registers:\n");
-        PrintRegister(&regs, AX);
-        PrintRegister(&regs, BX);
-        PrintRegister(&regs, CX);
-        PrintRegister(&regs, DX);
-        PrintRegister(&regs, SP);
-        PrintRegister(&regs, BP);
-        PrintRegister(&regs, SI);
-        PrintRegister(&regs, DI);
-        fprintf(stdout, "%10s: 0x%04hx (%d)\n", "ip", ip, (u16)ip);
-        fprintf(stdout, "%10s: ", "flags");
-        for(int index = 0; index < FLAGS_COUNT; ++index)
-        {
-            int bitVal = 1 << index;
-            bool bitSet = flags & bitVal;
-            if(bitSet)
-            {
-                char* flagStr = GetFlagsStr(bitVal);
-                fprintf(stdout, "%s", flagStr);
-            }
-        }
-        fprintf(stdout, "\n");
+        TIME_BLOCK_BEGIN(ProfilePhase_Output);
+        fflush(output);
+        TIME_BLOCK_END(ProfilePhase_Output, 0);
+
+        PrintProfile(ReadCPUTimer() - profileStart, instructionCount);
     }
 
     return 0;